@@ -1,5 +1,5 @@
 
 from . import _init_mindsensors
 
-from ._mindsensors import CANLight
-__all__ = ["CANLight"]
\ No newline at end of file
+from ._mindsensors import CANLight, LightSequence
+__all__ = ["CANLight", "LightSequence"]
\ No newline at end of file
@@ -0,0 +1,135 @@
+"""
+asyncio support for CANLight.
+
+Constructing a CANLight, reading its metadata and discovering devices all
+wait on the CAN bus. The coroutines here run that work on a background C++
+thread and wake the event loop when it is done, so the loop keeps running in
+the meantime::
+
+    from mindsensors import aio
+
+    ids = await aio.discover()
+    light = await aio.create(ids[0])
+    await aio.refresh_info(light)
+    volts = await aio.battery_voltage(light)
+
+Importing this module also adds ``CANLight.create(id)``,
+``light.refresh_info()`` and ``light.battery_voltage()``, which are awaited
+the same way.
+
+Commands such as ``showRGB`` never wait on the bus and can be called directly
+from a coroutine.
+"""
+
+import asyncio
+import threading
+import typing
+
+from ._mindsensors import CANLight, CANLightRequests
+
+__all__ = ["create", "refresh_info", "battery_voltage", "discover"]
+
+# seconds between checks on platforms where the engine has no notifier
+_POLL_PERIOD = 0.01
+
+# Event loops in different threads share the engine's notifier, so a loop may
+# take completions meant for another; these tables are only touched under _lock.
+_lock = threading.Lock()
+# request number -> future waiting for it
+_pending: typing.Dict[int, asyncio.Future] = {}
+# completions taken before their request reached _pending
+_unclaimed: typing.Dict[int, typing.Any] = {}
+# loops currently watching the notifier, with the number of requests each awaits
+_watching: typing.Dict[asyncio.AbstractEventLoop, int] = {}
+
+
+def _dispatch() -> None:
+    # completions may belong to futures of other loops, so hand each to its own
+    for completion in CANLightRequests.takeCompletions():
+        with _lock:
+            future = _pending.pop(completion.request, None)
+            if future is None:
+                _unclaimed[completion.request] = completion
+        if future is not None:
+            future.get_loop().call_soon_threadsafe(_resolve, future, completion)
+
+
+def _resolve(future: asyncio.Future, completion) -> None:
+    loop = future.get_loop()
+    with _lock:
+        _watching[loop] -= 1
+        stop_watching = _watching[loop] == 0
+        if stop_watching:
+            del _watching[loop]
+    if stop_watching:
+        fd = CANLightRequests.getNotifier()
+        if fd >= 0:
+            loop.remove_reader(fd)
+
+    if future.cancelled():
+        return
+    if completion.error:
+        future.set_exception(RuntimeError(completion.error))
+    else:
+        future.set_result(completion)
+
+
+def _poll(loop: asyncio.AbstractEventLoop) -> None:
+    _dispatch()
+    with _lock:
+        watching = loop in _watching
+    if watching:
+        loop.call_later(_POLL_PERIOD, _poll, loop)
+
+
+async def _submit(request: int):
+    loop = asyncio.get_running_loop()
+    future = loop.create_future()
+
+    with _lock:
+        start_watching = loop not in _watching
+        if start_watching:
+            _watching[loop] = 0
+        _watching[loop] += 1
+        completion = _unclaimed.pop(request, None)
+        if completion is None:
+            _pending[request] = future
+    if start_watching:
+        fd = CANLightRequests.getNotifier()
+        if fd >= 0:
+            loop.add_reader(fd, _dispatch)
+        else:
+            loop.call_later(_POLL_PERIOD, _poll, loop)
+    if completion is not None:
+        _resolve(future, completion)
+
+    # the request keeps running if the caller is cancelled; its result is dropped
+    return await future
+
+
+async def create(device_number: int) -> CANLight:
+    """Construct a CANLight without blocking the event loop."""
+    completion = await _submit(CANLightRequests.create(device_number))
+    return completion.light
+
+
+async def refresh_info(light: CANLight) -> None:
+    """Read the light's name, versions and serial number from the device again."""
+    await _submit(CANLightRequests.refreshInfo(light))
+
+
+async def battery_voltage(light: CANLight) -> float:
+    """The battery voltage measured by the light."""
+    completion = await _submit(CANLightRequests.batteryVoltage(light))
+    return completion.voltage
+
+
+async def discover(timeout: float = 0.1) -> typing.List[int]:
+    """IDs of the CANLights that answer within ``timeout`` seconds."""
+    completion = await _submit(CANLightRequests.discover(timeout))
+    return list(completion.deviceIDs)
+
+
+CANLight.create = staticmethod(create)
+CANLight.refresh_info = refresh_info
+CANLight.battery_voltage = battery_voltage
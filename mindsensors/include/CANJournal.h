@@ -0,0 +1,81 @@
+#pragma once
+
+#include "CANTransport.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace mindsensors {
+
+/*
+ * Journal file layout, in native byte order: a JournalHeader followed by
+ * `capacity` JournalRecords. Record n is kept in slot n % capacity, so the
+ * file always holds the most recent `capacity` frames.
+ */
+struct JournalHeader {
+    char magic[8];               // "MSCANJNL"
+    uint32_t version;            // 1
+    uint32_t recordSize;         // sizeof(JournalRecord)
+    uint64_t capacity;           // number of record slots
+    std::atomic<uint64_t> next;  // number of records ever started
+    uint8_t reserved[32];
+};
+
+struct JournalRecord {
+    uint64_t timeNs;    // steady (monotonic) clock; 0 while the record is being written
+    uint32_t messageID;
+    int16_t periodMs;   // HAL send period of a sent frame, 0 for received frames
+    uint8_t direction;  // CANJournal::Direction
+    uint8_t dataSize;
+    uint8_t data[8];
+};
+
+static_assert(sizeof(JournalHeader) == 64, "journal header layout is part of the file format");
+static_assert(sizeof(JournalRecord) == 24, "journal record layout is part of the file format");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the journal counter is shared through a file mapping");
+
+/**
+ * Records mindsensors CAN traffic to a memory-mapped ring file, to reproduce
+ * glitches offline with Replay. The file is sized and mapped up front;
+ * recording a frame takes one atomic increment and a 24 byte copy, with no
+ * allocation, lock or system call. Because the ring lives in a shared file
+ * mapping, the kernel writes it out even if the robot program crashes.
+ */
+class CANJournal {
+public:
+    enum Direction : uint8_t {
+        Sent = 0,
+        Received = 1
+    };
+
+    static constexpr uint32_t kVersion = 1;
+
+    CANJournal(const char* path, uint64_t capacity, int32_t* status);
+    ~CANJournal();
+
+    CANJournal(const CANJournal&) = delete;
+    CANJournal& operator=(const CANJournal&) = delete;
+
+    // mindsensorsDriver records frames as they are sent, and received frames
+    // as getMessage reads them, not as they arrive
+    void Record(Direction direction, uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t periodMs);
+    // ask the kernel to write the ring to disk now
+    void Flush();
+
+    // Send a journal's frames through a transport, spaced as they were
+    // recorded (divided by speed). Received frames are only sent if
+    // includeReceived is set, which makes sense on a virtual SocketCAN bus
+    // with no real device attached. Periodic frames are stopped at the end.
+    // Returns the number of frames sent.
+    static size_t Replay(const char* path, CANTransport& transport, bool includeReceived, double speed, int32_t* status);
+
+private:
+    JournalHeader* m_header = nullptr;
+    JournalRecord* m_records = nullptr;
+    uint64_t m_capacity = 0;
+    size_t m_mappedSize = 0;
+};
+
+} // namespace mindsensors
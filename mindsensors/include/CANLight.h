@@ -1,21 +1,139 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <frc/util/Color8Bit.h>
 
 namespace mindsensors {
 
 class CANLight {
 public:
-    static std::string GetLibraryVersion();
+    static std::string_view GetLibraryVersion();
+
+	/** Longest metadata string, plus one for the null terminator. */
+	static constexpr size_t kMetadataLength = 16;
+
+	/**
+	 * Send and receive CANLight traffic through the roboRIO HAL. This is the
+	 * default and also works in simulation.
+	 */
+	static void UseHALTransport();
+
+	/**
+	 * Send and receive CANLight traffic through a Linux SocketCAN interface
+	 * instead of the HAL, for example to drive CANLights from a coprocessor or
+	 * to test against a virtual bus. Call this before constructing any CANLight.
+	 * 
+	 * @param interfaceName The name of the SocketCAN interface, such as "can0"
+	 * or "vcan0".
+	 */
+	static void UseSocketCANTransport(const std::string& interfaceName);
+
+	/**
+	 * Limit the share of CAN bus time used by all CANLights together, so that
+	 * lighting never crowds out other devices such as motor controllers. While
+	 * the lights are over this share (measured over the last 100ms), color and
+	 * pattern changes ({@link #ShowRGB(uint8_t, uint8_t, uint8_t)},
+	 * {@link #ShowRegister(uint8_t)}, {@link #Flash(uint8_t)},
+	 * {@link #Cycle(uint8_t, uint8_t)} and {@link #Fade(uint8_t, uint8_t)}) are
+	 * held back, and only the most recent one is sent on a later call once bus
+	 * time is available. Register writes, resets and BlinkLED are not held back
+	 * for bus time, but they do wait behind a change that is, so commands
+	 * still reach the CANLight in the order they were called.
+	 * Restoring a CANLight's registers and color after it loses power also
+	 * waits for bus time.
+	 * 
+	 * @param fraction A value between 0 and 1 (inclusive). The default of 1
+	 * disables the limit.
+	 */
+	static void SetBusBudget(double fraction);
+
+	/**
+	 * @return The share of CAN bus time, between 0 and 1, used by all CANLights
+	 * over the last 100ms.
+	 */
+	static double GetBusUtilization();
+
+	/**
+	 * Start recording every frame sent to or received from CANLights, with
+	 * timestamps, to a file. The file holds the most recent frames in a ring
+	 * and is written by the operating system even if the program crashes, so
+	 * a lighting glitch or bus load spike can be examined or replayed after a
+	 * match. Recording costs a few nanoseconds per frame.
+	 * 
+	 * Frames from the CANLights are recorded as the library reads them: the
+	 * status broadcasts the presence monitor polls every 20ms, and replies to
+	 * metadata requests. A broadcast replaced by a newer one before it was
+	 * read is not recorded, so the journal can hold fewer received frames
+	 * than were on the bus.
+	 * 
+	 * @param path The file to write. An existing file is replaced.
+	 * @param capacity How many frames to keep. Each takes 24 bytes.
+	 */
+	static void StartJournal(const std::string& path, size_t capacity = 65536);
+
+	/**
+	 * Stop recording. The journal file stays on disk.
+	 */
+	static void StopJournal();
+
+	/**
+	 * Send the frames in a journal again, with their original timing, through
+	 * the current transport: the simulated HAL, or a SocketCAN interface
+	 * selected with {@link #UseSocketCANTransport(const std::string&)}. This
+	 * blocks until every frame is sent. The python -m mindsensors.replay
+	 * command runs this from the command line.
+	 * 
+	 * @param path A file written by {@link #StartJournal(const std::string&, size_t)}.
+	 * @param includeReceived Also send the frames the CANLights sent, for
+	 * example to play a whole recorded bus onto a virtual SocketCAN bus.
+	 * @param speed Playback speed; 2 replays twice as fast.
+	 * @return The number of frames sent.
+	 */
+	static size_t ReplayJournal(const std::string& path, bool includeReceived = false, double speed = 1.0);
+
+	/**
+	 * Turn timing spans on or off. Spans cover each command method, the
+	 * handle lookup, the error check, the CAN send, requests made through
+	 * CANLightRequests, and the time from a color or pattern command until
+	 * the device's next status broadcast. Tracing is off by default and
+	 * costs almost nothing while off.
+	 */
+	static void SetTraceEnabled(bool enabled);
+
+	/**
+	 * Discard the spans recorded so far.
+	 */
+	static void ClearTrace();
+
+	/**
+	 * Write the recorded spans to a file in the Chrome trace format, which can
+	 * be opened at ui.perfetto.dev or chrome://tracing.
+	 */
+	static void WriteTrace(const std::string& path);
+
+	/**
+	 * Find the CANLights connected to the CAN bus, including ones already in
+	 * use by other CANLight objects. This blocks for the whole timeout; from
+	 * Python, mindsensors.aio provides a version that can be awaited.
+	 * 
+	 * @param timeout How long to wait for replies, in seconds.
+	 * @return The IDs of the devices that answered, in increasing order.
+	 */
+	static std::vector<uint8_t> Discover(double timeout = 0.1);
 
 	/**
 	 * An instance of this object represents a single CANLight device. Multiple
 	 * devices can be used indepentently to control multiple light strips. Only a
 	 * single instance can be created for each device ID. Please construct this
 	 * object only once when initializing your robot and pass the reference around.
-	 * If you do wish to call this constructor with the same ID later, call the
-	 * destructor first.
+	 * Copies share the device, which is released when the last copy is
+	 * destroyed; only then can the same ID be constructed again.
 	 * <p>
 	 * If a CANLight does not have a CAN connection to a roboRIO, its default
 	 * behavior of {@link #Cycle(uint8_t, uint8_t) Cycle(1,7)} will be used. If it
@@ -27,6 +145,10 @@ public:
 	 * durations. Each register has a default value. The WriteRegister command can
 	 * be used to change these. The CANLight will restore its default values when
 	 * power is lost.
+	 * <p>
+	 * All methods are thread safe. Different CANLights can be controlled from
+	 * different threads, and one thread may read the battery voltage while
+	 * another sends commands, without contending on a shared lock.
 	 * 
 	 * @param deviceNumber An integer between 1 and 60 (inclusive) for the ID of
 	 * this CANLight. CAN IDs can be modified through the mindsensors
@@ -42,6 +164,11 @@ public:
 	 */
 	uint8_t GetDeviceID() const;
 
+	/*
+	 * The metadata accessors below return a copy, so they may be called from
+	 * several threads at once.
+	 */
+
 	/**
 	 * @return The name associated with this CANLight. The factory default will be
 	 * "CANLight", but this value can be changed through the mindsensors 
@@ -75,6 +202,13 @@ public:
 	 */
 	std::string GetSerialNumber() const;
 
+	/**
+	 * Read the name, versions and serial number from the device again, for
+	 * example after it was reconfigured with the mindsensors configuration tool.
+	 * This waits for the device to answer, up to about 100ms per value.
+	 */
+	void RefreshInfo();
+
 	/**
 	 * Each CANLight has a build-in LED on the board itself. This command will cause
 	 * it to blink for a specified duration. This can be useful in debugging. Please
@@ -82,8 +216,10 @@ public:
 	 * CANLight can not find a connection to the FRC driver station.
 	 * 
 	 * @param seconds The number of seconds to blink.
+	 * @return The command's sequence number, or 0 if this CANLight is disabled.
+	 * See {@link #GetCommandStatus(uint32_t)}.
 	 */
-	void BlinkLED(uint8_t seconds);
+	uint32_t BlinkLED(uint8_t seconds);
 
 	/**
 	 * Set a static color for the CANLight to display. This command will simply set
@@ -96,9 +232,11 @@ public:
 	 * of the color to show.
 	 * @param blue An integer between 0 and 255 (inclusive) for the blue component
 	 * of the color to show.
+	 * @return The command's sequence number, or 0 if this CANLight is disabled.
+	 * See {@link #GetCommandStatus(uint32_t)}.
 	 */
-	void ShowRGB(uint8_t red, uint8_t green, uint8_t blue);
-	void ShowRGB(frc::Color8Bit color);
+	uint32_t ShowRGB(uint8_t red, uint8_t green, uint8_t blue);
+	uint32_t ShowRGB(frc::Color8Bit color);
 
 	/**
 	 * Write a value in the CANLight's internal memory. The CANLight has 8 internal
@@ -119,15 +257,20 @@ public:
 	 * @param red An integer between 0 and 255 (inclusive).
 	 * @param green An integer between 0 and 255 (inclusive).
 	 * @param blue An integer between 0 and 255 (inclusive).
+	 * @return The command's sequence number, or 0 if this CANLight is disabled.
+	 * See {@link #GetCommandStatus(uint32_t)}.
 	 */
-	void WriteRegister(uint8_t index, double time, uint8_t red, uint8_t green, uint8_t blue);
-	void WriteRegister(uint8_t index, double time, frc::Color8Bit color);
+	uint32_t WriteRegister(uint8_t index, double time, uint8_t red, uint8_t green, uint8_t blue);
+	uint32_t WriteRegister(uint8_t index, double time, frc::Color8Bit color);
 
 	/**
 	 * Restore the registers to power on default. These are, in order, from index
 	 * 0 to 7: off, red, green, blue, orange, teal, purple, white.
+	 * 
+	 * @return The command's sequence number, or 0 if this CANLight is disabled.
+	 * See {@link #GetCommandStatus(uint32_t)}.
 	 */
-	void Reset();
+	uint32_t Reset();
 
 	/**
 	 * Display a stored color. As with {@link #ShowRGB(uint8_t, uint8_t, uint8_t)}
@@ -135,8 +278,10 @@ public:
 	 * 
 	 * @param index An integer between 0 and 7 (inclusive) for which register to
 	 * show.
+	 * @return The command's sequence number, or 0 if this CANLight is disabled.
+	 * See {@link #GetCommandStatus(uint32_t)}.
 	 */
-	void ShowRegister(uint8_t index);
+	uint32_t ShowRegister(uint8_t index);
 
 	/**
 	 * Flash a stored color. Lights will remain on and off for the time specified in
@@ -144,8 +289,10 @@ public:
 	 * 
 	 * @param index An integer between 0 and 7 (inclusive) for which register to
 	 * show.
+	 * @return The command's sequence number, or 0 if this CANLight is disabled.
+	 * See {@link #GetCommandStatus(uint32_t)}.
 	 */
-	void Flash(uint8_t index);
+	uint32_t Flash(uint8_t index);
 
 	/**
 	 * Cycle through a sequence of stored color values.
@@ -154,8 +301,10 @@ public:
 	 * begin the sequence at.
 	 * @param toIndex An integer between 0 and 7 (inclusive) for which register to
 	 * use as the last color in the sequence.
+	 * @return The command's sequence number, or 0 if this CANLight is disabled.
+	 * See {@link #GetCommandStatus(uint32_t)}.
 	 */
-	void Cycle(uint8_t fromIndex, uint8_t toIndex);
+	uint32_t Cycle(uint8_t fromIndex, uint8_t toIndex);
 
 	/**
 	 * Fade across a sequence of stored color values. Similar to
@@ -167,8 +316,10 @@ public:
 	 * to begin at.
 	 * @param endIndex An integer between 0 and 7 (inclusive) for which register to
 	 * end at.
+	 * @return The command's sequence number, or 0 if this CANLight is disabled.
+	 * See {@link #GetCommandStatus(uint32_t)}.
 	 */
-	void Fade(uint8_t startIndex, uint8_t endIndex);
+	uint32_t Fade(uint8_t startIndex, uint8_t endIndex);
     
 	/**
 	 * @return The voltage this CANLight device is currently receiving. A value of
@@ -178,7 +329,189 @@ public:
 	 */
     double GetBatteryVoltage() const;
 
+	/**
+	 * Keep the current color or pattern on the CAN bus. The last call to
+	 * {@link #ShowRGB(uint8_t, uint8_t, uint8_t)}, {@link #ShowRegister(uint8_t)},
+	 * {@link #Flash(uint8_t)}, {@link #Cycle(uint8_t, uint8_t)} or
+	 * {@link #Fade(uint8_t, uint8_t)} is handed to the roboRIO's CAN layer,
+	 * which sends it again every period with no further calls from the robot
+	 * loop. A CANLight that missed a frame or restarted then picks the color
+	 * up within one period. A new command replaces the repeated one.
+	 * <p>
+	 * Each repeated frame uses bus bandwidth, which counts against the limit
+	 * set with {@link #SetBusBudget(double)}. Hold mode is off by default.
+	 * 
+	 * @param period Seconds between repeats, between 0.01 and 10 (inclusive),
+	 * or 0 to stop repeating. The CANLight keeps showing its last command.
+	 */
+	void SetHoldPeriod(double period);
+
+	/**
+	 * CANLights are watched in the background. If a CANLight was not connected
+	 * when this object was constructed, or is disconnected later, it is
+	 * disabled and then automatically enabled again when it is connected, with
+	 * its name and versions read at that time. Nothing in the robot loop waits
+	 * for this to happen.
+	 * 
+	 * @return True if this CANLight is currently connected.
+	 */
+	bool IsPresent() const;
+
+	/**
+	 * Set a function to be called when this CANLight is connected or
+	 * disconnected. The function is called from a background thread, so it
+	 * should return quickly. Only one function is kept per device ID; setting
+	 * another replaces it, and an empty function removes it. It is released
+	 * along with the device, when the last copy of this CANLight is destroyed.
+	 * 
+	 * @param callback Called with true when the CANLight is connected and false
+	 * when it is disconnected.
+	 */
+	void SetPresenceCallback(std::function<void(bool present)> callback);
+
+	/**
+	 * Delivery status of the commands sent to a CANLight. Commands are numbered
+	 * in the order they are called, starting at 1.
+	 */
+	struct DeliveryReport {
+		/** Sequence number of the most recent command. */
+		uint32_t lastIssued = 0;
+		/** Sequence number of the most recent command sent on the CAN bus. */
+		uint32_t lastDelivered = 0;
+		/** Number of commands sent on the CAN bus. */
+		uint32_t delivered = 0;
+		/** Number of failed sends that were queued to try again. */
+		uint32_t retries = 0;
+		/** Number of unsent commands replaced by a newer command. */
+		uint32_t superseded = 0;
+		/** Number of commands given up on. */
+		uint32_t dropped = 0;
+		/** Number of color or pattern commands delayed by the battery governor. */
+		uint32_t throttled = 0;
+		/** Number of commands waiting to be retried or held back by the bus budget. */
+		uint32_t pending = 0;
+		/** True if the most recent color or pattern was sent and nothing is waiting. */
+		bool synchronized = false;
+		/**
+		 * True if, as well, the CANLight has broadcast its status since it
+		 * received the most recent color or pattern.
+		 */
+		bool acknowledged = false;
+	};
+
+	/**
+	 * If the CAN bus is busy, a command may fail to send. Instead of being lost
+	 * it is kept and retried, backing off a little more each time, on later
+	 * calls to this CANLight. A newer command of the same kind replaces it, so
+	 * the most recent color is the one that is shown. This report tells which
+	 * commands have actually been sent.
+	 * 
+	 * @return The delivery status of this CANLight's commands.
+	 */
+	DeliveryReport GetDeliveryReport() const;
+
+	/**
+	 * What became of one command, as returned by
+	 * {@link #GetCommandStatus(uint32_t)}.
+	 */
+	enum class CommandStatus {
+		/** The sequence number is 0, not issued yet, or lost too long ago to tell. */
+		Unknown,
+		/** Waiting to be sent, retried or held back. */
+		Pending,
+		/** Sent on the CAN bus. */
+		Delivered,
+		/** Replaced by a newer command of the same kind before it was sent. */
+		Superseded,
+		/** Given up on. */
+		Dropped
+	};
+
+	/**
+	 * Find out whether one command was sent on the CAN bus, using the sequence
+	 * number returned by the command. The last 16 commands that were superseded
+	 * or dropped are remembered; older commands that may have been lost report
+	 * Unknown.
+	 * 
+	 * @param sequence A sequence number returned by a command of this CANLight.
+	 * @return The command's status.
+	 */
+	CommandStatus GetCommandStatus(uint32_t sequence) const;
+
+	/**
+	 * A summary of one CANLight, as returned by {@link #GetTelemetry()}.
+	 */
+	struct Telemetry {
+		/** The device ID. */
+		uint8_t deviceID = 0;
+		/** True if the device is connected. */
+		bool present = false;
+		/** Battery voltage, or 0 if no status was received in the last second. */
+		double batteryVoltage = 0;
+		/** Milliseconds since the last status broadcast, or -1 if none was received. */
+		int64_t statusAgeMs = -1;
+		/** Number of commands waiting to be retried or held back by the bus budget. */
+		uint32_t pending = 0;
+		/** True if the most recent color or pattern was sent and nothing is waiting. */
+		bool synchronized = false;
+		/** Battery governor level: 0 normal, 1 reduced, 2 critical. */
+		uint8_t governorLevel = 0;
+		/** Number of times the governor level changed. */
+		uint16_t governorTransitions = 0;
+	};
+
+	/**
+	 * Get a summary of every CANLight constructed in this program, in order
+	 * of device ID, for example to put on a dashboard. This is cheap enough
+	 * to call every robot loop.
+	 */
+	static std::vector<Telemetry> GetTelemetry();
+
+	/**
+	 * Settings for {@link #EnableGovernor(const Governor&)}. Voltages are in
+	 * volts, brightness is a fraction of the requested color, and update
+	 * periods are the shortest time, in seconds, between color or pattern
+	 * changes sent to one CANLight.
+	 */
+	struct Governor {
+		/** Below this battery voltage the reduced limits apply. */
+		double reducedVoltage = 10.5;
+		double reducedBrightness = 0.6;
+		double reducedUpdatePeriod = 0.05;
+		/** Below this battery voltage the critical limits apply. */
+		double criticalVoltage = 9.0;
+		double criticalBrightness = 0.3;
+		double criticalUpdatePeriod = 0.2;
+		/** How far the voltage must rise above a threshold before its limits are lifted. */
+		double hysteresis = 0.3;
+	};
+
+	/**
+	 * Ease the load of every CANLight on a sagging battery. Each CANLight
+	 * compares the battery voltage it reports with the thresholds. Below a
+	 * threshold, the colors of {@link #ShowRGB(uint8_t, uint8_t, uint8_t)}
+	 * and {@link #WriteRegister(uint8_t, double, uint8_t, uint8_t, uint8_t)}
+	 * are dimmed, and color or pattern changes that come faster than the
+	 * update period are held back so that only the latest one is sent. This
+	 * slows down streamed colors and LightSequences without any change to
+	 * robot code. Registers that were never written keep their default
+	 * brightness.
+	 * <p>
+	 * Each change of level is printed, counted in {@link #GetTelemetry()},
+	 * and recorded as a trace span when tracing is on.
+	 */
+	static void EnableGovernor(const Governor& settings);
+	static void EnableGovernor(); // with the default settings
+
+	/**
+	 * Turn the battery governor off. CANLights return to full brightness and
+	 * update rate within a few milliseconds.
+	 */
+	static void DisableGovernor();
+
 private:
+	class Owner; // closes the handle when the last copy goes
+	std::shared_ptr<Owner> m_owner;
 	int m_handle;
 	int m_deviceID;
 };
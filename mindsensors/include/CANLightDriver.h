@@ -2,18 +2,47 @@
 
 #include "mindsensorsDriver.h"
 #include "can_light.h"
+#include "CANLightMessages.h"
+#include "CANLightTable.h"
 
-#include <hal/handles/IndexedHandleResource.h>
+#include <hal/handles/HandlesInternal.h>
 
+#include <atomic>
 #include <chrono> /* for GetBatteryVoltage grace period */
+#include <cstddef>
+#include <mutex>
+#include <string_view>
 
 #define CANLight_Handle HAL_Handle
 
 namespace mindsensors {
 
+/*
+ * Thread safety
+ *
+ * Every public method may be called from any thread, for the same or
+ * different devices, while the CANLightMonitor thread polls in the
+ * background. The command path takes no lock shared between devices:
+ *  - handle lookups only take a reference on the device's slot in the
+ *    table, a compare-and-swap on its own counter
+ *  - state, the last status reading, sequence numbers, counters and the
+ *    shadow registers/mode are atomics in CANLightTable
+ *  - the bus budget window and the current transport are atomics
+ *  - the per-device pending queue is locked only when a command has to be
+ *    queued or something is already pending
+ *  - a per-device send lock keeps a command's shadow update and send in
+ *    order with the monitor's replay of that shadow after a reset
+ * Metadata and the presence callback are guarded by per-device mutexes that
+ * are never held while talking to the bus. Receiving through SocketCAN goes
+ * through one lock in the transport; sending does not.
+ *
+ * Commands sent to one device from several threads at once are numbered as
+ * they take the send lock and reach the bus in that order; the device shows
+ * the last one.
+ */
 class CANLightDriver : protected mindsensorsDriver {
 public:
-    static std::string GetLibraryVersion();
+    static std::string_view GetLibraryVersion();
     
     enum State : uint8_t {
         Enabled = 0,
@@ -21,72 +50,357 @@ public:
         OldFirmware = 2
     };
     
-    CANLightDriver(int8_t deviceNumber, int32_t* status);
+    // Claim device ID deviceNumber's slot for a new CANLight, look for the
+    // device and return a handle, or HAL_kInvalidHandle with status set. The
+    // ID of a CANLight closed just now is free once its calls and the
+    // monitor's pass let go of the slot.
+    static CANLight_Handle Open(int8_t deviceNumber, int32_t* status);
+    // stop hold mode and close the handle; the slot is reset by the next Open
+    static void Close(CANLight_Handle handle);
+
+    // The device behind an open handle. It holds a reference on the slot for
+    // as long as it exists, so a new CANLight can't reset the slot under a
+    // call. False if the handle is not open.
+    explicit CANLightDriver(CANLight_Handle handle);
+    ~CANLightDriver();
+    CANLightDriver(const CANLightDriver&) = delete;
+    CANLightDriver& operator=(const CANLightDriver&) = delete;
+    explicit operator bool() const { return m_deviceID != 0; }
 
         uint8_t GetDeviceID(int32_t* status) const;
-    std::string GetDeviceName(int32_t* status) const;
-    std::string GetFirmwareVersion(int32_t* status) const;
-    std::string GetHardwareVersion(int32_t* status) const;
-    std::string GetBootloaderVersion(int32_t* status) const;
-    std::string GetSerialNumber(int32_t* status) const;
-
-    void BlinkLED(uint8_t seconds, int32_t* status);
-
-    void ShowRGB(uint8_t red, uint8_t green, uint8_t blue, int32_t* status);
-    void WriteRegister(uint8_t index, uint8_t time, uint8_t red, uint8_t green, uint8_t blue, int32_t* status);
-    void Reset(int32_t* status);
-    void ShowRegister(uint8_t index, int32_t* status);
-    void Flash(uint8_t index, int32_t* status);
-    void Cycle(uint8_t fromIndex, uint8_t toIndex, int32_t* status);
-    void Fade(uint8_t startIndex, uint8_t endIndex, int32_t* status);
+    // metadata may be refreshed by the presence monitor, so it is copied out
+    // under a lock; returns the full length as CANLight_GetDeviceName does
+    size_t GetDeviceName(char* buffer, size_t bufferSize) const;
+    size_t GetFirmwareVersion(char* buffer, size_t bufferSize) const;
+    size_t GetHardwareVersion(char* buffer, size_t bufferSize) const;
+    size_t GetBootloaderVersion(char* buffer, size_t bufferSize) const;
+    size_t GetSerialNumber(char* buffer, size_t bufferSize) const;
+    // read the metadata from the device again; status is set to
+    // HAL_ERR_CANSessionMux_MessageNotFound if it does not answer
+    void RefreshMetadata(int32_t* status);
+
+    // ask every device ID for its name at once; returns a mask with bit n set
+    // if device n answered within timeoutMs
+    static uint64_t Discover(uint32_t timeoutMs, int32_t* status);
+
+    // commands return their sequence number, or 0 if the device is disabled
+    uint32_t BlinkLED(uint8_t seconds, int32_t* status);
+
+    uint32_t ShowRGB(uint8_t red, uint8_t green, uint8_t blue, int32_t* status);
+    uint32_t WriteRegister(uint8_t index, uint8_t time, uint8_t red, uint8_t green, uint8_t blue, int32_t* status);
+    uint32_t Reset(int32_t* status);
+    uint32_t ShowRegister(uint8_t index, int32_t* status);
+    uint32_t Flash(uint8_t index, int32_t* status);
+    uint32_t Cycle(uint8_t fromIndex, uint8_t toIndex, int32_t* status);
+    uint32_t Fade(uint8_t startIndex, uint8_t endIndex, int32_t* status);
     
     double GetBatteryVoltage(int32_t* status);
+
+    // register color/pattern commands with the transport to repeat every
+    // periodMs, starting with the current one; 0 stops repeating
+    void SetHoldPeriod(uint16_t periodMs, int32_t* status);
+    uint16_t GetHoldPeriod() const { return m_table.holdPeriodMs[m_deviceID].load(std::memory_order_relaxed); }
+
+    // retry failed commands and send held back ones whose time has come, unless
+    // the device is disconnected; never waits
+    void ServicePending();
+
+    struct DeliveryReport {
+        uint32_t lastIssued;    // sequence number of the most recent command
+        uint32_t lastDelivered; // sequence number of the most recent command to reach the bus
+        uint32_t delivered;
+        uint32_t retries;       // failed attempts that were queued for retry
+        uint32_t superseded;    // pending commands replaced by a newer one
+        uint32_t dropped;       // commands given up on
+        uint32_t throttled;     // color/pattern commands delayed by the battery governor
+        uint32_t pending;
+        bool synchronized;      // the latest color/pattern command was delivered and nothing is pending
+        bool acknowledged;      // synchronized, and a status broadcast sent after that command was read
+    };
+    DeliveryReport GetDeliveryReport() const;
+
+    // what became of the command with this sequence number; Unknown for 0, a
+    // number not issued yet, or one lost before the last kLostHistory losses;
+    // in the order of CANLight_CommandStatus
+    enum class CommandStatus : uint8_t { Unknown, Pending, Delivered, Superseded, Dropped };
+    CommandStatus GetCommandStatus(uint32_t sequence) const;
+
+    State GetState() const { return (State) m_table.state[m_deviceID].load(); }
+
+    // called from the presence monitor thread whenever the device appears or disappears
+    using PresenceCallback = CANLightTable::PresenceCallback;
+    void SetPresenceCallback(PresenceCallback callback);
+
+    // One pass of CANLightMonitor over every open device, each step a loop
+    // over the table: retry pending commands, read the status broadcasts,
+    // judge presence, resets and the governor level, then replay the state
+    // of devices that reset. Never waits on the bus; returns the devices
+    // that just answered, whose metadata FetchArrived must read.
+    static uint64_t MonitorPass(std::chrono::steady_clock::time_point now);
+    // read the metadata of devices that just answered, on the monitor's
+    // fetch thread; the next pass announces the ones that are connected
+    static void FetchArrived(uint64_t devices);
+
+    struct Telemetry {
+        uint8_t deviceID;
+        State state;
+        double batteryVoltage; // 0 if no status in the last second
+        uint32_t statusAgeMs;  // UINT32_MAX if never heard
+        uint32_t pending;
+        bool synchronized;
+        uint8_t governorLevel;
+        uint16_t governorTransitions;
+    };
+    // one scan of the device table, for every allocated device; returns the count
+    static size_t GetTelemetry(Telemetry* telemetry, size_t maxDevices);
+
+    // Battery governor, shared by all devices. Each device compares its own
+    // status voltage with the thresholds: below reducedMillivolts it is at
+    // level 1, below criticalMillivolts at level 2, and it only moves back up
+    // once the voltage is hysteresisMillivolts above the threshold it crossed.
+    // At each level colors are scaled by brightness/256 and color/pattern
+    // frames are spaced at least intervalMs apart, the latest one winning.
+    struct GovernorSettings {
+        uint16_t reducedMillivolts;
+        uint16_t criticalMillivolts;
+        uint16_t hysteresisMillivolts;
+        uint16_t reducedBrightness;  // out of 256
+        uint16_t criticalBrightness;
+        uint16_t reducedIntervalMs;
+        uint16_t criticalIntervalMs;
+    };
+    static void SetGovernor(const GovernorSettings* settings); // nullptr turns it off
 	
 protected:
-        uint8_t m_deviceID;
-    std::string m_deviceName;
-    std::string m_firmwareVersion;
-    std::string m_hardwareVersion;
-    std::string m_bootloaderVersion;
-    std::string m_serialNumber;
-    
-    double lastBatteryVoltageReading = 0.0;
-    std::chrono::time_point<std::chrono::system_clock> lastBatteryVoltageTime;
+    // all of the device's state lives in the table; these only point into it
+    CANLightTable& m_table;
+        uint8_t m_deviceID; // 0 if the handle was not open
+    const messages::CANLightFrames& m_frames;
+    CANLightTable::CommandState& m_commands;
+    using Metadata = CANLightTable::Metadata;
+
+    struct StatusReading {
+        bool valid;
+        std::chrono::milliseconds age;
+        double voltage;
+    };
+    StatusReading LastStatus(std::chrono::steady_clock::time_point now) const;
+    static StatusReading DecodeStatus(uint64_t packed, std::chrono::steady_clock::time_point now);
 
 private:
-    static hal::IndexedHandleResource<CANLight_Handle, uint8_t, 63, hal::HAL_HandleEnum::Vendor> canlightHandles;
-    CANLight_Handle m_resourceHandle;
+    // a view of a slot the caller already holds a reference on
+    explicit CANLightDriver(uint8_t deviceID);
+    bool m_holdsReference = false;
+
+    void SetState(State state) { m_table.state[m_deviceID] = state; }
+    void DisabledWarning(const char* methodName) const;
+
+    // returns false if the device did not answer
+    bool FetchMetadata(uint32_t timeoutMs, int32_t* status);
+    bool FetchMetadataLocked(uint32_t timeoutMs, int32_t* status); // m_table.fetchMutex[m_deviceID] must be held
+    void WriteVersionFile(const Metadata& metadata) const;
+    bool PollStatus(); // read the status broadcast, if one arrived, and acknowledge mode commands
+    void UpdateGovernor(const StatusReading& reading); // monitor thread only
+
+    static constexpr auto kPresenceTimeout = std::chrono::seconds(1);
+    static constexpr auto kDiscoveryInterval = std::chrono::seconds(1);
+    void NotifyPresence(bool present);
+    // the monitor's judgement of one device after the status broadcasts were
+    // read: heard is true if one arrived this pass, previous is the reading
+    // before. Returns true if the device just answered and its metadata is
+    // to be read.
+    bool Watch(std::chrono::steady_clock::time_point now, const StatusReading& previous, bool heard);
+
+    // The registers and mode requested by the user are shadowed in the table
+    // and replayed after the device resets (brownout or power cycle) and falls
+    // back to its defaults. A reset is assumed when the monitor polls and
+    // finds the status broadcast silent for longer than kResetGap, or when a
+    // device that was disconnected comes back.
+    bool NeedsResync() const { return m_table.needsResync.load() & (uint64_t(1) << m_deviceID); }
+    void SetNeedsResync(bool needed);
+    void RestartResync(); // replay everything from the start on the next pass
+    static constexpr auto kResetGap = std::chrono::milliseconds(250);
+    static constexpr size_t kMaxResyncFrames = 16; // per monitor pass, across all devices
+    // replay the last requested registers and mode to the devices in `devices`
+    // that reset, a bounded number of frames per call, batched into one
+    // transport call
+    static void Resync(uint64_t devices);
 
-    State state = State::Enabled;
-    void DisabledWarning(std::string methodName) const;
+    template <typename Msg>
+    void UpdateShadow(const typename Msg::Payload& payload);
+    bool HasShadowState() const { return m_commands.registersWritten != 0 || m_commands.modeShadow != 0; }
+    // fill frames for the registers and mode still to replay; returns the
+    // number written. The mode waits for the governor like any color change.
+    // m_sendMutex must be held until the frames are sent.
+    size_t BuildResyncFrames(CANFrame* frames, size_t maxFrames, std::chrono::steady_clock::time_point now,
+                             uint8_t* registersTaken, bool* complete, bool* modeTaken);
+
+    template <typename Msg>
+    uint32_t SendCommand(const typename Msg::Payload& payload, const char* methodName, int32_t* status);
+    // send a command's frame as the governor and hold mode want it
+    void Transmit(CANFrame frame, bool mode, int32_t* status);
+    // scale the colors in a ShowRGB or WriteRegister frame for the governor level
+    void Dim(CANFrame& frame) const;
+
+    // Commands that failed to send, or were held back by the bus budget or
+    // governor, wait here in issue order, and commands issued meanwhile queue
+    // behind them. They are sent strictly in order. A newer command with the
+    // same key replaces a pending one, so the latest ShowRGB wins and only the
+    // last write to each register is kept.
+    using PendingCommand = CANLightTable::PendingCommand;
+    static constexpr size_t kMaxPending = CANLightTable::kMaxPending;
+    static constexpr uint8_t kMaxAttempts = 6;
+
+    template <typename Msg>
+    static constexpr uint8_t SupersedeKey(const typename Msg::Payload& payload);
+    void Supersede(uint8_t key); // m_pendingMutex must be held
+    void Enqueue(const PendingCommand& command); // m_pendingMutex must be held
+    void RecordLost(uint32_t sequence, bool dropped); // m_pendingMutex must be held
+    bool Throttle(PendingCommand& command); // queue a mode command the governor doesn't allow yet
+    int32_t GovernorWaitMs(std::chrono::steady_clock::time_point now) const; // <= 0 if a mode frame may go now
+    void Delivered(uint32_t sequence, bool mode);
+
+    // held from a command's shadow update until its frame is sent or queued,
+    // and by Resync from reading the shadow until the replay is sent, so a
+    // replay never overwrites a newer command on the device; taken before
+    // m_pendingMutex and the hold mutex
+    std::mutex& m_sendMutex;
+    // the queue lives in the table with its count, m_commands.pendingCount
+    std::mutex& m_pendingMutex;
+    PendingCommand* m_pending;
+
+    // In hold mode the latest mode command is registered with the transport
+    // (netcomm for the HAL, the broadcast manager for SocketCAN) to repeat on
+    // its own, which keeps the device refreshed and covers lost frames. A
+    // command with another arbitration ID stops the held one first; the same
+    // ID only replaces the payload. Its bus load is added to the budget while
+    // it repeats. The frame is in m_table.held, guarded by its mutex.
+    void SendHeld(const CANFrame& frame, int32_t* status); // m_table.held[m_deviceID].mutex must be held
+    void ReleaseHeld(); // m_table.held[m_deviceID].mutex must be held
 };
 
 } // namespace mindsensors
 
 extern "C" {
     
+// returns a pointer to static storage, never freed
 const char* CANLight_GetLibraryVersion();
 
+// select the CAN transport used by every CANLight; call before constructing
+// devices. Returns once no send or replay is using the previous transport.
+void CANLight_UseHALTransport(void);
+void CANLight_UseSocketCANTransport(const char* interfaceName, int32_t* status);
+
+// share (0 to 1) of the CAN bus all CANLights may use; 1 disables the limit
+void CANLight_SetBusBudget(double fraction);
+double CANLight_GetBusUtilization(void);
+
+// record all mindsensors CAN traffic to a memory-mapped ring file of
+// `capacity` frames, replacing any journal already being recorded
+void CANLight_StartJournal(const char* path, uint64_t capacity, int32_t* status);
+void CANLight_StopJournal(void);
+// send a journal's frames through the current transport with their original
+// timing; blocks until done and returns the number of frames sent. The
+// transport can't be changed until the replay is done.
+size_t CANLight_ReplayJournal(const char* path, HAL_Bool includeReceived, double speed, int32_t* status);
+
+// timing spans along the command path, written as Chrome trace JSON
+void CANLight_SetTraceEnabled(HAL_Bool enabled);
+void CANLight_ClearTrace(void);
+void CANLight_WriteTrace(const char* path, int32_t* status);
+
 int CANLight_Constructor(int8_t deviceNumber, int32_t* status);
 void CANLight_Destructor(CANLight_Handle handle);
 
     uint8_t CANLight_GetDeviceID(CANLight_Handle handle, int32_t* status);
-const char* CANLight_GetDeviceName(CANLight_Handle handle, int32_t* status);
-const char* CANLight_GetFirmwareVersion(CANLight_Handle handle, int32_t* status);
-const char* CANLight_GetHardwareVersion(CANLight_Handle handle, int32_t* status);
-const char* CANLight_GetBootloaderVersion(CANLight_Handle handle, int32_t* status);
-const char* CANLight_GetSerialNumber(CANLight_Handle handle, int32_t* status);
-
-void CANLight_BlinkLED(CANLight_Handle handle, uint8_t seconds, int32_t* status);
-
-void CANLight_ShowRGB(CANLight_Handle handle, uint8_t red, uint8_t green, uint8_t blue, int32_t* status);
-void CANLight_WriteRegister(CANLight_Handle handle, uint8_t index, uint8_t time, uint8_t red, uint8_t green, int8_t blue, int32_t* status);
-void CANLight_Reset(CANLight_Handle handle, int32_t* status);
-void CANLight_ShowRegister(CANLight_Handle handle, uint8_t index, int32_t* status);
-void CANLight_Flash(CANLight_Handle handle, uint8_t index, int32_t* status);
-void CANLight_Cycle(CANLight_Handle handle, uint8_t fromIndex, uint8_t toIndex, int32_t* status);
-void CANLight_Fade(CANLight_Handle handle, uint8_t startIndex, uint8_t endIndex, int32_t* status);
+// metadata is copied into the caller's buffer (always null terminated when
+// bufferSize > 0); the return value is the full length of the string, which
+// never exceeds CANLIGHT_METADATA_LENGTH - 1
+size_t CANLight_GetDeviceName(CANLight_Handle handle, char* buffer, size_t bufferSize, int32_t* status);
+size_t CANLight_GetFirmwareVersion(CANLight_Handle handle, char* buffer, size_t bufferSize, int32_t* status);
+size_t CANLight_GetHardwareVersion(CANLight_Handle handle, char* buffer, size_t bufferSize, int32_t* status);
+size_t CANLight_GetBootloaderVersion(CANLight_Handle handle, char* buffer, size_t bufferSize, int32_t* status);
+size_t CANLight_GetSerialNumber(CANLight_Handle handle, char* buffer, size_t bufferSize, int32_t* status);
+
+// commands return their sequence number for CANLight_GetCommandStatus, or 0
+// if the device is disabled
+uint32_t CANLight_BlinkLED(CANLight_Handle handle, uint8_t seconds, int32_t* status);
+
+uint32_t CANLight_ShowRGB(CANLight_Handle handle, uint8_t red, uint8_t green, uint8_t blue, int32_t* status);
+uint32_t CANLight_WriteRegister(CANLight_Handle handle, uint8_t index, uint8_t time, uint8_t red, uint8_t green, int8_t blue, int32_t* status);
+uint32_t CANLight_Reset(CANLight_Handle handle, int32_t* status);
+uint32_t CANLight_ShowRegister(CANLight_Handle handle, uint8_t index, int32_t* status);
+uint32_t CANLight_Flash(CANLight_Handle handle, uint8_t index, int32_t* status);
+uint32_t CANLight_Cycle(CANLight_Handle handle, uint8_t fromIndex, uint8_t toIndex, int32_t* status);
+uint32_t CANLight_Fade(CANLight_Handle handle, uint8_t startIndex, uint8_t endIndex, int32_t* status);
 
 double CANLight_GetBatteryVoltage(CANLight_Handle handle, int32_t* status);
 
+// repeat color/pattern commands every periodMs without further calls; 0 stops
+void CANLight_SetHoldPeriod(CANLight_Handle handle, uint16_t periodMs, int32_t* status);
+
+typedef struct {
+    uint32_t lastIssued;
+    uint32_t lastDelivered;
+    uint32_t delivered;
+    uint32_t retries;
+    uint32_t superseded;
+    uint32_t dropped;
+    uint32_t throttled;
+    uint32_t pending;
+    HAL_Bool synchronized;
+    HAL_Bool acknowledged;
+} CANLight_DeliveryReport;
+
+void CANLight_GetDeliveryReport(CANLight_Handle handle, CANLight_DeliveryReport* report, int32_t* status);
+
+typedef enum {
+    CANLight_CommandUnknown = 0, // 0, not issued yet, or lost too long ago to tell
+    CANLight_CommandPending,     // waiting to be sent or retried
+    CANLight_CommandDelivered,   // sent on the CAN bus
+    CANLight_CommandSuperseded,  // replaced by a newer command before it was sent
+    CANLight_CommandDropped      // given up on
+} CANLight_CommandStatus;
+
+// what became of the command with this sequence number
+CANLight_CommandStatus CANLight_GetCommandStatus(CANLight_Handle handle, uint32_t sequence, int32_t* status);
+
+// devices are watched in the background and re-enabled when they (re)appear;
+// the callback runs on the monitor thread and must not block for long
+typedef void (*CANLight_PresenceCallback)(void* param, uint8_t deviceID, HAL_Bool present);
+void CANLight_SetPresenceCallback(CANLight_Handle handle, CANLight_PresenceCallback callback, void* param, int32_t* status);
+HAL_Bool CANLight_IsPresent(CANLight_Handle handle, int32_t* status);
+
+typedef struct {
+    uint8_t deviceID;
+    HAL_Bool present;
+    double batteryVoltage;
+    uint32_t statusAgeMs;
+    uint32_t pending;
+    HAL_Bool synchronized;
+    uint8_t governorLevel;
+    uint16_t governorTransitions;
+} CANLight_Telemetry;
+
+// one entry per allocated CANLight, in ID order; returns the number written
+size_t CANLight_GetTelemetry(CANLight_Telemetry* telemetry, size_t maxDevices);
+
+typedef struct {
+    uint16_t reducedMillivolts;
+    uint16_t criticalMillivolts;
+    uint16_t hysteresisMillivolts;
+    uint16_t reducedBrightness;  // out of 256
+    uint16_t criticalBrightness;
+    uint16_t reducedIntervalMs;  // minimum time between color/pattern frames
+    uint16_t criticalIntervalMs;
+} CANLight_GovernorSettings;
+
+// dim colors and slow updates on devices reporting a low battery; NULL turns it off
+void CANLight_SetGovernor(const CANLight_GovernorSettings* settings);
+
+// both block while waiting for replies
+void CANLight_RefreshMetadata(CANLight_Handle handle, int32_t* status);
+// bit n of the result is set if device ID n answered
+uint64_t CANLight_Discover(uint32_t timeoutMs, int32_t* status);
+
 } // extern "C"
@@ -0,0 +1,159 @@
+#pragma once
+
+#include "can_light.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace mindsensors {
+namespace messages {
+
+/**
+ * Compile-time description of a single CANLight message. The API ID holds the
+ * manufacturer, device type and API number; the device ID occupies the low six
+ * bits and is added per device. Payloads always have a fixed size.
+ *
+ * These definitions only depend on can_light.h so that anything speaking the
+ * CANLight protocol (the driver, a simulator, a firmware updater) can share
+ * them.
+ */
+template <uint32_t ApiID, uint8_t Size>
+struct Message {
+    static_assert((ApiID & ~CAN_MSGID_FULL_M) == 0, "API ID must fit in a 29 bit identifier");
+    static_assert((ApiID & 0x3F) == 0, "low six bits of the API ID are reserved for the device ID");
+    static_assert(Size <= 8, "CAN payloads are at most 8 bytes");
+
+    static constexpr uint32_t kApiID = ApiID;
+    static constexpr uint8_t kSize = Size;
+    static constexpr bool kMode = false;
+
+    using Payload = std::array<uint8_t, Size>;
+
+    static constexpr uint32_t ArbitrationID(uint8_t deviceID) {
+        return ApiID | (deviceID & 0x3F);
+    }
+};
+
+/**
+ * A command that selects what the device displays. Each one replaces the
+ * effect of the previous one, so only the latest needs to reach the device.
+ */
+template <uint32_t ApiID, uint8_t Size>
+struct ModeMessage : Message<ApiID, Size> {
+    static constexpr bool kMode = true;
+};
+
+// ----- color commands -----
+
+/** ShowRGB: [0, red, green, blue] */
+struct ColorSet : ModeMessage<MS_API_COLOR_SET, 4> {
+    static constexpr Payload Encode(uint8_t red, uint8_t green, uint8_t blue) {
+        return {0, red, green, blue};
+    }
+};
+
+/** ShowRegister: [index] */
+struct ColorShow : ModeMessage<MS_API_COLOR_SHOW, 1> {
+    static constexpr Payload Encode(uint8_t index) { return {index}; }
+};
+
+/** Flash: [index] */
+struct ColorBlink : ModeMessage<MS_API_COLOR_BLINK, 1> {
+    static constexpr Payload Encode(uint8_t index) { return {index}; }
+};
+
+/** Fade: [startIndex, endIndex] */
+struct ColorFade : ModeMessage<MS_API_COLOR_FADE, 2> {
+    static constexpr Payload Encode(uint8_t startIndex, uint8_t endIndex) { return {startIndex, endIndex}; }
+};
+
+/** Cycle: [fromIndex, toIndex] */
+struct ColorSweep : ModeMessage<MS_API_COLOR_SWEEP, 2> {
+    static constexpr Payload Encode(uint8_t fromIndex, uint8_t toIndex) { return {fromIndex, toIndex}; }
+};
+
+/** WriteRegister: [index, time (centiseconds), red, green, blue] */
+struct ColorLoad : Message<MS_API_COLOR_LOAD, 5> {
+    static constexpr Payload Encode(uint8_t index, uint8_t time, uint8_t red, uint8_t green, uint8_t blue) {
+        return {index, time, red, green, blue};
+    }
+};
+
+/** Reset: no payload */
+struct ColorReset : Message<MS_API_COLOR_RESET, 0> {
+    static constexpr Payload Encode() { return {}; }
+};
+
+/** BlinkLED: [seconds] */
+struct Blink : Message<MSR_BLINK, 1> {
+    static constexpr Payload Encode(uint8_t seconds) { return {seconds}; }
+};
+
+// ----- requested / broadcast data -----
+
+/** Device name, up to 8 characters, null terminated if shorter. */
+struct DeviceName : Message<MSR_DEVNAME, 0> {};
+
+/** [fw major, fw minor, hw major, hw minor, bootloader major, bootloader minor] */
+struct FirmwareVersion : Message<MSR_FIRMWARE_VERSION, 0> {};
+
+/** Serial number as ASCII, up to 8 characters. */
+struct SerialNumber : Message<MSR_DEVSERNO, 0> {};
+
+/** Status broadcast by the device: [?, vbatt low, vbatt high, ...] */
+struct StatusData : Message<MSR_STATUS_DATA, 0> {
+    static constexpr double DecodeBatteryVoltage(const uint8_t* data) {
+        return 2.8*((uint16_t)data[1] + (data[2]<<8))/1000;
+    }
+};
+
+// ----- firmware update -----
+
+struct UpdateRequest : Message<MS_API_CANLIGHT_UPD_REQUEST, 0> {};
+struct UpdateDownload : Message<MS_API_CANLIGHT_UPD_DOWNLOAD, 8> {};
+struct UpdateReset : Message<MS_API_CANLIGHT_UPD_RESET, 0> {};
+struct UpdateAck : Message<MS_API_CANLIGHT_UPD_ACK, 0> {};
+
+// ----- per-device frame templates -----
+
+namespace detail {
+template <typename T, typename... Ts>
+constexpr size_t IndexOf() {
+    constexpr bool matches[] = {std::is_same_v<T, Ts>...};
+    for (size_t i = 0; i < sizeof...(Ts); i++) {
+        if (matches[i]) return i;
+    }
+    return sizeof...(Ts);
+}
+} // namespace detail
+
+/**
+ * Arbitration IDs for a set of messages, computed once for a device so that
+ * sending a command is a table lookup rather than rebuilding the ID.
+ */
+template <typename... Msgs>
+class FrameTable {
+public:
+    constexpr explicit FrameTable(uint8_t deviceID) : m_ids{Msgs::ArbitrationID(deviceID)...} {}
+
+    template <typename Msg>
+    constexpr uint32_t Get() const {
+        constexpr size_t index = detail::IndexOf<Msg, Msgs...>();
+        static_assert(index < sizeof...(Msgs), "message is not part of this frame table");
+        return m_ids[index];
+    }
+
+private:
+    std::array<uint32_t, sizeof...(Msgs)> m_ids;
+};
+
+using CANLightFrames = FrameTable<ColorSet, ColorShow, ColorBlink, ColorFade, ColorSweep, ColorLoad,
+                                  ColorReset, Blink, DeviceName, FirmwareVersion, SerialNumber, StatusData>;
+
+static_assert(CANLightFrames(3).Get<ColorSet>() == (MS_API_COLOR_SET | 3), "frame table must match can_light.h");
+static_assert(CANLightFrames(60).Get<StatusData>() == (MSR_STATUS_DATA | 60), "frame table must match can_light.h");
+
+} // namespace messages
+} // namespace mindsensors
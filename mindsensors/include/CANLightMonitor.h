@@ -0,0 +1,42 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace mindsensors {
+
+/**
+ * Background thread that watches every CANLight for presence, retries pending
+ * commands and re-enables devices that appear after construction. The devices
+ * to watch are the open slots in CANLightTable, so opening or destroying a
+ * CANLight needs no registering. A second thread reads the metadata of
+ * devices that appear, so the passes keep their period meanwhile.
+ */
+class CANLightMonitor {
+public:
+    static CANLightMonitor& GetInstance();
+
+    void Start(); // start the threads, if they aren't running yet
+
+private:
+    CANLightMonitor() = default;
+    ~CANLightMonitor();
+
+    void Run();
+    void RunFetches();
+
+    static constexpr auto kPeriod = std::chrono::milliseconds(20);
+
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    bool m_stop = false;
+    uint64_t m_fetchRequests = 0; // devices for RunFetches, bit n for ID n
+    std::condition_variable m_fetchWakeup;
+    std::thread m_thread; // started with the first device
+    std::thread m_fetchThread;
+};
+
+} // namespace mindsensors
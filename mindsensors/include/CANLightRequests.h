@@ -0,0 +1,64 @@
+#pragma once
+
+#include "CANLight.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace mindsensors {
+
+/**
+ * Runs CANLight operations that wait on the CAN bus (construction, reading
+ * metadata, discovery) on a background thread, so that an event loop can
+ * start them without blocking. Each call returns a request number at once;
+ * its result is later collected with {@link #TakeCompletions()}.
+ * <p>
+ * This is the engine behind mindsensors.aio. Most Python code should use that
+ * module rather than this class.
+ */
+class CANLightRequests {
+public:
+	/** The outcome of one request. */
+	struct Completion {
+		/** The number returned when the request was made. */
+		uint64_t request = 0;
+		/** Empty if the request succeeded, otherwise the error message. */
+		std::string error;
+		/** The new CANLight, for {@link #Create(uint8_t)}. */
+		std::optional<CANLight> light;
+		/** The voltage in volts, for {@link #BatteryVoltage(const CANLight&)}. */
+		double voltage = 0;
+		/** The IDs that answered, for {@link #Discover(double)}. */
+		std::vector<uint8_t> deviceIDs;
+	};
+
+	/**
+	 * @return A file descriptor that becomes readable when a request completes,
+	 * for use with select, poll or asyncio's add_reader. It stays readable
+	 * until {@link #TakeCompletions()} is called. -1 on platforms without
+	 * eventfd, where completions have to be polled for.
+	 */
+	static int GetNotifier();
+
+	/** Construct a CANLight. Fails if the ID is out of range or already in use. */
+	static uint64_t Create(uint8_t deviceNumber);
+
+	/** Run {@link CANLight#RefreshInfo()}. */
+	static uint64_t RefreshInfo(const CANLight& light);
+
+	/** Run {@link CANLight#GetBatteryVoltage()}. */
+	static uint64_t BatteryVoltage(const CANLight& light);
+
+	/** Run {@link CANLight#Discover(double)}. */
+	static uint64_t Discover(double timeout = 0.1);
+
+	/**
+	 * @return Every completion not yet taken, in the order the requests
+	 * finished. Never waits.
+	 */
+	static std::vector<Completion> TakeCompletions();
+};
+
+} // namespace mindsensors
@@ -0,0 +1,170 @@
+#pragma once
+
+#include "CANTransport.h" /* for CANFrame */
+#include "CANLightMessages.h" /* for CANLightFrames */
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+// metadata strings are read from 8 byte CAN frames, so 16 bytes (including
+// the null terminator) is always enough
+#define CANLIGHT_METADATA_LENGTH 16
+
+namespace mindsensors {
+
+/**
+ * The state of every CANLight, indexed by device ID. All of a device's state
+ * lives here; a CANLightDriver is only the table and an ID, made on the stack
+ * for each call. Fields read across all devices (state, last status, resync
+ * flags) are kept in their own arrays, so fleet-wide passes such as the
+ * monitor's and GetTelemetry read a few contiguous cache lines. Each
+ * device's command counters and shadow mode share one cache line, which no
+ * other device touches, so threads commanding different devices don't slow
+ * each other down. Rarely used state is kept apart from all of this.
+ */
+class CANLightTable {
+public:
+    static constexpr size_t kSlots = 64; // device IDs 1-60 index directly
+
+    static CANLightTable& GetInstance();
+
+    // every message's arbitration ID for a device, computed at compile time
+    static const messages::CANLightFrames& Frames(uint8_t deviceID);
+
+    struct alignas(64) CommandState {
+        std::atomic<uint32_t> lastIssued{0};
+        std::atomic<uint32_t> lastDelivered{0};
+        std::atomic<uint32_t> lastModeIssued{0};
+        std::atomic<uint32_t> lastModeDelivered{0};
+        std::atomic<uint32_t> delivered{0};
+        std::atomic<uint32_t> retries{0};
+        std::atomic<uint32_t> superseded{0};
+        std::atomic<uint32_t> dropped{0};
+        std::atomic<uint64_t> modeShadow{0};      // data size << 61 | ID << 32 | payload, 0 if none
+        std::atomic<uint64_t> traceModeSentNs{0}; // see CANLightDriver::Delivered
+        std::atomic<uint32_t> throttled{0};       // mode commands held back by the battery governor
+        std::atomic<uint32_t> lastModeSentMs{0};  // steady clock, only kept while the governor limits this device
+        std::atomic<uint8_t> pendingCount{0};
+        std::atomic<uint8_t> registersWritten{0}; // registers changed from their defaults
+        std::atomic<uint8_t> governorLevel{0};    // see CANLightDriver::UpdateGovernor
+        std::atomic<uint16_t> governorTransitions{0};
+    };
+    static_assert(sizeof(CommandState) == 64, "command state should fill exactly one cache line");
+
+    // a command waiting to be sent; see CANLightDriver::SendCommand
+    struct PendingCommand {
+        CANFrame frame;
+        const char* methodName;
+        uint32_t sequence;
+        uint8_t key;
+        uint8_t attempts; // 0 if only held back by the bus budget
+        std::chrono::steady_clock::time_point nextAttempt;
+    };
+    static constexpr size_t kMaxPending = 8;
+    static constexpr size_t kLostHistory = 16;
+    struct alignas(64) PendingQueue {
+        std::mutex sendMutex; // see CANLightDriver::SendCommand
+        std::mutex mutex; // the count is CommandState::pendingCount
+        PendingCommand commands[kMaxPending];
+        // the last commands superseded or dropped, for
+        // CANLightDriver::GetCommandStatus; guarded by mutex
+        uint32_t lostSequence[kLostHistory];
+        bool lostDropped[kLostHistory];
+        uint32_t lostCount;     // ever recorded; the next goes at lostCount % kLostHistory
+        uint32_t lostForgotten; // highest sequence pushed out of the history
+    };
+
+    // hold mode: the frame the transport repeats for a device, if any; see
+    // CANLightDriver::SetHoldPeriod
+    struct HeldFrame {
+        std::mutex mutex; // taken after the pending queue's mutex, never before
+        CANFrame frame{}; // messageID 0 if nothing repeats
+        int32_t periodMs = 0;
+    };
+
+    // called when the device appears or disappears
+    using PresenceCallback = std::function<void(uint8_t deviceID, bool present)>;
+    struct Presence {
+        std::mutex mutex; // never held while calling the callback
+        PresenceCallback callback;
+    };
+
+    // used only by the monitor thread
+    struct MonitorState {
+        std::chrono::steady_clock::time_point lastSilentPoll; // last pass with no status broadcast
+        std::chrono::steady_clock::time_point lastDiscovery;  // last name request while not found
+        uint8_t resyncRegisters = 0; // registers still to replay
+        bool resyncInProgress = false;
+    };
+
+    struct Metadata {
+        char deviceName[CANLIGHT_METADATA_LENGTH] = {};
+        char firmwareVersion[CANLIGHT_METADATA_LENGTH] = {};
+        char hardwareVersion[CANLIGHT_METADATA_LENGTH] = {};
+        char bootloaderVersion[CANLIGHT_METADATA_LENGTH] = {};
+        char serialNumber[CANLIGHT_METADATA_LENGTH] = {};
+        uint8_t firmwareMajor = 0;
+        uint8_t firmwareMinor = 0;
+    };
+
+    // Slot lifetime. Each slot counts its references, with its generation
+    // in the top byte. The CANLight's handle holds one, and each call made
+    // through the handle or monitor pass holds one while it runs. A slot is
+    // only claimed for a new CANLight once its count is back to zero; the
+    // generation changes then, and handles carry it, so a handle kept after
+    // its CANLight was destroyed can't reach the next owner of the ID.
+    alignas(64) std::atomic<uint32_t> refs[kSlots] = {};
+    // bit n is set from the start of device ID n's construction until its
+    // handle is closed, even while references remain
+    std::atomic<uint64_t> owned{0};
+    // bit n is set while device n has an open handle: the monitor watches it
+    std::atomic<uint64_t> open{0};
+    // bit n is set while device n's registers and mode need replaying
+    std::atomic<uint64_t> needsResync{0};
+    // bit n is set while the monitor's fetch thread reads the metadata of
+    // device n, which just answered, and then until the monitor announces it
+    std::atomic<uint64_t> fetching{0};
+    std::atomic<uint64_t> connected{0}; // read, to be announced on the next pass
+
+    alignas(64) std::atomic<uint8_t> state[kSlots] = {}; // CANLightDriver::State
+    // last status broadcast: received time in ms (high 32 bits), a valid flag
+    // (bit 31) and the battery voltage in mV
+    alignas(64) std::atomic<uint64_t> lastStatus[kSlots] = {};
+    // mode commands seen by the device: the last one a status broadcast
+    // confirmed (high 32 bits) and the last one delivered when the previous
+    // broadcast was read; see CANLightDriver::PollStatus
+    alignas(64) std::atomic<uint64_t> modeAcknowledged[kSlots] = {};
+    CommandState commands[kSlots];
+    alignas(64) std::atomic<uint32_t> registerShadow[kSlots][8] = {}; // time, red, green, blue
+    PendingQueue pending[kSlots];
+    alignas(64) std::atomic<uint16_t> holdPeriodMs[kSlots] = {}; // 0 unless in hold mode
+    MonitorState monitor[kSlots];
+
+    // cold
+    HeldFrame held[kSlots];
+    Presence presence[kSlots];
+    Metadata metadata[kSlots];
+    std::mutex metadataMutex[kSlots];
+    // held while reading a device's name or metadata replies; otherwise one
+    // reader (a CANLight, the monitor or Discover) can take another's reply
+    std::mutex fetchMutex[kSlots];
+
+    // take the slot for a new CANLight if nothing references it; returns
+    // false if it is in use. The slot starts with one reference.
+    bool Claim(uint8_t deviceID, uint8_t* generation);
+    // take a reference if the slot is in use (and has this generation, if
+    // one is given); every successful call must be matched by Unref
+    bool TryRef(uint8_t deviceID, int generation = -1);
+    void Unref(uint8_t deviceID);
+
+private:
+    CANLightTable() = default;
+    // clear a slot for a newly constructed CANLight
+    void ResetSlot(uint8_t deviceID);
+};
+
+} // namespace mindsensors
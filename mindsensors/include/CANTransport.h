@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+#include <unordered_map>
+
+namespace mindsensors {
+
+struct CANFrame {
+    uint32_t messageID;
+    uint8_t data[8];
+    uint8_t dataSize;
+};
+
+/**
+ * The link between mindsensorsDriver and a CAN bus. Status codes follow the
+ * HAL: 0 on success, HAL_ERR_CANSessionMux_MessageNotFound when nothing new
+ * has been received, and negative values for other errors.
+ */
+class CANTransport {
+public:
+    virtual ~CANTransport() = default;
+
+    // periodMs follows HAL_CAN_SendMessage: HAL_CAN_SEND_PERIOD_NO_REPEAT to send
+    // once, a positive period to repeat, HAL_CAN_SEND_PERIOD_STOP_REPEATING to cancel
+    virtual void SendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t periodMs, int32_t* status) = 0;
+    // send several one-shot frames; stops at the first failure and returns
+    // the number of frames sent before it
+    virtual size_t SendMessages(const CANFrame* frames, size_t count, int32_t* status);
+
+    // get the latest frame matching messageID/messageIDMask received since the last call
+    virtual void ReceiveMessage(uint32_t* messageID, uint32_t messageIDMask, uint8_t* data, uint8_t* dataSize, uint32_t* timeStamp, int32_t* status) = 0;
+};
+
+/** Default transport: the roboRIO (or simulated) HAL. */
+class HALCANTransport : public CANTransport {
+public:
+    void SendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t periodMs, int32_t* status) override;
+    void ReceiveMessage(uint32_t* messageID, uint32_t messageIDMask, uint8_t* data, uint8_t* dataSize, uint32_t* timeStamp, int32_t* status) override;
+};
+
+#ifdef __linux__
+/**
+ * Linux SocketCAN transport (can0, vcan0, ...). Only frames carrying the
+ * mindsensors manufacturer ID are accepted by the kernel filter. Sends and
+ * receives are batched with sendmmsg/recvmmsg, and periodic frames are handed
+ * to the kernel's broadcast manager.
+ */
+class SocketCANTransport : public CANTransport {
+public:
+    SocketCANTransport(const char* interfaceName, int32_t* status);
+    ~SocketCANTransport() override;
+
+    SocketCANTransport(const SocketCANTransport&) = delete;
+    SocketCANTransport& operator=(const SocketCANTransport&) = delete;
+
+    void SendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t periodMs, int32_t* status) override;
+    size_t SendMessages(const CANFrame* frames, size_t count, int32_t* status) override;
+    void ReceiveMessage(uint32_t* messageID, uint32_t messageIDMask, uint8_t* data, uint8_t* dataSize, uint32_t* timeStamp, int32_t* status) override;
+
+private:
+    void SendPeriodic(const CANFrame& frame, int32_t periodMs, int32_t* status);
+    void Drain(); // read everything pending into m_received; m_receivedMutex must be held
+
+    struct ReceivedFrame {
+        CANFrame frame;
+        uint32_t timeStamp;
+        bool fresh;
+    };
+
+    int m_interfaceIndex = 0;
+    int m_socket = -1;
+    int m_bcmSocket = -1; // opened on first periodic send
+    std::mutex m_bcmMutex;
+    std::mutex m_receivedMutex;
+    std::unordered_map<uint32_t, ReceivedFrame> m_received;
+};
+#endif
+
+} // namespace mindsensors
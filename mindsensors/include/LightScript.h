@@ -0,0 +1,165 @@
+#pragma once
+
+#include "CANLight.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace mindsensors {
+
+/**
+ * A timed light sequence written as a C++20 coroutine. Scripts run on a single
+ * shared executor thread and suspend with co_await instead of blocking, for
+ * example:
+ *
+ *   LightScript AlertThenTeamColor(CANLight light, frc::Color8Bit team) {
+ *       for (int i = 0; i < 3; i++) {
+ *           light.ShowRGB(255, 0, 0);
+ *           co_await Delay(std::chrono::milliseconds(200));
+ *           light.ShowRGB(0, 0, 0);
+ *           co_await Delay(std::chrono::milliseconds(200));
+ *       }
+ *       light.ShowRGB(team);
+ *       co_await Delivered(light);
+ *   }
+ *
+ *   int handle = LightScriptExecutor::GetInstance().Start(light.GetDeviceID(), AlertThenTeamColor(light, blue));
+ *
+ * Take the CANLight by value: the script outlives the caller's stack frame.
+ */
+class LightScript {
+public:
+    struct promise_type {
+        // what the script is waiting for; set by the awaiters below
+        std::chrono::steady_clock::time_point wakeTime;
+        std::function<bool()> condition;
+
+        LightScript get_return_object() {
+            return LightScript(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; } // started by the executor
+        std::suspend_always final_suspend() noexcept { return {}; }   // destroyed by the executor
+        void return_void() {}
+        void unhandled_exception();
+    };
+
+    LightScript(LightScript&& other) noexcept : m_handle(other.m_handle) { other.m_handle = nullptr; }
+    LightScript& operator=(LightScript&& other) noexcept;
+    LightScript(const LightScript&) = delete;
+    LightScript& operator=(const LightScript&) = delete;
+    ~LightScript();
+
+private:
+    friend class LightScriptExecutor;
+    explicit LightScript(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+    // hand the coroutine over to the executor
+    std::coroutine_handle<promise_type> Release() { auto handle = m_handle; m_handle = nullptr; return handle; }
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+/** co_await Delay(duration): resume after the given time. */
+struct Delay {
+    std::chrono::steady_clock::duration duration;
+
+    template <typename Rep, typename Period>
+    explicit Delay(std::chrono::duration<Rep, Period> d)
+        : duration(std::chrono::duration_cast<std::chrono::steady_clock::duration>(d)) {}
+
+    bool await_ready() const noexcept { return duration.count() <= 0; }
+    void await_suspend(std::coroutine_handle<LightScript::promise_type> handle) const noexcept {
+        handle.promise().wakeTime = std::chrono::steady_clock::now() + duration;
+        handle.promise().condition = nullptr;
+    }
+    void await_resume() const noexcept {}
+};
+
+/**
+ * co_await Until(condition): resume once condition() returns true, checked every executor tick.
+ * The condition is moved to the script rather than copied, so an Until can be awaited once.
+ *
+ * GCC 12 destroys a lambda written inside the co_await expression twice when the script is
+ * cancelled there. A lambda capturing a CANLight would then release the device while copies
+ * are still in use, so build such a condition before the co_await, or use Delivered or Present.
+ */
+struct Until {
+    std::function<bool()> condition;
+
+    // a constructor rather than aggregate initialization: GCC 12 destroys the members of an
+    // aggregate awaiter twice when the script is cancelled at this co_await
+    explicit Until(std::function<bool()> c) : condition(std::move(c)) {}
+
+    bool await_ready() const { return condition(); }
+    void await_suspend(std::coroutine_handle<LightScript::promise_type> handle) {
+        handle.promise().wakeTime = std::chrono::steady_clock::now();
+        handle.promise().condition = std::move(condition);
+        condition = nullptr;
+    }
+    void await_resume() const noexcept {}
+};
+
+/** co_await NextTick(): give other scripts a turn. */
+inline Delay NextTick() { return Delay(std::chrono::nanoseconds(1)); }
+
+/**
+ * Wait until every command sent to the light so far has been sent on the CAN bus and the light
+ * has broadcast its status after receiving the latest color or pattern, which takes up to two
+ * status periods. A light that is disconnected keeps the script waiting.
+ */
+inline Until Delivered(const CANLight& light) {
+    return Until{[light] { return light.GetDeliveryReport().acknowledged; }};
+}
+
+/** Wait until the light is connected. */
+inline Until Present(const CANLight& light) {
+    return Until{[light] { return light.IsPresent(); }};
+}
+
+/**
+ * Runs LightScripts on one shared thread. Each script may be tied to a device
+ * ID; starting a new script for a device cancels the one it replaces.
+ * Cancelling is cheap: the script's coroutine frame is destroyed at its
+ * current suspension point without running further.
+ */
+class LightScriptExecutor {
+public:
+    static LightScriptExecutor& GetInstance();
+
+    // returns a handle (> 0) for Cancel/IsRunning; deviceID 0 ties the script to no device
+    int Start(uint8_t deviceID, LightScript script);
+    void Cancel(int handle);
+    void CancelDevice(uint8_t deviceID);
+    bool IsRunning(int handle);
+
+private:
+    LightScriptExecutor();
+    ~LightScriptExecutor();
+
+    void Run();
+    void CancelLocked(size_t index); // m_mutex must be held
+
+    static constexpr auto kConditionPollPeriod = std::chrono::milliseconds(10);
+
+    struct Task {
+        int handle;
+        uint8_t deviceID;
+        std::coroutine_handle<LightScript::promise_type> coroutine;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    bool m_stop = false;
+    int m_nextHandle = 1;
+    int m_running = 0; // handle of the task being checked or resumed, 0 if none
+    bool m_runningCancelled = false;
+    std::vector<Task> m_tasks;
+    std::thread m_thread; // started with the first script
+};
+
+} // namespace mindsensors
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "CANLight.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace mindsensors {
+
+class LightScript;
+
+class LightSequence {
+public:
+	/**
+	 * A list of light commands and waits that runs in the background on a
+	 * CANLight, for example to flash red three times and then hold the team
+	 * color. Build the sequence with the methods below, then call
+	 * {@link #Start(CANLight&)}. Nothing in the robot loop waits while the
+	 * sequence runs, and it can be cancelled at any time.
+	 * <p>
+	 * C++ code can also write sequences directly as coroutines; see
+	 * LightScript.h.
+	 */
+	LightSequence() = default;
+
+	/** Add a {@link CANLight#ShowRGB(uint8_t, uint8_t, uint8_t)} step. */
+	void ShowRGB(uint8_t red, uint8_t green, uint8_t blue);
+
+	/** Add a {@link CANLight#ShowRegister(uint8_t)} step. */
+	void ShowRegister(uint8_t index);
+
+	/** Add a {@link CANLight#Flash(uint8_t)} step. */
+	void Flash(uint8_t index);
+
+	/** Add a {@link CANLight#Cycle(uint8_t, uint8_t)} step. */
+	void Cycle(uint8_t fromIndex, uint8_t toIndex);
+
+	/** Add a {@link CANLight#Fade(uint8_t, uint8_t)} step. */
+	void Fade(uint8_t startIndex, uint8_t endIndex);
+
+	/**
+	 * Add a pause.
+	 * 
+	 * @param seconds How long to keep showing the current color or pattern.
+	 */
+	void Wait(double seconds);
+
+	/**
+	 * Add a step that waits until every command so far has been sent on the
+	 * CAN bus, for example when the bus is busy and commands are being retried,
+	 * and the CANLight has answered with a status broadcast after the latest
+	 * color or pattern.
+	 */
+	void WaitForDelivery();
+
+	/**
+	 * @param times How many times to run the sequence. 0 repeats it until it
+	 * is cancelled. The default is 1.
+	 */
+	void SetRepeat(int times);
+
+	/**
+	 * Start running this sequence on a CANLight. Any sequence already running
+	 * on that CANLight is cancelled. The sequence is copied, so this object may
+	 * be changed or reused afterwards.
+	 * 
+	 * @return A handle for {@link #Cancel(int)} and {@link #IsRunning(int)}.
+	 */
+	int Start(CANLight& light) const;
+
+	/**
+	 * Stop a running sequence. The light keeps showing its last command.
+	 * 
+	 * @param handle The value returned by {@link #Start(CANLight&)}.
+	 */
+	static void Cancel(int handle);
+
+	/**
+	 * @param handle The value returned by {@link #Start(CANLight&)}.
+	 * @return True if the sequence has not finished or been cancelled.
+	 */
+	static bool IsRunning(int handle);
+
+private:
+	enum class StepType : uint8_t { ShowRGB, ShowRegister, Flash, Cycle, Fade, Wait, WaitForDelivery };
+	struct Step {
+		StepType type;
+		uint8_t args[3];
+		double seconds;
+	};
+
+	// plays a copy of the steps on a copy of the light, so neither needs to outlive the script
+	static LightScript Run(CANLight light, std::vector<Step> steps, int repeat);
+
+	std::vector<Step> m_steps;
+	int m_repeat = 1;
+};
+
+} // namespace mindsensors
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace mindsensors {
+
+/**
+ * A pointer that many threads use without a lock while another replaces it,
+ * such as the shared CAN transport. The replaced object's owner is released
+ * as soon as no user can still be holding it, rather than kept until exit.
+ *
+ * Users count themselves in one of two epochs before loading the pointer.
+ * Replace stores the new pointer, then moves new users to the other epoch
+ * and waits for the old one to empty, twice: a user that loaded the old
+ * pointer had registered before the store, so by then it has finished.
+ */
+template <typename T>
+class SwappablePointer {
+public:
+    explicit SwappablePointer(T* initial) : m_pointer(initial) {}
+
+    SwappablePointer(const SwappablePointer&) = delete;
+    SwappablePointer& operator=(const SwappablePointer&) = delete;
+
+    /** The current pointer, which Replace won't release while this is held. */
+    class Use {
+    public:
+        explicit Use(SwappablePointer& owner) : m_users(owner.m_users[owner.m_epoch.load() & 1]) {
+            m_users.fetch_add(1);
+            m_pointer = owner.m_pointer.load();
+        }
+        ~Use() { m_users.fetch_sub(1, std::memory_order_release); }
+
+        Use(const Use&) = delete;
+        Use& operator=(const Use&) = delete;
+
+        T* get() const { return m_pointer; }
+        T& operator*() const { return *m_pointer; }
+        T* operator->() const { return m_pointer; }
+        explicit operator bool() const { return m_pointer != nullptr; }
+
+    private:
+        std::atomic<int>& m_users;
+        T* m_pointer;
+    };
+
+    /**
+     * Point users at `pointer`, kept alive by `owner` (which may be empty for
+     * an object that outlives this one). Blocks until no Use of the previous
+     * pointer is left, then returns the previous owner.
+     */
+    std::shared_ptr<T> Replace(std::shared_ptr<T> owner, T* pointer) {
+        std::scoped_lock lock(m_replaceMutex);
+        m_pointer.store(pointer);
+        for (int pass = 0; pass < 2; pass++) {
+            unsigned previous = m_epoch.fetch_add(1) & 1;
+            while (m_users[previous].load() != 0) std::this_thread::yield();
+        }
+        m_owner.swap(owner);
+        return owner;
+    }
+
+private:
+    std::atomic<T*> m_pointer;
+    std::atomic<unsigned> m_epoch{0};
+    std::atomic<int> m_users[2] = {};
+    std::mutex m_replaceMutex;
+    std::shared_ptr<T> m_owner;
+};
+
+} // namespace mindsensors
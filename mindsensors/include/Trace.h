@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace mindsensors {
+
+/**
+ * Optional timing spans along the command path (CANLight method, handle
+ * lookup, error check, transport send, request engine, first status after a
+ * command), exported in the Chrome trace event format for chrome://tracing or
+ * ui.perfetto.dev.
+ *
+ * Each thread writes to its own fixed-size ring without locking, so tracing
+ * never makes threads wait on each other; only the oldest spans are lost if
+ * a ring fills up. When tracing is off, a span costs one relaxed atomic load.
+ * Building with CANLIGHT_DISABLE_TRACE removes the spans entirely.
+ */
+class Trace {
+public:
+    static void SetEnabled(bool enabled);
+    static bool IsEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+    // steady clock in nanoseconds, the time base of every span
+    static uint64_t Now();
+    // name must outlive the trace, e.g. a string literal; deviceID < 0 for none
+    static void Record(const char* name, uint64_t startNs, uint64_t endNs, int32_t deviceID = -1);
+
+    // every span still held, as a Chrome trace JSON document
+    static std::string DumpJSON();
+    static void Clear();
+
+    class Span {
+    public:
+        explicit Span(const char* name, int32_t deviceID = -1)
+            : m_name(IsEnabled() ? name : nullptr), m_deviceID(deviceID), m_start(m_name != nullptr ? Now() : 0) {}
+        ~Span() { if (m_name != nullptr) Record(m_name, m_start, Now(), m_deviceID); }
+
+        Span(const Span&) = delete;
+        Span& operator=(const Span&) = delete;
+
+    private:
+        const char* m_name; // nullptr if tracing was off when the span began
+        int32_t m_deviceID;
+        uint64_t m_start;
+    };
+
+private:
+    static std::atomic<bool> enabled;
+};
+
+} // namespace mindsensors
+
+#define CANLIGHT_TRACE_CONCAT_(a, b) a##b
+#define CANLIGHT_TRACE_CONCAT(a, b) CANLIGHT_TRACE_CONCAT_(a, b)
+
+// trace the rest of the enclosing scope: CANLIGHT_TRACE_SPAN("name") or CANLIGHT_TRACE_SPAN("name", deviceID)
+#ifdef CANLIGHT_DISABLE_TRACE
+#define CANLIGHT_TRACE_SPAN(...) do {} while (0)
+#else
+#define CANLIGHT_TRACE_SPAN(...) ::mindsensors::Trace::Span CANLIGHT_TRACE_CONCAT(canlightTraceSpan, __LINE__)(__VA_ARGS__)
+#endif
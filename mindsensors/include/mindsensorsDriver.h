@@ -1,18 +1,68 @@
 #pragma once
 
 #include "can_mindsensors.h"
+#include "CANTransport.h"
+#include "CANJournal.h"
+#include "SwappablePointer.h"
 // #include "FRC_NetworkCommunication/CANSessionMux.h"
 #include <hal/CAN.h>
 
+#include <memory>
+
 namespace mindsensors {
 
 class mindsensorsDriver {
+public:
+    // all mindsensors devices share one transport, the HAL unless replaced.
+    // SetTransport waits for calls still using the previous transport (and
+    // for anything holding a TransportUse) to finish, then releases it.
+    static void SetTransport(std::shared_ptr<CANTransport> transport);
+    using TransportUse = SwappablePointer<CANTransport>::Use;
+    static TransportUse GetTransport();
+
+    // record every frame sent, and every frame received by getMessage, to a
+    // journal; nullptr stops recording. Like a transport, the previous journal
+    // is released once no send or receive is recording to it.
+    static void SetJournal(std::shared_ptr<CANJournal> journal);
+
+    // bus budget: share (0 to 1) of the bus mindsensors traffic may use, measured
+    // over a sliding window; 1 disables admission control
+    static void SetBusBudget(double fraction);
+    static double GetBusBudget();
+    // share of the bus used by mindsensors frames over the window
+    static double GetBusUtilization();
+
+    // worst-case bits on the wire for an extended (29 bit ID) data frame,
+    // including stuff bits and interframe space
+    static constexpr uint32_t FrameBits(uint8_t dataSize) {
+        return 67 + 8*dataSize + (54 + 8*dataSize - 1)/4;
+    }
+    // bus load of a frame the transport repeats every periodMs
+    static constexpr uint32_t PeriodicBitsPerSecond(uint8_t dataSize, int32_t periodMs) {
+        return periodMs > 0 ? FrameBits(dataSize) * 1000 / periodMs : 0;
+    }
+
 protected:
     // note these methods begin with a lowercase character, unlike the public methods
     static void sendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t period, int32_t* status);
     // period default value should be CAN_SEND_PERIOD_NO_REPEAT, but you can't have a parameter without a default value after one with, so overload instead
 	static void sendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t* status);
+    // send once and leave any transport error in status for the caller to handle
+    static void trySendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t* status);
+    static void trySendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t period, int32_t* status);
+    // send several one-shot frames in a single transport call; errors are left
+    // in status, and the frames sent before a failure are still counted and
+    // journaled. Returns the number of frames sent.
+    static size_t sendMessages(const CANFrame* frames, size_t count, int32_t* status);
     
+    // true if a frame of this size fits in the bus budget right now, after
+    // batchedBits of frames going out in the same batch ahead of it; frames
+    // that are not optional are sent (and counted) regardless
+    static bool busBudgetAvailable(uint8_t dataSize, uint32_t batchedBits = 0);
+    // frames repeated by the transport aren't seen by the sliding window, so
+    // their senders add (and later remove) their load here
+    static void addPeriodicLoad(int64_t bitsPerSecond);
+
     static void requestMessage(uint32_t messageID, int32_t* status);
 	
     static void getMessage(uint32_t messageID, uint32_t mask, uint8_t* data, uint8_t* dataSize, int32_t* status);
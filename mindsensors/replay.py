@@ -0,0 +1,92 @@
+"""
+Inspect or replay a CAN journal recorded with ``CANLight.startJournal``::
+
+    python -m mindsensors.replay journal.bin --dump
+    python -m mindsensors.replay journal.bin --socketcan vcan0 --received
+    python -m mindsensors.replay journal.bin --speed 0.5
+
+Without ``--socketcan`` the frames are sent through the HAL, which is the
+simulated HAL when run on a desktop.
+"""
+
+import argparse
+import struct
+import sys
+import typing
+
+# must match JournalHeader and JournalRecord in CANJournal.h
+_MAGIC = b"MSCANJNL"
+_HEADER = struct.Struct("=8sIIQQ32x")
+_RECORD = struct.Struct("=QIhBB8s")
+
+SENT = 0
+RECEIVED = 1
+
+
+class Record(typing.NamedTuple):
+    time: float  # seconds since the first record
+    message_id: int
+    period_ms: int
+    direction: int
+    data: bytes
+
+
+def read(path: str) -> typing.List[Record]:
+    """The complete records in a journal, oldest first."""
+    with open(path, "rb") as f:
+        contents = f.read()
+
+    magic, version, record_size, capacity, next_ = _HEADER.unpack_from(contents)
+    if magic != _MAGIC or version != 1 or record_size != _RECORD.size:
+        raise ValueError(f"{path} is not a CAN journal written by this library version")
+
+    records = []
+    for i in range(max(0, next_ - capacity), next_):
+        time_ns, message_id, period_ms, direction, size, data = _RECORD.unpack_from(
+            contents, _HEADER.size + (i % capacity) * _RECORD.size
+        )
+        if time_ns == 0:  # never finished
+            continue
+        records.append((time_ns, message_id, period_ms, direction, data[:size]))
+
+    base = records[0][0] if records else 0
+    return [Record((r[0] - base) / 1e9, *r[1:]) for r in records]
+
+
+def dump(records: typing.List[Record], out=sys.stdout) -> None:
+    for r in records:
+        direction = "rx" if r.direction == RECEIVED else "tx"
+        period = f" every {r.period_ms}ms" if r.period_ms > 0 else ""
+        print(
+            f"{r.time:12.6f} {direction} {r.message_id:08x} device {r.message_id & 0x3F:2d} [{r.data.hex(' ')}]{period}",
+            file=out,
+        )
+
+
+def main(argv=None) -> int:
+    parser = argparse.ArgumentParser(
+        prog="python -m mindsensors.replay",
+        description="Inspect or replay a CANLight journal",
+    )
+    parser.add_argument("journal")
+    parser.add_argument("--dump", action="store_true", help="print the frames instead of sending them")
+    parser.add_argument("--socketcan", metavar="INTERFACE", help="send through SocketCAN (e.g. vcan0) instead of the HAL")
+    parser.add_argument("--received", action="store_true", help="also send the frames the CANLights sent")
+    parser.add_argument("--speed", type=float, default=1.0, help="playback speed (default 1)")
+    args = parser.parse_args(argv)
+
+    if args.dump:
+        dump(read(args.journal))
+        return 0
+
+    from ._mindsensors import CANLight
+
+    if args.socketcan:
+        CANLight.useSocketCANTransport(args.socketcan)
+    sent = CANLight.replayJournal(args.journal, args.received, args.speed)
+    print(f"sent {sent} frames")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
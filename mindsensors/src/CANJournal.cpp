@@ -0,0 +1,180 @@
+#include "CANJournal.h"
+
+#include <string.h> /* for memcpy, memset, strerror */
+#include <errno.h>
+
+#include <algorithm> /* for std::min, std::clamp, std::find */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream> /* for printing file errors */
+#include <new> /* for placement new */
+#include <thread> /* for std::this_thread::sleep_until */
+#include <vector>
+
+#include "hal/CAN.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h> /* for close, ftruncate */
+#endif
+
+using namespace mindsensors;
+
+static constexpr char JOURNAL_MAGIC[8] = {'M', 'S', 'C', 'A', 'N', 'J', 'N', 'L'};
+
+static uint64_t TimeNs() {
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#ifndef _WIN32
+
+CANJournal::CANJournal(const char* path, uint64_t capacity, int32_t* status) {
+    if (capacity == 0) capacity = 1;
+    size_t size = sizeof(JournalHeader) + capacity * sizeof(JournalRecord);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        std::cerr << "ERROR: could not create CAN journal " << path << ": " << strerror(errno) << std::endl;
+        if (fd >= 0) close(fd);
+        *status = HAL_ERR_CANSessionMux_NotAllowed;
+        return;
+    }
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    if (mapping == MAP_FAILED) {
+        std::cerr << "ERROR: could not map CAN journal " << path << ": " << strerror(errno) << std::endl;
+        *status = HAL_ERR_CANSessionMux_NotAllowed;
+        return;
+    }
+
+    // the file was truncated, so every record starts out zero (unwritten)
+    m_mappedSize = size;
+    m_capacity = capacity;
+    m_header = new (mapping) JournalHeader;
+    memcpy(m_header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    m_header->version = kVersion;
+    m_header->recordSize = sizeof(JournalRecord);
+    m_header->capacity = capacity;
+    m_header->next.store(0);
+    m_records = reinterpret_cast<JournalRecord*>(m_header + 1);
+}
+
+CANJournal::~CANJournal() {
+    if (m_header != nullptr) munmap(m_header, m_mappedSize);
+}
+
+void CANJournal::Flush() {
+    if (m_header != nullptr) msync(m_header, m_mappedSize, MS_ASYNC);
+}
+
+#else
+
+CANJournal::CANJournal(const char* path, uint64_t capacity, int32_t* status) {
+    fprintf(stderr, "ERROR: CAN journals are not available on Windows.\n");
+    *status = HAL_ERR_CANSessionMux_NotAllowed;
+}
+
+CANJournal::~CANJournal() {}
+
+void CANJournal::Flush() {}
+
+#endif
+
+/**
+ * Claim the next slot and fill it. The time is written last, so a reader can
+ * tell a complete record (non-zero time) from one still being written.
+ */
+void CANJournal::Record(Direction direction, uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t periodMs) {
+    if (m_records == nullptr) return;
+    uint64_t index = m_header->next.fetch_add(1, std::memory_order_relaxed);
+    JournalRecord& record = m_records[index % m_capacity];
+
+    std::atomic_ref<uint64_t> time(record.timeNs);
+    time.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    record.messageID = messageID;
+    record.periodMs = (int16_t) std::clamp<int32_t>(periodMs, INT16_MIN, INT16_MAX);
+    record.direction = direction;
+    record.dataSize = std::min<uint8_t>(dataSize, 8);
+    memset(record.data, 0, sizeof(record.data));
+    if (data != nullptr) memcpy(record.data, data, record.dataSize);
+    time.store(TimeNs(), std::memory_order_release);
+}
+
+#ifndef _WIN32
+
+size_t CANJournal::Replay(const char* path, CANTransport& transport, bool includeReceived, double speed, int32_t* status) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    off_t size = fd < 0 ? -1 : lseek(fd, 0, SEEK_END);
+    if (size < (off_t) sizeof(JournalHeader)) {
+        std::cerr << "ERROR: could not read CAN journal " << path << ": " << (fd < 0 ? strerror(errno) : "file too short") << std::endl;
+        if (fd >= 0) close(fd);
+        *status = HAL_ERR_CANSessionMux_NotAllowed;
+        return 0;
+    }
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "ERROR: could not map CAN journal " << path << ": " << strerror(errno) << std::endl;
+        *status = HAL_ERR_CANSessionMux_NotAllowed;
+        return 0;
+    }
+
+    const JournalHeader* header = static_cast<const JournalHeader*>(mapping);
+    if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 || header->version != kVersion
+            || header->recordSize != sizeof(JournalRecord)
+            || (uint64_t) size < sizeof(JournalHeader) + header->capacity * sizeof(JournalRecord)) {
+        std::cerr << "ERROR: " << path << " is not a CAN journal written by this library version" << std::endl;
+        munmap(mapping, size);
+        *status = HAL_ERR_CANSessionMux_NotAllowed;
+        return 0;
+    }
+
+    const JournalRecord* records = reinterpret_cast<const JournalRecord*>(header + 1);
+    uint64_t next = header->next.load();
+    uint64_t first = next > header->capacity ? next - header->capacity : 0;
+    if (speed <= 0) speed = 1;
+
+    std::vector<uint32_t> periodicIDs;
+    size_t sent = 0;
+    uint64_t baseNs = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (uint64_t i = first; i < next && *status == 0; i++) {
+        const JournalRecord& record = records[i % header->capacity];
+        if (record.timeNs == 0) continue; // never finished
+        if (record.direction == Received && !includeReceived) continue;
+
+        if (baseNs == 0) baseNs = record.timeNs;
+        if (record.timeNs > baseNs) {
+            std::this_thread::sleep_until(start + std::chrono::nanoseconds((int64_t) ((record.timeNs - baseNs) / speed)));
+        }
+
+        int32_t periodMs = record.direction == Sent ? record.periodMs : HAL_CAN_SEND_PERIOD_NO_REPEAT;
+        transport.SendMessage(record.messageID, record.data, record.dataSize, periodMs, status);
+        if (periodMs > 0 && std::find(periodicIDs.begin(), periodicIDs.end(), record.messageID) == periodicIDs.end()) {
+            periodicIDs.push_back(record.messageID);
+        }
+        sent++;
+    }
+
+    for (uint32_t messageID : periodicIDs) {
+        int32_t stopStatus = 0;
+        transport.SendMessage(messageID, nullptr, 0, HAL_CAN_SEND_PERIOD_STOP_REPEATING, &stopStatus);
+    }
+    munmap(mapping, size);
+    return sent;
+}
+
+#else
+
+size_t CANJournal::Replay(const char* path, CANTransport& transport, bool includeReceived, double speed, int32_t* status) {
+    fprintf(stderr, "ERROR: CAN journals are not available on Windows.\n");
+    *status = HAL_ERR_CANSessionMux_NotAllowed;
+    return 0;
+}
+
+#endif
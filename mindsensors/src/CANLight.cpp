@@ -1,23 +1,113 @@
 #include "CANLight.h"
 
 #include "CANLightDriver.h"
+#include "Trace.h"
 
 #include <string>
 using std::string;
 #include <math.h>
+#include <algorithm> /* for std::min */
 
 #include <frc/Errors.h>
 
+#include <memory>
+#include <mutex>
+
 using namespace mindsensors;
 
+// FRC_CheckErrorStatus for the command path, where it is traced
+#define CheckCommandStatus(status, deviceID) \
+	do { \
+		CANLIGHT_TRACE_SPAN("FRC_CheckErrorStatus", deviceID); \
+		FRC_CheckErrorStatus(status, "CAN ID {}", deviceID); \
+	} while (0)
+
+static_assert(CANLight::kMetadataLength == CANLIGHT_METADATA_LENGTH, "CANLight metadata buffers must match the driver");
+
 /**
  * @return The version of this library in the format <code>major.minor</code>,
  * for example: "1.1"
  */
-string CANLight::GetLibraryVersion() {
+std::string_view CANLight::GetLibraryVersion() {
     return CANLight_GetLibraryVersion();
 }
 
+void CANLight::UseHALTransport() {
+    CANLight_UseHALTransport();
+}
+
+void CANLight::UseSocketCANTransport(const string& interfaceName) {
+	int32_t status = 0;
+	CANLight_UseSocketCANTransport(interfaceName.c_str(), &status);
+	FRC_CheckErrorStatus(status, "SocketCAN interface {}", interfaceName);
+}
+void CANLight::SetBusBudget(double fraction) {
+    if (fraction < 0 || fraction > 1) throw std::out_of_range("Bus budget must be between 0 and 1.");
+    CANLight_SetBusBudget(fraction);
+}
+
+double CANLight::GetBusUtilization() {
+    return CANLight_GetBusUtilization();
+}
+
+void CANLight::StartJournal(const string& path, size_t capacity) {
+	if (capacity == 0) throw std::invalid_argument("Journal capacity must be positive.");
+	int32_t status = 0;
+	CANLight_StartJournal(path.c_str(), capacity, &status);
+	FRC_CheckErrorStatus(status, "CAN journal {}", path);
+}
+
+void CANLight::StopJournal() {
+	CANLight_StopJournal();
+}
+
+size_t CANLight::ReplayJournal(const string& path, bool includeReceived, double speed) {
+	if (speed <= 0) throw std::invalid_argument("Replay speed must be positive.");
+	int32_t status = 0;
+	size_t retVal = CANLight_ReplayJournal(path.c_str(), includeReceived, speed, &status);
+	FRC_CheckErrorStatus(status, "CAN journal {}", path);
+	return retVal;
+}
+
+void CANLight::SetTraceEnabled(bool enabled) {
+	CANLight_SetTraceEnabled(enabled);
+}
+
+void CANLight::ClearTrace() {
+	CANLight_ClearTrace();
+}
+
+void CANLight::WriteTrace(const string& path) {
+	int32_t status = 0;
+	CANLight_WriteTrace(path.c_str(), &status);
+	FRC_CheckErrorStatus(status, "CANLight trace {}", path);
+}
+
+std::vector<uint8_t> CANLight::Discover(double timeout) {
+    if (timeout < 0) throw std::invalid_argument("Time/duration must be positive.");
+	int32_t status = 0;
+	uint64_t found = CANLight_Discover((uint32_t) std::round(timeout * 1000), &status);
+	FRC_CheckErrorStatus(status, "{}", "CANLight discovery");
+
+	std::vector<uint8_t> retVal;
+	for (uint8_t id = 1; id <= 60; id++) {
+		if (found & (uint64_t(1) << id)) retVal.push_back(id);
+	}
+	return retVal;
+}
+
+class CANLight::Owner {
+public:
+	Owner(int handle, uint8_t deviceID) : m_handle(handle), m_deviceID(deviceID) {}
+	~Owner();
+
+	Owner(const Owner&) = delete;
+	Owner& operator=(const Owner&) = delete;
+
+private:
+	int m_handle;
+	uint8_t m_deviceID;
+};
 
 CANLight::CANLight(uint8_t deviceNumber)  : m_deviceID(deviceNumber) {
     if (deviceNumber > 60 || deviceNumber < 1) throw std::invalid_argument("Device number must be between 1 and 60.");
@@ -25,6 +115,7 @@ CANLight::CANLight(uint8_t deviceNumber)  : m_deviceID(deviceNumber) {
 	int handle = CANLight_Constructor(deviceNumber, &status);
     FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
     m_handle = handle;
+    m_owner = std::make_shared<Owner>(handle, deviceNumber);
 }
 
 uint8_t CANLight::GetDeviceID() const {
@@ -34,95 +125,118 @@ uint8_t CANLight::GetDeviceID() const {
 	return retVal;
 }
 
-string CANLight::GetDeviceName() const {
+std::string CANLight::GetDeviceName() const {
+	char buffer[kMetadataLength];
 	int32_t status = 0;
-	const char* retVal = CANLight_GetDeviceName(m_handle, &status);
+	size_t length = CANLight_GetDeviceName(m_handle, buffer, kMetadataLength, &status);
 	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
-	return retVal;
+	return std::string(buffer, std::min(length, kMetadataLength - 1));
 }
 
-string CANLight::GetFirmwareVersion() const {
+std::string CANLight::GetFirmwareVersion() const {
+	char buffer[kMetadataLength];
 	int32_t status = 0;
-	const char* retVal = CANLight_GetFirmwareVersion(m_handle, &status);
+	size_t length = CANLight_GetFirmwareVersion(m_handle, buffer, kMetadataLength, &status);
 	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
-	return retVal;
+	return std::string(buffer, std::min(length, kMetadataLength - 1));
 }
 
-string CANLight::GetHardwareVersion() const {
+std::string CANLight::GetHardwareVersion() const {
+	char buffer[kMetadataLength];
 	int32_t status = 0;
-	const char* retVal = CANLight_GetHardwareVersion(m_handle, &status);
+	size_t length = CANLight_GetHardwareVersion(m_handle, buffer, kMetadataLength, &status);
 	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
-	return retVal;
+	return std::string(buffer, std::min(length, kMetadataLength - 1));
 }
 
-string CANLight::GetBootloaderVersion() const {
+std::string CANLight::GetBootloaderVersion() const {
+	char buffer[kMetadataLength];
 	int32_t status = 0;
-	const char* retVal = CANLight_GetBootloaderVersion(m_handle, &status);
+	size_t length = CANLight_GetBootloaderVersion(m_handle, buffer, kMetadataLength, &status);
 	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
-	return retVal;
+	return std::string(buffer, std::min(length, kMetadataLength - 1));
 }
 
-string CANLight::GetSerialNumber() const {
+std::string CANLight::GetSerialNumber() const {
+	char buffer[kMetadataLength];
 	int32_t status = 0;
-	const char* retVal = CANLight_GetSerialNumber(m_handle, &status);
+	size_t length = CANLight_GetSerialNumber(m_handle, buffer, kMetadataLength, &status);
 	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
-	return retVal;
+	return std::string(buffer, std::min(length, kMetadataLength - 1));
 }
 
+void CANLight::RefreshInfo() {
+	int32_t status = 0;
+	CANLight_RefreshMetadata(m_handle, &status);
+	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+}
 
-void CANLight::BlinkLED(uint8_t seconds) {
+uint32_t CANLight::BlinkLED(uint8_t seconds) {
+	CANLIGHT_TRACE_SPAN("CANLight::BlinkLED", m_deviceID);
 	int32_t status = 0;
   if (seconds == 0) seconds = 1;
-	CANLight_BlinkLED(m_handle, seconds, &status);
-	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+	uint32_t sequence = CANLight_BlinkLED(m_handle, seconds, &status);
+	CheckCommandStatus(status, m_deviceID);
+	return sequence;
 }
 
-void CANLight::ShowRGB(uint8_t red, uint8_t green, uint8_t blue) {
+uint32_t CANLight::ShowRGB(uint8_t red, uint8_t green, uint8_t blue) {
+	CANLIGHT_TRACE_SPAN("CANLight::ShowRGB", m_deviceID);
 	int32_t status = 0;
-	CANLight_ShowRGB(m_handle, red, green, blue, &status);
-	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+	uint32_t sequence = CANLight_ShowRGB(m_handle, red, green, blue, &status);
+	CheckCommandStatus(status, m_deviceID);
+	return sequence;
 }
 
-void CANLight::ShowRGB(frc::Color8Bit color) {
-	ShowRGB(color.red, color.green, color.blue);
+uint32_t CANLight::ShowRGB(frc::Color8Bit color) {
+	return ShowRGB(color.red, color.green, color.blue);
 }
 
-void CANLight::WriteRegister(uint8_t index, double time, uint8_t red, uint8_t green, uint8_t blue) {
+uint32_t CANLight::WriteRegister(uint8_t index, double time, uint8_t red, uint8_t green, uint8_t blue) {
+	CANLIGHT_TRACE_SPAN("CANLight::WriteRegister", m_deviceID);
     if (index > 7) throw std::out_of_range("Index must be between 0 and 7.");
     if (time < 0) throw std::invalid_argument("Time/duration must be positive.");
     if (time > 2.550) time = 2.550;
     uint8_t centiseconds = (uint8_t)std::round(time*1000/10); // multiply by 1000 for milliseconds, divide by 10 for increment size
     //if (centiseconds > 255) centiseconds = 255; // centiseconds already uint8_t
   int32_t status = 0;
-	CANLight_WriteRegister(m_handle, index, centiseconds, red, green, blue, &status);
-	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+	uint32_t sequence = CANLight_WriteRegister(m_handle, index, centiseconds, red, green, blue, &status);
+	CheckCommandStatus(status, m_deviceID);
+	return sequence;
 }
 
-void CANLight::WriteRegister(uint8_t index, double time, frc::Color8Bit color) {
-	WriteRegister(index, time, color.red, color.green, color.blue);
+uint32_t CANLight::WriteRegister(uint8_t index, double time, frc::Color8Bit color) {
+	return WriteRegister(index, time, color.red, color.green, color.blue);
 }
 
-void CANLight::Reset() {
+uint32_t CANLight::Reset() {
+	CANLIGHT_TRACE_SPAN("CANLight::Reset", m_deviceID);
 	int32_t status = 0;
-	CANLight_Reset(m_handle, &status);
-	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+	uint32_t sequence = CANLight_Reset(m_handle, &status);
+	CheckCommandStatus(status, m_deviceID);
+	return sequence;
 }
 
-void CANLight::ShowRegister(uint8_t index) {
+uint32_t CANLight::ShowRegister(uint8_t index) {
+	CANLIGHT_TRACE_SPAN("CANLight::ShowRegister", m_deviceID);
     if (index > 7) throw std::out_of_range("Index must be between 0 and 7.");
 	int32_t status = 0;
-	CANLight_ShowRegister(m_handle, index, &status);
-	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+	uint32_t sequence = CANLight_ShowRegister(m_handle, index, &status);
+	CheckCommandStatus(status, m_deviceID);
+	return sequence;
 }
 
-void CANLight::Flash(uint8_t index) {
+uint32_t CANLight::Flash(uint8_t index) {
+	CANLIGHT_TRACE_SPAN("CANLight::Flash", m_deviceID);
     if (index > 7) throw std::out_of_range("Index must be between 0 and 7.");
 	int32_t status = 0;
-	CANLight_Flash(m_handle, index, &status);
-	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+	uint32_t sequence = CANLight_Flash(m_handle, index, &status);
+	CheckCommandStatus(status, m_deviceID);
+	return sequence;
 }
 
-void CANLight::Cycle(uint8_t fromIndex, uint8_t toIndex) {
+uint32_t CANLight::Cycle(uint8_t fromIndex, uint8_t toIndex) {
+	CANLIGHT_TRACE_SPAN("CANLight::Cycle", m_deviceID);
     if (fromIndex > 7 || toIndex > 7) throw std::out_of_range("Indices must be between 0 and 7.");
     if (fromIndex > toIndex) { // swap
         int temp = fromIndex;
@@ -130,11 +244,13 @@ void CANLight::Cycle(uint8_t fromIndex, uint8_t toIndex) {
         toIndex = temp;
     }
 	int32_t status = 0;
-	CANLight_Cycle(m_handle, fromIndex, toIndex, &status);
-	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+	uint32_t sequence = CANLight_Cycle(m_handle, fromIndex, toIndex, &status);
+	CheckCommandStatus(status, m_deviceID);
+	return sequence;
 }
 
-void CANLight::Fade(uint8_t startIndex, uint8_t endIndex) {
+uint32_t CANLight::Fade(uint8_t startIndex, uint8_t endIndex) {
+	CANLIGHT_TRACE_SPAN("CANLight::Fade", m_deviceID);
     if (startIndex > 7 || endIndex > 7) throw std::out_of_range("Indices must be between 0 and 7.");
     if (startIndex > endIndex) { // swap
         int temp = startIndex;
@@ -142,13 +258,143 @@ void CANLight::Fade(uint8_t startIndex, uint8_t endIndex) {
         endIndex = temp;
     }
 	int32_t status = 0;
-	CANLight_Fade(m_handle, startIndex, endIndex, &status);
-	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+	uint32_t sequence = CANLight_Fade(m_handle, startIndex, endIndex, &status);
+	CheckCommandStatus(status, m_deviceID);
+	return sequence;
 }
 
 double CANLight::GetBatteryVoltage() const {
+	CANLIGHT_TRACE_SPAN("CANLight::GetBatteryVoltage", m_deviceID);
     int32_t status = 0;
 	double retVal = CANLight_GetBatteryVoltage(m_handle, &status);
-	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+	CheckCommandStatus(status, m_deviceID);
     return retVal;
 }
+
+void CANLight::SetHoldPeriod(double period) {
+    if (period != 0 && (period < 0.01 || period > 10)) throw std::out_of_range("Hold period must be 0 or between 0.01 and 10 seconds.");
+	int32_t status = 0;
+	CANLight_SetHoldPeriod(m_handle, (uint16_t) std::round(period*1000), &status);
+	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+}
+
+CANLight::DeliveryReport CANLight::GetDeliveryReport() const {
+	int32_t status = 0;
+	CANLight_DeliveryReport report;
+	CANLight_GetDeliveryReport(m_handle, &report, &status);
+	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+
+	DeliveryReport retVal;
+	retVal.lastIssued = report.lastIssued;
+	retVal.lastDelivered = report.lastDelivered;
+	retVal.delivered = report.delivered;
+	retVal.retries = report.retries;
+	retVal.superseded = report.superseded;
+	retVal.dropped = report.dropped;
+	retVal.throttled = report.throttled;
+	retVal.pending = report.pending;
+	retVal.synchronized = report.synchronized;
+	retVal.acknowledged = report.acknowledged;
+	return retVal;
+}
+
+CANLight::CommandStatus CANLight::GetCommandStatus(uint32_t sequence) const {
+	int32_t status = 0;
+	CANLight_CommandStatus retVal = CANLight_GetCommandStatus(m_handle, sequence, &status);
+	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+	return (CommandStatus) retVal;
+}
+
+std::vector<CANLight::Telemetry> CANLight::GetTelemetry() {
+	CANLight_Telemetry entries[64];
+	size_t count = CANLight_GetTelemetry(entries, 64);
+
+	std::vector<Telemetry> retVal(count);
+	for (size_t i = 0; i < count; i++) {
+		retVal[i].deviceID = entries[i].deviceID;
+		retVal[i].present = entries[i].present;
+		retVal[i].batteryVoltage = entries[i].batteryVoltage;
+		retVal[i].statusAgeMs = entries[i].statusAgeMs == UINT32_MAX ? -1 : (int64_t) entries[i].statusAgeMs;
+		retVal[i].pending = entries[i].pending;
+		retVal[i].synchronized = entries[i].synchronized;
+		retVal[i].governorLevel = entries[i].governorLevel;
+		retVal[i].governorTransitions = entries[i].governorTransitions;
+	}
+	return retVal;
+}
+
+void CANLight::EnableGovernor(const Governor& settings) {
+    if (settings.criticalVoltage < 0 || settings.criticalVoltage > settings.reducedVoltage || settings.reducedVoltage > 30) throw std::out_of_range("Governor voltages must satisfy 0 <= critical <= reduced <= 30.");
+    if (settings.hysteresis < 0 || settings.hysteresis > 5) throw std::out_of_range("Governor hysteresis must be between 0 and 5 volts.");
+    if (settings.reducedBrightness < 0 || settings.reducedBrightness > 1 || settings.criticalBrightness < 0 || settings.criticalBrightness > 1) throw std::out_of_range("Governor brightness must be between 0 and 1.");
+    if (settings.reducedUpdatePeriod < 0 || settings.reducedUpdatePeriod > 10 || settings.criticalUpdatePeriod < 0 || settings.criticalUpdatePeriod > 10) throw std::out_of_range("Governor update periods must be between 0 and 10 seconds.");
+	CANLight_GovernorSettings driverSettings;
+	driverSettings.reducedMillivolts = (uint16_t) std::round(settings.reducedVoltage*1000);
+	driverSettings.criticalMillivolts = (uint16_t) std::round(settings.criticalVoltage*1000);
+	driverSettings.hysteresisMillivolts = (uint16_t) std::round(settings.hysteresis*1000);
+	driverSettings.reducedBrightness = (uint16_t) std::round(settings.reducedBrightness*256);
+	driverSettings.criticalBrightness = (uint16_t) std::round(settings.criticalBrightness*256);
+	driverSettings.reducedIntervalMs = (uint16_t) std::round(settings.reducedUpdatePeriod*1000);
+	driverSettings.criticalIntervalMs = (uint16_t) std::round(settings.criticalUpdatePeriod*1000);
+	CANLight_SetGovernor(&driverSettings);
+}
+
+void CANLight::EnableGovernor() {
+	EnableGovernor(Governor());
+}
+
+void CANLight::DisableGovernor() {
+	CANLight_SetGovernor(nullptr);
+}
+
+bool CANLight::IsPresent() const {
+	int32_t status = 0;
+	bool retVal = CANLight_IsPresent(m_handle, &status);
+	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+	return retVal;
+}
+
+// presence callbacks are kept here, one per device ID, rather than in CANLight
+// objects, which may be copied. Each is tagged with the handle it was set
+// through: the driver calls the trampoline with that handle, so a call still
+// on its way after the CANLight was destroyed can't reach the next owner's
+// callback. Only the pointers are touched under the lock: copying or
+// destroying a function that wraps a Python callable takes the GIL, and a
+// Python thread holding the GIL may be waiting for this lock in
+// SetPresenceCallback.
+struct PresenceCallback {
+	int handle;
+	std::function<void(bool)> function;
+};
+static std::mutex presenceCallbacksMutex;
+static std::shared_ptr<const PresenceCallback> presenceCallbacks[64];
+
+static void PresenceCallbackTrampoline(void* param, uint8_t deviceID, HAL_Bool present) {
+	std::shared_ptr<const PresenceCallback> callback;
+	{
+		std::scoped_lock lock(presenceCallbacksMutex);
+		callback = presenceCallbacks[deviceID & 63];
+	}
+	if (callback && callback->handle == (int) (intptr_t) param && callback->function) callback->function(present);
+}
+
+void CANLight::SetPresenceCallback(std::function<void(bool present)> callback) {
+	std::shared_ptr<const PresenceCallback> replacement = std::make_shared<PresenceCallback>(PresenceCallback{m_handle, std::move(callback)});
+	{
+		std::scoped_lock lock(presenceCallbacksMutex);
+		presenceCallbacks[m_deviceID & 63].swap(replacement);
+	} // `replacement` now holds the previous callback, released after the lock
+	int32_t status = 0;
+	CANLight_SetPresenceCallback(m_handle, PresenceCallbackTrampoline, (void*) (intptr_t) m_handle, &status);
+	FRC_CheckErrorStatus(status, "CAN ID {}", m_deviceID);
+}
+
+CANLight::Owner::~Owner() {
+	CANLight_Destructor(m_handle);
+	std::shared_ptr<const PresenceCallback> previous;
+	{
+		std::scoped_lock lock(presenceCallbacksMutex);
+		std::shared_ptr<const PresenceCallback>& current = presenceCallbacks[m_deviceID & 63];
+		if (current && current->handle == m_handle) current.swap(previous); // unless a new owner set one already
+	} // released after the lock, as in SetPresenceCallback
+}
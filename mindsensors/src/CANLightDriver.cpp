@@ -1,103 +1,238 @@
 #include "CANLightDriver.h"
+#include "CANLightMonitor.h"
+#include "Trace.h"
 
 #include <string>
 using std::string;
 #include <iostream> /* for printing library version in extern "C" portion */
 #include <fstream> /* for writing device information to file */
 #include <chrono> /* for GetBatteryVoltage grace period */
+#include <algorithm> /* for std::copy, std::move */
+#include <bit> /* for std::countr_zero */
+#include <thread> /* for sleep_for */
+#include <type_traits>
 
 #include <unistd.h> /* for usleep */
 
 #include "hal/FRCUsageReporting.h"
-#include "hal/handles/IndexedClassedHandleResource.h"
 #include "hal/CAN.h"
 
 using namespace mindsensors;
 
-hal::IndexedHandleResource<CANLight_Handle, uint8_t, 63, hal::HAL_HandleEnum::Vendor> CANLightDriver::canlightHandles;
+static constexpr char LIBRARY_VERSION[] = "1.7";
+static constexpr uint8_t MINIMUM_REQUIRED_FIRMWARE_MAJOR = 1;
+static constexpr uint8_t MINIMUM_REQUIRED_FIRMWARE_MINOR = 2;
 
-const string LIBRARY_VERSION = "1.7";
-const string MINIMUM_REQUIRED_FIRMWARE_VERSION = "1.2";
-
-string CANLightDriver::GetLibraryVersion() {
-    //fprintf(stderr, "mindsensors CANLight library version: %s\n", LIBRARY_VERSION.c_str());
+std::string_view CANLightDriver::GetLibraryVersion() {
+    //fprintf(stderr, "mindsensors CANLight library version: %s\n", LIBRARY_VERSION);
     return LIBRARY_VERSION;
 }
 
+/** Copy a string out of a CAN frame, stopping at the first null byte. */
+static void CopyFrameString(char* dest, const uint8_t* data, uint8_t dataSize) {
+    int i = 0;
+    for (; i < dataSize && i < CANLIGHT_METADATA_LENGTH - 1; i++) {
+        if (data[i] == 0) break;
+        dest[i] = (char) data[i];
+    }
+    dest[i] = '\0';
+}
+
+// handles are laid out as HAL handles are: type << 24 | generation << 16 | index
+static CANLight_Handle MakeHandle(uint8_t deviceID, uint8_t generation) {
+    return ((int32_t) hal::HAL_HandleEnum::Vendor << 24) | ((int32_t) generation << 16) | deviceID;
+}
+
+/** Take a reference on an open handle's slot; returns its device ID, or 0 if the handle is not open. */
+static uint8_t AcquireSlot(CANLight_Handle handle) {
+    int32_t index = handle & 0xFFFF;
+    if ((handle >> 24) != (int32_t) hal::HAL_HandleEnum::Vendor || index < 1 || index > 60) return 0;
+    CANLightTable& table = CANLightTable::GetInstance();
+    if (!table.TryRef(index, (handle >> 16) & 0xFF)) return 0; // destroyed, maybe with the ID taken again
+    if (!(table.open.load() & (uint64_t(1) << index))) { // closed, only calls are left
+        table.Unref(index);
+        return 0;
+    }
+    return index;
+}
+
 /** The CANLight can hold a sequence of up to eight colors and associated durations. */
-CANLightDriver::CANLightDriver(int8_t deviceNumber, int32_t* status) {
-    if (*status != 0) return;
+CANLightDriver::CANLightDriver(uint8_t deviceID)
+    : m_table(CANLightTable::GetInstance()), m_deviceID(deviceID), m_frames(CANLightTable::Frames(deviceID)),
+      m_commands(m_table.commands[deviceID]), m_sendMutex(m_table.pending[deviceID].sendMutex),
+      m_pendingMutex(m_table.pending[deviceID].mutex), m_pending(m_table.pending[deviceID].commands) {}
 
-    m_deviceID = deviceNumber;
+CANLightDriver::CANLightDriver(CANLight_Handle handle) : CANLightDriver(AcquireSlot(handle)) {
+    m_holdsReference = m_deviceID != 0;
+}
 
-    uint8_t data[8];
-    uint8_t dataSize;
-    uint32_t timeoutMs = 100; // try to get each value for 100ms before giving up
-    
-    bool failedToGetMessage = false; 
-    
-    // get name
-    requestMessage(MSR_DEVNAME | m_deviceID, data, &dataSize, timeoutMs, status);
-    if (*status != HAL_ERR_CANSessionMux_MessageNotFound) {
-        m_deviceName = "";
-        for (int i = 0; i < dataSize; i++) {
-            if (data[i] == 0) break;
-            m_deviceName += (char) data[i];
+CANLightDriver::~CANLightDriver() {
+    if (m_holdsReference) m_table.Unref(m_deviceID);
+}
+
+// how long a new CANLight waits for a closed one with the same ID to be let go
+static constexpr auto kReleaseWait = std::chrono::seconds(1);
+
+/**
+ * The ID is claimed first, so a duplicate fails before spending up to a
+ * second looking for the device. A slot whose handle was closed but which a
+ * call or the monitor still references is waited for instead.
+ */
+CANLight_Handle CANLightDriver::Open(int8_t deviceNumber, int32_t* status) {
+    CANLightTable& table = CANLightTable::GetInstance();
+    uint8_t id = deviceNumber;
+    uint64_t bit = uint64_t(1) << id;
+    uint8_t generation;
+    auto deadline = std::chrono::steady_clock::now() + kReleaseWait;
+    while (!table.Claim(id, &generation)) {
+        if ((table.owned.load() & bit) || std::chrono::steady_clock::now() >= deadline) {
+            *status = NO_AVAILABLE_RESOURCES;
+            return HAL_kInvalidHandle;
         }
-    } else {
-        fprintf(stderr, "ERROR: CANLight with ID %d not found. This instance has been disabled.\n", m_deviceID);
-        state = State::NotFound;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    table.owned.fetch_or(bit);
+
+    CANLightDriver driver(id); // the claim's reference becomes the handle's
+    if (!driver.FetchMetadata(100, status)) { // try to get each value for 100ms before giving up
+        fprintf(stderr, "ERROR: CANLight with ID %d not found. This instance has been disabled until it is connected.\n", id);
+        driver.SetState(State::NotFound);
         *status = 0;
-        failedToGetMessage = true; // don't try to get other versions
     }
+    table.monitor[id].lastDiscovery = std::chrono::steady_clock::now();
+
+    table.open.fetch_or(bit);
+    CANLightMonitor::GetInstance().Start();
+    return MakeHandle(id, generation);
+}
+
+/**
+ * The slot is only cleared by the next Open of the ID, once the calls still
+ * running through this handle and the monitor's pass have let go of it.
+ */
+void CANLightDriver::Close(CANLight_Handle handle) {
+    CANLightDriver driver(handle);
+    if (!driver) return;
+    uint64_t bit = uint64_t(1) << driver.m_deviceID;
+    if (!(driver.m_table.open.fetch_and(~bit) & bit)) return; // closed by another thread meanwhile
+
+    int32_t status = 0;
+    driver.SetHoldPeriod(0, &status); // the transport would otherwise keep repeating it
+    driver.SetPresenceCallback(nullptr);
+    driver.m_table.owned.fetch_and(~bit);
+    driver.m_table.Unref(driver.m_deviceID); // the handle's reference
+}
+
+/**
+ * Read the name, versions and serial number from the device, and check that
+ * its firmware is supported. The values are gathered first and swapped in
+ * under the metadata lock so that readers never wait on the CAN bus.
+ */
+bool CANLightDriver::FetchMetadata(uint32_t timeoutMs, int32_t* status) {
+    std::scoped_lock fetchLock(m_table.fetchMutex[m_deviceID]);
+    return FetchMetadataLocked(timeoutMs, status);
+}
+
+bool CANLightDriver::FetchMetadataLocked(uint32_t timeoutMs, int32_t* status) {
+    Metadata metadata;
+    uint8_t data[8];
+    uint8_t dataSize = 0;
+    
+    // get name
+    requestMessage(m_frames.Get<messages::DeviceName>(), data, &dataSize, timeoutMs, status);
+    if (*status == HAL_ERR_CANSessionMux_MessageNotFound) return false; // don't try to get other versions
+    CopyFrameString(metadata.deviceName, data, dataSize);
 
     // get firmware, hardware, bootloader versions
-    if (!failedToGetMessage) {
-        requestMessage(MSR_FIRMWARE_VERSION | m_deviceID, data, &dataSize, timeoutMs, status);
-        if (*status != HAL_ERR_CANSessionMux_MessageNotFound) {
-            m_firmwareVersion   = std::to_string(data[0]) + "." + std::to_string(data[1]);
-            m_hardwareVersion   = std::to_string(data[2]) + "." + std::to_string(data[3]);
-            m_bootloaderVersion = std::to_string(data[4]) + "."	+ std::to_string(data[5]);
-        }
+    requestMessage(m_frames.Get<messages::FirmwareVersion>(), data, &dataSize, timeoutMs, status);
+    if (*status != HAL_ERR_CANSessionMux_MessageNotFound) {
+        metadata.firmwareMajor = data[0];
+        metadata.firmwareMinor = data[1];
+        snprintf(metadata.firmwareVersion,   CANLIGHT_METADATA_LENGTH, "%u.%u", data[0], data[1]);
+        snprintf(metadata.hardwareVersion,   CANLIGHT_METADATA_LENGTH, "%u.%u", data[2], data[3]);
+        snprintf(metadata.bootloaderVersion, CANLIGHT_METADATA_LENGTH, "%u.%u", data[4], data[5]);
     }
 
     // get serial number
-    if (!failedToGetMessage) {
-        requestMessage(MSR_DEVSERNO | m_deviceID, data, &dataSize, timeoutMs, status);
-        if (*status != HAL_ERR_CANSessionMux_MessageNotFound) {
-            m_serialNumber = "";
-            for (int i = 0; i < dataSize; i++) {
-                if (data[i] == 0) break;
-                m_serialNumber += (char) data[i];
-            }
-        }
+    requestMessage(m_frames.Get<messages::SerialNumber>(), data, &dataSize, timeoutMs, status);
+    if (*status != HAL_ERR_CANSessionMux_MessageNotFound) {
+        CopyFrameString(metadata.serialNumber, data, dataSize);
     }
+
+    WriteVersionFile(metadata);
     
+    // if (received a firmware version AND (major versions match and minor version >= required OR major version greater than required))
+    if (metadata.firmwareVersion[0] != '\0' && ((metadata.firmwareMajor == MINIMUM_REQUIRED_FIRMWARE_MAJOR && metadata.firmwareMinor >= MINIMUM_REQUIRED_FIRMWARE_MINOR) || (metadata.firmwareMajor > MINIMUM_REQUIRED_FIRMWARE_MAJOR))) {
+        SetState(State::Enabled); // firmware version ok!
+    } else {
+        SetState(State::OldFirmware);
+        fprintf(stderr, "ERROR: CANLight with ID %d has an old firmware version. This must be updated from mindsensors.com. This instance has been disabled.\n", m_deviceID);
+    }
+
+    std::scoped_lock lock(m_table.metadataMutex[m_deviceID]);
+    m_table.metadata[m_deviceID] = metadata;
+    return true;
+}
+
+void CANLightDriver::RefreshMetadata(int32_t* status) {
+    if (GetState() == State::NotFound) { // the monitor reads the metadata when the device connects
+        *status = HAL_ERR_CANSessionMux_MessageNotFound;
+        return;
+    }
+    if (FetchMetadata(100, status)) *status = 0; // a missing serial number or version is not an error
+}
+
+/**
+ * Send a name request to every device ID in one batch, then collect the
+ * replies as they arrive. Devices owned by another CANLight answer too, so
+ * every ID's fetch lock is held until the end: a CANLight reading its
+ * metadata meanwhile waits, and the monitor skips its name probe, rather
+ * than either taking a reply meant for the other.
+ */
+uint64_t CANLightDriver::Discover(uint32_t timeoutMs, int32_t* status) {
+    static constexpr uint8_t kMaxDeviceID = 60;
+    CANLightTable& table = CANLightTable::GetInstance();
+    std::unique_lock<std::mutex> fetchLocks[kMaxDeviceID];
+    for (uint8_t id = 1; id <= kMaxDeviceID; id++) { // in ID order, the only place more than one is held
+        fetchLocks[id - 1] = std::unique_lock(table.fetchMutex[id]);
+    }
+
+    CANFrame frames[kMaxDeviceID];
+    for (uint8_t id = 1; id <= kMaxDeviceID; id++) {
+        frames[id - 1].messageID = messages::DeviceName::ArbitrationID(id);
+        frames[id - 1].dataSize = 0;
+    }
+    sendMessages(frames, kMaxDeviceID, status);
+    if (*status != 0) return 0;
+
+    uint64_t found = 0;
+    uint32_t time = 0;
+    do {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        time += 10;
+        for (uint8_t id = 1; id <= kMaxDeviceID; id++) {
+            if (found & (uint64_t(1) << id)) continue;
+            uint8_t data[8];
+            int32_t receiveStatus = 0;
+            getMessage(frames[id - 1].messageID, data, nullptr, &receiveStatus);
+            if (receiveStatus == 0) found |= uint64_t(1) << id;
+        }
+    } while (time < timeoutMs);
+    return found;
+}
+
+void CANLightDriver::WriteVersionFile(const Metadata& metadata) const {
     std::ofstream deviceInfoFile;
     deviceInfoFile.open(string("/var/tmp/frc_versions/CANLight_")+std::to_string(m_deviceID)+string("-versions.ini"));
     deviceInfoFile << "[Version]\n"
                    << "deviceID=" << std::to_string(m_deviceID) << std::endl
-                   << "currentVersion=" << m_firmwareVersion << std::endl
-                   << "softwareStatus=" << (m_firmwareVersion.empty() ? "Failed to read version information." : "") << std::endl
+                   << "currentVersion=" << metadata.firmwareVersion << std::endl
+                   << "softwareStatus=" << (metadata.firmwareVersion[0] == '\0' ? "Failed to read version information." : "") << std::endl
                    << "model=" << "CANLight" << std::endl
-                   << "hardwareRev=" << m_hardwareVersion << std::endl
-                   << "bootloaderRev=" << m_bootloaderVersion << std::endl
-                   << "manufactureDate=" << (!m_serialNumber.empty() ? std::to_string(std::stoi(m_serialNumber)*25+1478732787) : "") << std::endl;
+                   << "hardwareRev=" << metadata.hardwareVersion << std::endl
+                   << "bootloaderRev=" << metadata.bootloaderVersion << std::endl
+                   << "manufactureDate=" << (metadata.serialNumber[0] != '\0' ? std::to_string(atoi(metadata.serialNumber)*25+1478732787) : "") << std::endl;
     deviceInfoFile.close();
-    
-    // check firmware version compliance
-    int fwFoundMajor = atoi(m_firmwareVersion.substr(0, m_firmwareVersion.find('.')).c_str());
-    int fwFoundMinor = atoi(m_firmwareVersion.substr(m_firmwareVersion.find('.') + 1).c_str());
-    int fwRequiredMajor = atoi(MINIMUM_REQUIRED_FIRMWARE_VERSION.substr(0, MINIMUM_REQUIRED_FIRMWARE_VERSION.find('.')).c_str());
-    int fwRequiredMinor = atoi(MINIMUM_REQUIRED_FIRMWARE_VERSION.substr(MINIMUM_REQUIRED_FIRMWARE_VERSION.find('.') + 1).c_str());
-    
-    // if (received a firmware version AND (major versions match and minor version >= required OR major version greater than required))
-    if (!m_firmwareVersion.empty() && ((fwFoundMajor == fwRequiredMajor && fwFoundMinor >= fwRequiredMinor) || (fwFoundMajor > fwRequiredMajor))) {
-        // firmware version ok!
-    } else if (state != State::NotFound) { // don't print error if one has already been printed about device not being found
-        state = State::OldFirmware;
-        fprintf(stderr, "ERROR: CANLight with ID %d has an old firmware version. This must be updated from mindsensors.com. This instance has been disabled.\n", m_deviceID);
-    }
 }
 
 // static, runs before any constructors will write new files
@@ -124,29 +259,43 @@ static deleteOldCANLightIniFiles delcanlightconf;
 uint8_t CANLightDriver::GetDeviceID(int32_t* status) const {
     return m_deviceID;
 }
-string CANLightDriver::GetDeviceName(int32_t* status) const {
-    return m_deviceName;
+/** Copy metadata into a caller-owned buffer, truncating if necessary. */
+static size_t CopyMetadata(std::string_view value, char* buffer, size_t bufferSize) {
+    if (buffer != nullptr && bufferSize > 0) {
+        size_t length = value.copy(buffer, bufferSize - 1);
+        buffer[length] = '\0';
+    }
+    return value.size();
 }
-string CANLightDriver::GetFirmwareVersion(int32_t* status) const {
-    return m_firmwareVersion;
+
+size_t CANLightDriver::GetDeviceName(char* buffer, size_t bufferSize) const {
+    std::scoped_lock lock(m_table.metadataMutex[m_deviceID]);
+    return CopyMetadata(m_table.metadata[m_deviceID].deviceName, buffer, bufferSize);
+}
+size_t CANLightDriver::GetFirmwareVersion(char* buffer, size_t bufferSize) const {
+    std::scoped_lock lock(m_table.metadataMutex[m_deviceID]);
+    return CopyMetadata(m_table.metadata[m_deviceID].firmwareVersion, buffer, bufferSize);
 }
-string CANLightDriver::GetHardwareVersion(int32_t* status) const {
-    return m_hardwareVersion;
+size_t CANLightDriver::GetHardwareVersion(char* buffer, size_t bufferSize) const {
+    std::scoped_lock lock(m_table.metadataMutex[m_deviceID]);
+    return CopyMetadata(m_table.metadata[m_deviceID].hardwareVersion, buffer, bufferSize);
 }
-string CANLightDriver::GetBootloaderVersion(int32_t* status) const {
-    return m_bootloaderVersion;
+size_t CANLightDriver::GetBootloaderVersion(char* buffer, size_t bufferSize) const {
+    std::scoped_lock lock(m_table.metadataMutex[m_deviceID]);
+    return CopyMetadata(m_table.metadata[m_deviceID].bootloaderVersion, buffer, bufferSize);
 }
-string CANLightDriver::GetSerialNumber(int32_t* status) const {
-    return m_serialNumber;
+size_t CANLightDriver::GetSerialNumber(char* buffer, size_t bufferSize) const {
+    std::scoped_lock lock(m_table.metadataMutex[m_deviceID]);
+    return CopyMetadata(m_table.metadata[m_deviceID].serialNumber, buffer, bufferSize);
 }
 
-void CANLightDriver::DisabledWarning(string methodName) const { // private helper method
-    switch (state) {
+void CANLightDriver::DisabledWarning(const char* methodName) const { // private helper method
+    switch (GetState()) {
         case State::NotFound:
-            fprintf(stderr, "Warning: CANLight with ID %d was not found during instantiation and is disabled. Ignoring call to %s.\n", m_deviceID, methodName.c_str());
+            fprintf(stderr, "Warning: CANLight with ID %d is not connected and is disabled. Ignoring call to %s.\n", m_deviceID, methodName);
             break;
         case State::OldFirmware:
-            fprintf(stderr, "Warning: CANLight with ID %d has outdated firmware and is disabled. Ignoring call to %s.\n", m_deviceID, methodName.c_str());
+            fprintf(stderr, "Warning: CANLight with ID %d has outdated firmware and is disabled. Ignoring call to %s.\n", m_deviceID, methodName);
             break;
         
         case State::Enabled:
@@ -154,273 +303,1079 @@ void CANLightDriver::DisabledWarning(string methodName) const { // private helpe
     } 
 }
 
-void CANLightDriver::BlinkLED(uint8_t seconds, int32_t* status) {
-    if (state != State::Enabled) { DisabledWarning("BlinkLED"); return; }
-    
-    uint8_t data[8];
-    data[0] = seconds;
+/** The frame packed into CommandState::modeShadow by UpdateShadow. */
+static CANFrame UnpackModeShadow(uint64_t mode) {
+    CANFrame frame;
+    frame.messageID = (mode >> 32) & CAN_MSGID_FULL_M;
+    frame.dataSize = mode >> 61;
+    for (size_t i = 0; i < frame.dataSize; i++) frame.data[i] = (mode >> (8*i)) & 0xFF;
+    return frame;
+}
 
-    sendMessage(MSR_BLINK | m_deviceID, data, 1, status);
-    
-    if (*status == HAL_ERR_CANSessionMux_MessageNotFound) {fprintf(stderr, "Warning: CANLight with ID %d not found. Call to BlinkLED failed.\n", m_deviceID); *status = 0; }
+// supersede keys: one for all mode commands, one per register, then reset and blink
+static constexpr uint8_t KEY_MODE = 0;
+static constexpr uint8_t KEY_REGISTER = 1; // + register index
+static constexpr uint8_t KEY_RESET = KEY_REGISTER + 8;
+static constexpr uint8_t KEY_BLINK = KEY_RESET + 1;
+
+template <typename Msg>
+constexpr uint8_t CANLightDriver::SupersedeKey(const typename Msg::Payload& payload) {
+    if constexpr (Msg::kMode) return KEY_MODE;
+    else if constexpr (std::is_same_v<Msg, messages::ColorLoad>) return KEY_REGISTER + (payload[0] & 7);
+    else if constexpr (std::is_same_v<Msg, messages::ColorReset>) return KEY_RESET;
+    else return KEY_BLINK;
 }
 
-void CANLightDriver::ShowRGB(uint8_t red, uint8_t green, uint8_t blue, int32_t* status) {
-    if (state != State::Enabled) { DisabledWarning("ShowRGB"); return; }
-    
-    uint8_t data[8];
-    data[0] = 0;
-    data[1] = red;
-    data[2] = green;
-    data[3] = blue;
+/** Raise an atomic to value unless another thread already raised it further. */
+static void StoreMax(std::atomic<uint32_t>& target, uint32_t value) {
+    uint32_t current = target.load(std::memory_order_relaxed);
+    while (current < value && !target.compare_exchange_weak(current, value, std::memory_order_relaxed)) {}
+}
+
+static uint32_t SteadyMilliseconds(std::chrono::steady_clock::time_point time) {
+    return (uint32_t) std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count();
+}
 
-    sendMessage(MS_API_COLOR_SET | m_deviceID, data, 4, status);
+// battery governor settings: hysteresis << 32 | critical mV << 16 | reduced mV, 0 while off
+static std::atomic<uint64_t> governorThresholds{0};
+// per level: minimum ms between mode frames << 16 | brightness out of 256
+static std::atomic<uint32_t> governorLimits[3] = {256, 256, 256};
+static const char* const GOVERNOR_LEVEL_NAMES[3] = {"normal", "reduced", "critical"};
+static const char* const GOVERNOR_TRACE_NAMES[3] = {"CANLight governor normal", "CANLight governor reduced", "CANLight governor critical"};
 
-    if (*status == HAL_ERR_CANSessionMux_MessageNotFound) {fprintf(stderr, "Warning: CANLight with ID %d not found. Call to ShowRGB failed.\n", m_deviceID); *status = 0; }
-    //std::cout << "HAL_ERR_CANSessionMux_MessageNotFound: " << HAL_ERR_CANSessionMux_MessageNotFound << "   status: " << *status << std::endl;
+/** Retry delay after a failed send: 2ms, doubling with each attempt. */
+static std::chrono::steady_clock::duration RetryBackoff(uint8_t attempts) {
+    return std::chrono::milliseconds(2 << (attempts - 1));
 }
 
-void CANLightDriver::WriteRegister(uint8_t index, uint8_t time, uint8_t red, uint8_t green, uint8_t blue, int32_t* status) {
-    if (state != State::Enabled) { DisabledWarning("WriteRegister"); return; }
-    
-    uint8_t data[8];
-    data[0] = index;
-    data[1] = time;
-    data[2] = red;
-    data[3] = green;
-    data[4] = blue;
+/**
+ * Send a command to this device, or warn if it is disabled. If the send fails
+ * the command is queued for retry instead of being lost, and mode commands
+ * (colors and patterns) are queued while the bus budget is exhausted. While
+ * anything is queued, new commands queue behind it, so that for example a
+ * ShowRegister never reaches the device before the WriteRegister it follows.
+ * The command is numbered under the send lock, so sequence numbers follow the
+ * order commands reach the bus. Returns the number, or 0 if disabled.
+ */
+template <typename Msg>
+uint32_t CANLightDriver::SendCommand(const typename Msg::Payload& payload, const char* methodName, int32_t* status) {
+    if (GetState() != State::Enabled) { DisabledWarning(methodName); return 0; }
 
-    sendMessage(MS_API_COLOR_LOAD | m_deviceID, data, 5, status);
-    
-    if (*status == HAL_ERR_CANSessionMux_MessageNotFound) {fprintf(stderr, "Warning: CANLight with ID %d not found. Call to WriteRegister failed.\n", m_deviceID); *status = 0; }
+    PendingCommand command;
+    command.frame.messageID = m_frames.Get<Msg>();
+    std::copy(payload.begin(), payload.end(), command.frame.data);
+    command.frame.dataSize = Msg::kSize;
+    command.methodName = methodName;
+    command.key = SupersedeKey<Msg>(payload);
+    command.attempts = 0;
+
+    std::scoped_lock sendLock(m_sendMutex);
+    command.sequence = ++m_commands.lastIssued;
+    if constexpr (Msg::kMode) StoreMax(m_commands.lastModeIssued, command.sequence);
+    UpdateShadow<Msg>(payload);
+
+    ServicePending();
+    if (m_commands.pendingCount != 0) {
+        std::scoped_lock lock(m_pendingMutex);
+        Supersede(command.key);
+        if (m_commands.pendingCount != 0) { // keep issue order behind commands still waiting
+            command.nextAttempt = std::chrono::steady_clock::now();
+            Enqueue(command);
+            return command.sequence;
+        }
+    }
+
+    if (Msg::kMode && m_commands.governorLevel.load(std::memory_order_relaxed) != 0 && Throttle(command)) return command.sequence;
+    if (Msg::kMode && !busBudgetAvailable(Msg::kSize)) {
+        command.nextAttempt = std::chrono::steady_clock::now();
+        std::scoped_lock lock(m_pendingMutex);
+        Enqueue(command);
+        return command.sequence;
+    }
+
+    Transmit(command.frame, Msg::kMode, status);
+    if (*status == 0) {
+        Delivered(command.sequence, Msg::kMode);
+    } else {
+        *status = 0; // handled by retrying
+        m_commands.retries++;
+        command.attempts = 1;
+        command.nextAttempt = std::chrono::steady_clock::now() + RetryBackoff(command.attempts);
+        std::scoped_lock lock(m_pendingMutex);
+        Enqueue(command);
+    }
+    return command.sequence;
 }
 
-void CANLightDriver::Reset(int32_t* status) {
-    if (state != State::Enabled) { DisabledWarning("Reset"); return; }
-    
-    sendMessage(MS_API_COLOR_RESET | m_deviceID, nullptr, 0, status);
-    
-    if (*status == HAL_ERR_CANSessionMux_MessageNotFound) {fprintf(stderr, "Warning: CANLight with ID %d not found. Call to Reset failed.\n", m_deviceID); *status = 0; }
+template <typename Msg>
+void CANLightDriver::UpdateShadow(const typename Msg::Payload& payload) {
+    if constexpr (Msg::kMode) {
+        uint64_t packed = ((uint64_t) Msg::kSize << 61) | ((uint64_t) m_frames.Get<Msg>() << 32);
+        for (size_t i = 0; i < Msg::kSize; i++) packed |= (uint64_t) payload[i] << (8*i);
+        m_commands.modeShadow = packed;
+    } else if constexpr (std::is_same_v<Msg, messages::ColorLoad>) {
+        uint8_t index = payload[0] & 7;
+        m_table.registerShadow[m_deviceID][index] = payload[1] | (payload[2] << 8) | (payload[3] << 16) | ((uint32_t) payload[4] << 24);
+        m_commands.registersWritten |= 1 << index;
+    } else if constexpr (std::is_same_v<Msg, messages::ColorReset>) {
+        m_commands.registersWritten = 0; // back to the defaults a rebooted device has anyway
+    }
 }
 
-void CANLightDriver::ShowRegister(uint8_t index, int32_t* status) {
-    if (state != State::Enabled) { DisabledWarning("ShowRegister"); return; }
-    
-    uint8_t data[8];
-    data[0] = index;
+/**
+ * Frames are dimmed here, as they go out, rather than when a command is
+ * issued, so the shadows keep the requested colors and a command that waited
+ * in the queue is sent at the brightness of the moment.
+ */
+void CANLightDriver::Transmit(CANFrame frame, bool mode, int32_t* status) {
+    Dim(frame);
+    if (mode && GetHoldPeriod() != 0) {
+        std::scoped_lock lock(m_table.held[m_deviceID].mutex);
+        SendHeld(frame, status);
+    } else {
+        trySendMessage(frame.messageID, frame.data, frame.dataSize, status);
+    }
+}
 
-    sendMessage(MS_API_COLOR_SHOW | m_deviceID, data, 1, status);
-    
-    if (*status == HAL_ERR_CANSessionMux_MessageNotFound) {fprintf(stderr, "Warning: CANLight with ID %d not found. Call to ShowRegister failed.\n", m_deviceID); *status = 0; }
+void CANLightDriver::Dim(CANFrame& frame) const {
+    uint8_t level = m_commands.governorLevel.load(std::memory_order_relaxed);
+    if (level == 0) return;
+    uint32_t brightness = governorLimits[level].load(std::memory_order_relaxed) & 0xFFFF;
+
+    size_t red;
+    if (frame.messageID == m_frames.Get<messages::ColorSet>()) red = 1;       // [0, red, green, blue]
+    else if (frame.messageID == m_frames.Get<messages::ColorLoad>()) red = 2; // [index, time, red, green, blue]
+    else return;
+    for (size_t i = red; i < red + 3; i++) frame.data[i] = (frame.data[i] * brightness) >> 8;
 }
 
-void CANLightDriver::Flash(uint8_t index, int32_t* status) {
-  if (state != State::Enabled) { DisabledWarning("Flash"); return; }
-  
-    uint8_t data[8];
-    data[0] = index;
+int32_t CANLightDriver::GovernorWaitMs(std::chrono::steady_clock::time_point now) const {
+    uint8_t level = m_commands.governorLevel.load(std::memory_order_relaxed);
+    if (level == 0) return 0;
+    uint32_t intervalMs = governorLimits[level].load(std::memory_order_relaxed) >> 16;
+    if (intervalMs == 0) return 0;
+    return (int32_t) (m_commands.lastModeSentMs + intervalMs - SteadyMilliseconds(now));
+}
 
-    sendMessage(MS_API_COLOR_BLINK | m_deviceID, data, 1, status);
-    
-    if (*status == HAL_ERR_CANSessionMux_MessageNotFound) {fprintf(stderr, "Warning: CANLight with ID %d not found. Call to Flash failed.\n", m_deviceID); *status = 0; }
+/** Queue a mode command until the governor's interval since the last one has passed. */
+bool CANLightDriver::Throttle(PendingCommand& command) {
+    auto now = std::chrono::steady_clock::now();
+    int32_t wait = GovernorWaitMs(now);
+    if (wait <= 0) return false;
+
+    m_commands.throttled++;
+    command.nextAttempt = now + std::chrono::milliseconds(wait);
+    std::scoped_lock lock(m_pendingMutex);
+    Enqueue(command);
+    return true;
 }
 
-void CANLightDriver::Cycle(uint8_t fromIndex, uint8_t toIndex, int32_t* status) {
-    if (state != State::Enabled) { DisabledWarning("Cycle"); return; }
-    
-    uint8_t data[8];
-    data[0] = fromIndex;
-    data[1] = toIndex;
+void CANLightDriver::Supersede(uint8_t key) {
+    size_t count = m_commands.pendingCount, kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint8_t pendingKey = m_pending[i].key;
+        // a reset also replaces any register writes still waiting
+        if (pendingKey == key || (key == KEY_RESET && pendingKey >= KEY_REGISTER && pendingKey < KEY_RESET)) {
+            m_commands.superseded++;
+            RecordLost(m_pending[i].sequence, false);
+            continue;
+        }
+        m_pending[kept++] = m_pending[i];
+    }
+    m_commands.pendingCount = kept;
+}
 
-    sendMessage(MS_API_COLOR_SWEEP | m_deviceID, data, 2, status);
-    
-    if (*status == HAL_ERR_CANSessionMux_MessageNotFound) {fprintf(stderr, "Warning: CANLight with ID %d not found. Call to Cycle failed.\n", m_deviceID); *status = 0; }
+void CANLightDriver::Enqueue(const PendingCommand& command) {
+    size_t count = m_commands.pendingCount;
+    if (count == kMaxPending) { // full, give up on the oldest
+        fprintf(stderr, "Warning: CANLight with ID %d has too many unsent commands. Dropping call to %s.\n", m_deviceID, m_pending[0].methodName);
+        m_commands.dropped++;
+        RecordLost(m_pending[0].sequence, true);
+        std::move(m_pending + 1, m_pending + count, m_pending);
+        count--;
+    }
+    m_pending[count] = command;
+    m_commands.pendingCount = count + 1;
 }
 
-void CANLightDriver::Fade(uint8_t startIndex, uint8_t endIndex, int32_t* status) {
-    if (state != State::Enabled) { DisabledWarning("Fade"); return; }
-    
+void CANLightDriver::RecordLost(uint32_t sequence, bool dropped) {
+    CANLightTable::PendingQueue& queue = m_table.pending[m_deviceID];
+    size_t slot = queue.lostCount++ % CANLightTable::kLostHistory;
+    if (queue.lostCount > CANLightTable::kLostHistory) queue.lostForgotten = std::max(queue.lostForgotten, queue.lostSequence[slot]);
+    queue.lostSequence[slot] = sequence;
+    queue.lostDropped[slot] = dropped;
+}
+
+void CANLightDriver::Delivered(uint32_t sequence, bool mode) {
+    m_commands.delivered++;
+    StoreMax(m_commands.lastDelivered, sequence);
+    if (mode) StoreMax(m_commands.lastModeDelivered, sequence);
+    if (mode && m_commands.governorLevel.load(std::memory_order_relaxed) != 0) {
+        m_commands.lastModeSentMs = SteadyMilliseconds(std::chrono::steady_clock::now());
+    }
+    if (mode && Trace::IsEnabled()) {
+        uint64_t unconfirmed = 0; // keep the oldest command not yet followed by a status broadcast
+        m_commands.traceModeSentNs.compare_exchange_strong(unconfirmed, Trace::Now(), std::memory_order_relaxed);
+    }
+}
+
+void CANLightDriver::ServicePending() {
+    // a disconnected device keeps its queue for when it comes back rather
+    // than spending retries and bus time on it
+    if (m_commands.pendingCount == 0 || GetState() == State::NotFound) return;
+
+    std::scoped_lock lock(m_pendingMutex);
+    auto now = std::chrono::steady_clock::now();
+    size_t count = m_commands.pendingCount, kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        PendingCommand& command = m_pending[i];
+        // strictly in order: once one command has to wait, everything after it waits too
+        bool ready = kept == 0 && now >= command.nextAttempt
+                     && (command.key != KEY_MODE || command.attempts != 0
+                         || (busBudgetAvailable(command.frame.dataSize) && GovernorWaitMs(now) <= 0));
+        if (ready) {
+            int32_t status = 0;
+            Transmit(command.frame, command.key == KEY_MODE, &status);
+            if (status == 0) {
+                Delivered(command.sequence, command.key == KEY_MODE);
+                continue;
+            }
+            if (++command.attempts > kMaxAttempts) {
+                fprintf(stderr, "Warning: CANLight with ID %d: call to %s failed after %d attempts (CAN error %d).\n", m_deviceID, command.methodName, kMaxAttempts, status);
+                m_commands.dropped++;
+                RecordLost(command.sequence, true);
+                continue;
+            }
+            m_commands.retries++;
+            command.nextAttempt = now + RetryBackoff(command.attempts);
+        }
+        m_pending[kept++] = command;
+    }
+    m_commands.pendingCount = kept;
+}
+
+/** Start repeating a mode frame at the hold period, replacing whatever repeats now. */
+void CANLightDriver::SendHeld(const CANFrame& frame, int32_t* status) {
+    CANLightTable::HeldFrame& held = m_table.held[m_deviceID];
+    int32_t period = GetHoldPeriod();
+    if (period == 0) { // hold was turned off after the caller checked
+        trySendMessage(frame.messageID, frame.data, frame.dataSize, status);
+        return;
+    }
+    // stopping an ID is separate from starting another, but the same ID may be replaced in place
+    if (held.frame.messageID != frame.messageID) ReleaseHeld();
+
+    trySendMessage(frame.messageID, frame.data, frame.dataSize, period, status);
+    if (*status != 0) return; // an earlier frame with this ID keeps repeating
+
+    addPeriodicLoad((int64_t) PeriodicBitsPerSecond(frame.dataSize, period) - PeriodicBitsPerSecond(held.frame.dataSize, held.periodMs));
+    held.frame = frame;
+    held.periodMs = period;
+}
+
+void CANLightDriver::ReleaseHeld() {
+    CANLightTable::HeldFrame& held = m_table.held[m_deviceID];
+    if (held.frame.messageID == 0) return;
+    int32_t status = 0;
+    trySendMessage(held.frame.messageID, held.frame.data, 0, HAL_CAN_SEND_PERIOD_STOP_REPEATING, &status);
+    if (status != 0) fprintf(stderr, "Warning: CANLight with ID %d: could not stop a repeating command (CAN error %d).\n", m_deviceID, status);
+    addPeriodicLoad(-(int64_t) PeriodicBitsPerSecond(held.frame.dataSize, held.periodMs));
+    held.frame = CANFrame{};
+    held.periodMs = 0;
+}
+
+/** Turn hold mode on, off, or change its period. The current mode is held right away. */
+void CANLightDriver::SetHoldPeriod(uint16_t periodMs, int32_t* status) {
+    std::scoped_lock sendLock(m_sendMutex); // the shadow read below is sent as the latest mode
+    std::scoped_lock lock(m_table.held[m_deviceID].mutex);
+    m_table.holdPeriodMs[m_deviceID] = periodMs;
+    if (periodMs == 0) {
+        ReleaseHeld();
+        return;
+    }
+
+    uint64_t mode = m_commands.modeShadow;
+    if (mode == 0 || GetState() != State::Enabled) return; // held by the next command
+    CANFrame frame = UnpackModeShadow(mode);
+    Dim(frame);
+    SendHeld(frame, status);
+    if (*status != 0) {
+        fprintf(stderr, "Warning: CANLight with ID %d: could not start repeating the current command (CAN error %d). The next command will try again.\n", m_deviceID, *status);
+        *status = 0;
+    }
+}
+
+CANLightDriver::DeliveryReport CANLightDriver::GetDeliveryReport() const {
+    DeliveryReport report;
+    report.lastIssued = m_commands.lastIssued;
+    report.lastDelivered = m_commands.lastDelivered;
+    report.delivered = m_commands.delivered;
+    report.retries = m_commands.retries;
+    report.superseded = m_commands.superseded;
+    report.dropped = m_commands.dropped;
+    report.throttled = m_commands.throttled;
+    report.pending = m_commands.pendingCount;
+    report.synchronized = report.pending == 0 && m_commands.lastModeDelivered == m_commands.lastModeIssued;
+    report.acknowledged = report.synchronized && (m_table.modeAcknowledged[m_deviceID] >> 32) >= m_commands.lastModeIssued;
+    return report;
+}
+
+/**
+ * Commands reach the bus in sequence order, so one that is neither waiting
+ * nor lost was delivered once lastDelivered has passed it, and is still on
+ * its way otherwise. A command being sent right now is newer than any lost
+ * one: the queue was empty when it skipped it.
+ */
+CANLightDriver::CommandStatus CANLightDriver::GetCommandStatus(uint32_t sequence) const {
+    if (sequence == 0 || sequence > m_commands.lastIssued) return CommandStatus::Unknown;
+
+    CANLightTable::PendingQueue& queue = m_table.pending[m_deviceID];
+    std::scoped_lock lock(m_pendingMutex);
+    for (size_t i = 0; i < m_commands.pendingCount; i++) {
+        if (m_pending[i].sequence == sequence) return CommandStatus::Pending;
+    }
+    size_t recorded = std::min<size_t>(queue.lostCount, CANLightTable::kLostHistory);
+    for (size_t i = 0; i < recorded; i++) {
+        if (queue.lostSequence[i] == sequence) return queue.lostDropped[i] ? CommandStatus::Dropped : CommandStatus::Superseded;
+    }
+    if (sequence <= queue.lostForgotten) return CommandStatus::Unknown; // may have been lost
+    return sequence > m_commands.lastDelivered ? CommandStatus::Pending : CommandStatus::Delivered;
+}
+
+uint32_t CANLightDriver::BlinkLED(uint8_t seconds, int32_t* status) {
+    return SendCommand<messages::Blink>(messages::Blink::Encode(seconds), "BlinkLED", status);
+}
+
+uint32_t CANLightDriver::ShowRGB(uint8_t red, uint8_t green, uint8_t blue, int32_t* status) {
+    return SendCommand<messages::ColorSet>(messages::ColorSet::Encode(red, green, blue), "ShowRGB", status);
+}
+
+uint32_t CANLightDriver::WriteRegister(uint8_t index, uint8_t time, uint8_t red, uint8_t green, uint8_t blue, int32_t* status) {
+    return SendCommand<messages::ColorLoad>(messages::ColorLoad::Encode(index, time, red, green, blue), "WriteRegister", status);
+}
+
+uint32_t CANLightDriver::Reset(int32_t* status) {
+    return SendCommand<messages::ColorReset>(messages::ColorReset::Encode(), "Reset", status);
+}
+
+uint32_t CANLightDriver::ShowRegister(uint8_t index, int32_t* status) {
+    return SendCommand<messages::ColorShow>(messages::ColorShow::Encode(index), "ShowRegister", status);
+}
+
+uint32_t CANLightDriver::Flash(uint8_t index, int32_t* status) {
+    return SendCommand<messages::ColorBlink>(messages::ColorBlink::Encode(index), "Flash", status);
+}
+
+uint32_t CANLightDriver::Cycle(uint8_t fromIndex, uint8_t toIndex, int32_t* status) {
+    return SendCommand<messages::ColorSweep>(messages::ColorSweep::Encode(fromIndex, toIndex), "Cycle", status);
+}
+
+uint32_t CANLightDriver::Fade(uint8_t startIndex, uint8_t endIndex, int32_t* status) {
+    return SendCommand<messages::ColorFade>(messages::ColorFade::Encode(startIndex, endIndex), "Fade", status);
+}
+
+static constexpr uint64_t STATUS_VALID = 1u << 31;
+
+CANLightDriver::StatusReading CANLightDriver::LastStatus(std::chrono::steady_clock::time_point now) const {
+    return DecodeStatus(m_table.lastStatus[m_deviceID].load(std::memory_order_acquire), now);
+}
+
+CANLightDriver::StatusReading CANLightDriver::DecodeStatus(uint64_t packed, std::chrono::steady_clock::time_point now) {
+    StatusReading reading;
+    reading.valid = packed & STATUS_VALID;
+    int32_t age = (int32_t) (SteadyMilliseconds(now) - (uint32_t) (packed >> 32));
+    reading.age = std::chrono::milliseconds(age > 0 ? age : 0); // may be received after `now` was taken
+    reading.voltage = (packed & ~STATUS_VALID & 0xFFFFFFFF) / 1000.0;
+    return reading;
+}
+
+/**
+ * Read the status broadcast if a new one arrived, recording the battery
+ * voltage and when it was heard. A broadcast that is new since the previous
+ * read was sent after it, so it acknowledges the mode commands delivered by
+ * then, which the device had already received.
+ */
+bool CANLightDriver::PollStatus() {
     uint8_t data[8];
-    data[0] = startIndex;
-    data[1] = endIndex;
+    int32_t status = 0;
 
-    sendMessage(MS_API_COLOR_FADE | m_deviceID, data, 2, status);
-    
-    if (*status == HAL_ERR_CANSessionMux_MessageNotFound) {fprintf(stderr, "Warning: CANLight with ID %d not found. Call to Fade failed.\n", m_deviceID); *status = 0; }
+    getMessage(m_frames.Get<messages::StatusData>(), data, nullptr, &status);
+    if (status != 0) return false;
+
+    uint32_t millivolts = (uint32_t) (messages::StatusData::DecodeBatteryVoltage(data) * 1000 + 0.5);
+    uint32_t received = SteadyMilliseconds(std::chrono::steady_clock::now());
+    m_table.lastStatus[m_deviceID].store(((uint64_t) received << 32) | STATUS_VALID | millivolts, std::memory_order_release);
+
+    std::atomic<uint64_t>& acknowledged = m_table.modeAcknowledged[m_deviceID];
+    uint64_t previous = acknowledged.load(std::memory_order_relaxed), next;
+    do {
+        uint32_t confirmed = std::max((uint32_t) (previous >> 32), (uint32_t) previous);
+        next = ((uint64_t) confirmed << 32) | m_commands.lastModeDelivered.load(std::memory_order_relaxed);
+    } while (!acknowledged.compare_exchange_weak(previous, next, std::memory_order_relaxed));
+
+    if (Trace::IsEnabled()) {
+        uint64_t sent = m_commands.traceModeSentNs.exchange(0, std::memory_order_relaxed);
+        if (sent != 0) Trace::Record("CANLight status after command", sent, Trace::Now(), m_deviceID);
+    }
+    return true;
 }
 
 double CANLightDriver::GetBatteryVoltage(int32_t* status) {
-    if (state != State::Enabled) { DisabledWarning("GetBatteryVoltage (returning 0.0)"); return 0.0; }
-    
-    uint8_t data[8];
+    if (GetState() != State::Enabled) { DisabledWarning("GetBatteryVoltage (returning 0.0)"); return 0.0; }
 
-    getMessage(MSR_STATUS_DATA | m_deviceID, data, nullptr, status);
-    
-    //if (*status == HAL_ERR_CANSessionMux_MessageNotFound) {fprintf(stderr, "Warning: CANLight with ID %d not found. Call to GetBatteryVoltage failed (returning 0.0).\n", m_deviceID); *status = 0; return 0.0; }
-    
-    if (*status != 0) { // if the message wasn't received... (maybe calling this function too fast)
-        *status = 0; // don't throw exception, we handled it
-        if ((std::chrono::system_clock::now() - lastBatteryVoltageTime).count() < 1000*1000*1000)
-            return lastBatteryVoltageReading; // if it's been less than a second, return the last value
-        else
-            return 0.0; // if it's been over a second since the last successful voltage reading, the device is probably off
+    ServicePending(); // robot code usually polls this, so use it to catch up on pending commands
+
+    // the monitor thread also reads the status broadcast, so a miss here (maybe
+    // calling this function too fast) usually means the reading is already recorded
+    PollStatus();
+
+    StatusReading reading = LastStatus(std::chrono::steady_clock::now());
+    if (!reading.valid || reading.age >= std::chrono::seconds(1))
+        return 0.0; // if it's been over a second since the last successful voltage reading, the device is probably off
+    return reading.voltage; // if it's been less than a second, return the last value
+}
+
+size_t CANLightDriver::BuildResyncFrames(CANFrame* frames, size_t maxFrames, std::chrono::steady_clock::time_point now,
+                                         uint8_t* registersTaken, bool* complete, bool* modeTaken) {
+    CANLightTable::MonitorState& monitor = m_table.monitor[m_deviceID];
+    if (!monitor.resyncInProgress) { // starting a new replay
+        monitor.resyncRegisters = m_commands.registersWritten;
+        monitor.resyncInProgress = true;
     }
-    
-    // otherwise, success
-    lastBatteryVoltageReading = 2.8*((uint16_t)data[1] + (data[2]<<8))/1000;
-    lastBatteryVoltageTime = std::chrono::system_clock::now();
-    return lastBatteryVoltageReading;
+    size_t count = 0;
+    *registersTaken = 0;
+
+    for (uint8_t index = 0; index < 8 && count < maxFrames; index++) {
+        if (!(monitor.resyncRegisters & (1 << index))) continue;
+        uint32_t value = m_table.registerShadow[m_deviceID][index];
+        auto payload = messages::ColorLoad::Encode(index, value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24);
+        CANFrame& frame = frames[count++];
+        frame.messageID = m_frames.Get<messages::ColorLoad>();
+        std::copy(payload.begin(), payload.end(), frame.data);
+        frame.dataSize = messages::ColorLoad::kSize;
+        Dim(frame);
+        *registersTaken |= 1 << index;
+    }
+
+    *complete = (monitor.resyncRegisters & ~*registersTaken) == 0 && count < maxFrames;
+    *modeTaken = false;
+    uint64_t mode = m_commands.modeShadow;
+    if (*complete && mode != 0) { // the mode goes last, once its registers are restored
+        if (GovernorWaitMs(now) > 0) {
+            *complete = false;
+        } else {
+            frames[count] = UnpackModeShadow(mode);
+            Dim(frames[count++]);
+            *modeTaken = true;
+        }
+    }
+    return count;
 }
 
+/**
+ * Called by the monitor at the end of each pass. Devices that reset together
+ * (for example after a brownout) are restored in one batch, capped at
+ * kMaxResyncFrames per pass and at what is left of the bus budget, so the
+ * replay can't flood the bus; the rest continue on a later pass.
+ *
+ * Each contributing device's send lock is held from reading its shadow
+ * until the batch is sent, so a command issued meanwhile goes out after the
+ * replay rather than being overwritten by it.
+ */
+void CANLightDriver::Resync(uint64_t devices) {
+    struct Contribution {
+        std::unique_lock<std::mutex> sendLock;
+        uint8_t deviceID;
+        uint8_t registersTaken;
+        bool complete;
+        bool modeTaken;
+    };
+    CANLightTable& table = CANLightTable::GetInstance();
+    devices &= table.needsResync.load();
+    if (devices == 0) return; // the usual case, one load for all devices
 
+    size_t maxFrames = 0; // sized for register frames, the largest
+    for (uint32_t bits = 0; maxFrames < kMaxResyncFrames && busBudgetAvailable(messages::ColorLoad::kSize, bits); maxFrames++) {
+        bits += FrameBits(messages::ColorLoad::kSize);
+    }
 
+    CANFrame frames[kMaxResyncFrames];
+    Contribution contributions[kMaxResyncFrames];
+    size_t frameCount = 0, contributionCount = 0;
+    auto now = std::chrono::steady_clock::now();
 
+    // in ID order, the only place more than one send lock is held
+    for (; devices != 0 && frameCount < maxFrames; devices &= devices - 1) {
+        CANLightDriver driver(uint8_t(std::countr_zero(devices)));
+        if (driver.GetState() != State::Enabled) continue;
 
-static hal::IndexedClassedHandleResource<CANLight_Handle, CANLightDriver, 63, hal::HAL_HandleEnum::Vendor> canlightHandles;
+        Contribution& contribution = contributions[contributionCount];
+        contribution.sendLock = std::unique_lock(driver.m_sendMutex);
+        contribution.deviceID = driver.m_deviceID;
+        contribution.complete = false;
+        size_t count = driver.BuildResyncFrames(frames + frameCount, maxFrames - frameCount, now,
+                                                &contribution.registersTaken, &contribution.complete, &contribution.modeTaken);
+        if (count == 0 && !contribution.complete) {
+            contribution.sendLock.unlock();
+            continue;
+        }
+        frameCount += count;
+        contributionCount++;
+    }
+    if (frameCount == 0 && contributionCount == 0) return;
+
+    int32_t status = 0;
+    sendMessages(frames, frameCount, &status);
+    if (status != 0) return; // try again next pass
+
+    for (size_t i = 0; i < contributionCount; i++) {
+        Contribution& contribution = contributions[i];
+        CANLightTable::MonitorState& monitor = table.monitor[contribution.deviceID];
+        CANLightTable::CommandState& commands = table.commands[contribution.deviceID];
+        monitor.resyncRegisters &= ~contribution.registersTaken;
+        if (contribution.modeTaken && commands.governorLevel.load(std::memory_order_relaxed) != 0) {
+            commands.lastModeSentMs = SteadyMilliseconds(now); // spaced from the next color change like any other
+        }
+        if (contribution.complete) {
+            monitor.resyncInProgress = false;
+            CANLightDriver(contribution.deviceID).SetNeedsResync(false);
+        }
+    }
+}
+
+void CANLightDriver::SetNeedsResync(bool needed) {
+    uint64_t bit = uint64_t(1) << m_deviceID;
+    if (needed) m_table.needsResync.fetch_or(bit);
+    else m_table.needsResync.fetch_and(~bit);
+}
+
+void CANLightDriver::RestartResync() {
+    SetNeedsResync(true);
+    m_table.monitor[m_deviceID].resyncInProgress = false; // start over, even if a replay was under way
+}
+
+/** Read every open device's state from the table. */
+size_t CANLightDriver::GetTelemetry(Telemetry* telemetry, size_t maxDevices) {
+    CANLightTable& table = CANLightTable::GetInstance();
+    auto now = std::chrono::steady_clock::now();
+    uint64_t open = table.open.load();
+    size_t count = 0;
+
+    for (uint8_t id = 1; id < CANLightTable::kSlots && count < maxDevices; id++) {
+        if (!(open & (uint64_t(1) << id))) continue;
+        const CANLightTable::CommandState& commands = table.commands[id];
+        StatusReading reading = DecodeStatus(table.lastStatus[id].load(std::memory_order_acquire), now);
+
+        Telemetry& entry = telemetry[count++];
+        entry.deviceID = id;
+        entry.state = (State) table.state[id].load();
+        bool recent = reading.valid && reading.age < std::chrono::seconds(1);
+        entry.batteryVoltage = recent ? reading.voltage : 0.0;
+        entry.statusAgeMs = reading.valid ? (uint32_t) reading.age.count() : UINT32_MAX;
+        entry.pending = commands.pendingCount;
+        entry.synchronized = entry.pending == 0 && commands.lastModeDelivered == commands.lastModeIssued;
+        entry.governorLevel = commands.governorLevel;
+        entry.governorTransitions = commands.governorTransitions;
+    }
+    return count;
+}
+
+void CANLightDriver::SetGovernor(const GovernorSettings* settings) {
+    if (settings == nullptr) {
+        governorThresholds = 0; // each device returns to normal on the monitor's next pass
+        return;
+    }
+    governorLimits[1] = ((uint32_t) settings->reducedIntervalMs << 16) | std::min<uint16_t>(settings->reducedBrightness, 256);
+    governorLimits[2] = ((uint32_t) settings->criticalIntervalMs << 16) | std::min<uint16_t>(settings->criticalBrightness, 256);
+    governorThresholds = ((uint64_t) settings->hysteresisMillivolts << 32) | ((uint64_t) settings->criticalMillivolts << 16)
+                         | settings->reducedMillivolts | (uint64_t(1) << 48); // never 0 while on
+}
+
+/**
+ * Called by the monitor each pass. The level moves down (dimmer, slower) as
+ * soon as the voltage is below a threshold, but only moves up again once it
+ * has recovered past the threshold plus the hysteresis, so a battery hovering
+ * near a threshold doesn't make the lights flicker between levels. A change
+ * replays the registers and mode through Resync at the new brightness.
+ */
+void CANLightDriver::UpdateGovernor(const StatusReading& reading) {
+    uint64_t thresholds = governorThresholds.load(std::memory_order_relaxed);
+    uint8_t current = m_commands.governorLevel.load(std::memory_order_relaxed);
+    if (thresholds == 0 && current == 0) return; // the usual case
+    bool recent = reading.valid && reading.age < kPresenceTimeout;
+    if (thresholds != 0 && !recent) return; // keep the level until the device reports again
+
+    uint8_t level = 0;
+    uint32_t millivolts = (uint32_t) (reading.voltage * 1000 + 0.5);
+    if (thresholds != 0) {
+        const uint32_t limits[3] = {UINT32_MAX, (uint32_t) (thresholds & 0xFFFF), (uint32_t) ((thresholds >> 16) & 0xFFFF)};
+        uint32_t hysteresis = (thresholds >> 32) & 0xFFFF;
+        level = current;
+        while (level > 0 && millivolts >= limits[level] + hysteresis) level--;
+        while (level < 2 && millivolts < limits[level + 1]) level++;
+    }
+    if (level == current) return;
+
+    m_commands.governorLevel = level;
+    m_commands.governorTransitions++;
+    m_commands.lastModeSentMs = SteadyMilliseconds(std::chrono::steady_clock::now());
+    if (level == 0) {
+        fprintf(stderr, "CANLight with ID %d: battery at %.2fV, restoring full brightness and update rate.\n", m_deviceID, reading.voltage);
+    } else {
+        uint32_t limits = governorLimits[level];
+        fprintf(stderr, "Warning: CANLight with ID %d: battery at %.2fV, %s level. Dimming to %u%% with at most one color change every %ums.\n",
+                m_deviceID, reading.voltage, GOVERNOR_LEVEL_NAMES[level], (limits & 0xFFFF) * 100 / 256, limits >> 16);
+    }
+    if (Trace::IsEnabled()) {
+        uint64_t now = Trace::Now();
+        Trace::Record(GOVERNOR_TRACE_NAMES[level], now, now, m_deviceID);
+    }
+
+    if (HasShadowState()) RestartResync();
+    std::scoped_lock sendLock(m_sendMutex);
+    std::scoped_lock lock(m_table.held[m_deviceID].mutex);
+    uint64_t mode = m_commands.modeShadow;
+    if (m_table.held[m_deviceID].frame.messageID != 0 && mode != 0) { // a held color would keep repeating at the old brightness
+        CANFrame frame = UnpackModeShadow(mode);
+        Dim(frame);
+        int32_t status = 0;
+        SendHeld(frame, &status);
+    }
+}
+
+void CANLightDriver::SetPresenceCallback(PresenceCallback callback) {
+    CANLightTable::Presence& presence = m_table.presence[m_deviceID];
+    std::scoped_lock lock(presence.mutex);
+    presence.callback = std::move(callback);
+}
+
+void CANLightDriver::NotifyPresence(bool present) {
+    CANLightTable::Presence& presence = m_table.presence[m_deviceID];
+    PresenceCallback callback;
+    {
+        std::scoped_lock lock(presence.mutex);
+        callback = presence.callback;
+    }
+    if (callback) callback(m_deviceID, present); // outside the lock, so the callback may replace itself
+}
+
+/**
+ * Each step is one loop over the open devices in the table. Every open slot
+ * is referenced for the whole pass, so a new CANLight can't reset one under
+ * it, even while the pass waits on a presence callback.
+ */
+uint64_t CANLightDriver::MonitorPass(std::chrono::steady_clock::time_point now) {
+    CANLightTable& table = CANLightTable::GetInstance();
+    uint64_t open = table.open.load(), devices = 0;
+    for (uint64_t rest = open; rest != 0; rest &= rest - 1) {
+        uint8_t id = std::countr_zero(rest);
+        if (!table.TryRef(id)) continue;
+        if (table.open.load() & (uint64_t(1) << id)) devices |= uint64_t(1) << id;
+        else table.Unref(id); // closed meanwhile
+    }
+
+    for (uint64_t rest = devices; rest != 0; rest &= rest - 1) {
+        uint8_t id = std::countr_zero(rest);
+        if (table.commands[id].pendingCount != 0) CANLightDriver(id).ServicePending();
+    }
+
+    StatusReading previous[CANLightTable::kSlots];
+    uint64_t heard = 0;
+    for (uint64_t rest = devices; rest != 0; rest &= rest - 1) {
+        uint8_t id = std::countr_zero(rest);
+        CANLightDriver driver(id);
+        previous[id] = driver.LastStatus(now);
+        if (driver.PollStatus()) heard |= uint64_t(1) << id;
+    }
+
+    uint64_t arrived = 0;
+    for (uint64_t rest = devices; rest != 0; rest &= rest - 1) {
+        uint8_t id = std::countr_zero(rest);
+        if (CANLightDriver(id).Watch(now, previous[id], heard & (uint64_t(1) << id))) arrived |= uint64_t(1) << id;
+    }
+
+    table.fetching.fetch_or(arrived);
+    Resync(devices);
+    for (uint64_t rest = devices; rest != 0; rest &= rest - 1) table.Unref(std::countr_zero(rest));
+    return arrived;
+}
+
+/**
+ * Reading the metadata waits up to 100ms for each reply, so it is kept off
+ * the monitor's pass, which would otherwise stall retries and presence for
+ * every other device meanwhile.
+ */
+void CANLightDriver::FetchArrived(uint64_t devices) {
+    CANLightTable& table = CANLightTable::GetInstance();
+    for (; devices != 0; devices &= devices - 1) {
+        uint8_t id = std::countr_zero(devices);
+        uint64_t bit = uint64_t(1) << id;
+        if (!table.TryRef(id)) continue; // reset by the next Open, which clears the bit
+        if (table.open.load() & bit) {
+            int32_t status = 0;
+            if (CANLightDriver(id).FetchMetadata(100, &status)) table.connected.fetch_or(bit);
+        }
+        if (!(table.connected.load() & bit)) table.fetching.fetch_and(~bit); // not found after all; the monitor looks again
+        table.Unref(id);
+    }
+}
+
+/**
+ * Presence is judged from the status broadcast. A device that is not found
+ * is also asked for its name once a second, without waiting for the answer,
+ * in case it is not broadcasting yet. A device that has broadcast status and
+ * then goes quiet for a second is considered disconnected.
+ */
+bool CANLightDriver::Watch(std::chrono::steady_clock::time_point now, const StatusReading& previous, bool heard) {
+    CANLightTable::MonitorState& monitor = m_table.monitor[m_deviceID];
+    uint64_t bit = uint64_t(1) << m_deviceID;
+    if (!heard) monitor.lastSilentPoll = now;
+
+    if (m_table.connected.load() & bit) { // FetchArrived read its metadata
+        m_table.connected.fetch_and(~bit);
+        m_table.fetching.fetch_and(~bit);
+        fprintf(stderr, "CANLight with ID %d connected.\n", m_deviceID);
+        if (HasShadowState()) RestartResync(); // it may have lost power while away
+        NotifyPresence(true);
+        return false;
+    }
+
+    if (GetState() == State::NotFound) {
+        if (m_table.fetching.load() & bit) return false;
+        // a discovery or metadata read is collecting this ID's replies; look again next pass
+        std::unique_lock fetchLock(m_table.fetchMutex[m_deviceID], std::try_to_lock);
+        if (!fetchLock.owns_lock()) return false;
+
+        uint8_t data[8];
+        int32_t status = 0;
+        getMessage(m_frames.Get<messages::DeviceName>(), data, nullptr, &status);
+        if (status == 0) heard = true;
+
+        if (heard) return true;
+        if (now - monitor.lastDiscovery >= kDiscoveryInterval) {
+            monitor.lastDiscovery = now;
+            requestMessage(m_frames.Get<messages::DeviceName>(), &status);
+        }
+        return false;
+    }
+
+    // only count silence this thread saw by polling; a late pass (blocked
+    // reading metadata, or waiting for a callback) is not a quiet device
+    if (heard && previous.valid && monitor.lastSilentPoll - (now - previous.age) > kResetGap && HasShadowState()) {
+        fprintf(stderr, "Warning: CANLight with ID %d stopped responding briefly and may have reset. Restoring its state.\n", m_deviceID);
+        RestartResync();
+    }
+
+    StatusReading last = LastStatus(now);
+    UpdateGovernor(last);
+    if (GetState() == State::Enabled && last.valid && last.age > kPresenceTimeout) {
+        fprintf(stderr, "ERROR: CANLight with ID %d disconnected. This instance has been disabled until it is connected.\n", m_deviceID);
+        SetState(State::NotFound);
+        m_table.lastStatus[m_deviceID] = 0;
+        monitor.lastDiscovery = now;
+        NotifyPresence(false);
+    }
+    return false;
+}
+
+/** Handle lookup on the command path, where it is traced. */
+static CANLightDriver GetCommandDriver(CANLight_Handle handle) {
+    CANLIGHT_TRACE_SPAN("CANLight handle lookup");
+    return CANLightDriver(handle);
+}
 
 extern "C" {
     
 const char* CANLight_GetLibraryVersion() {
-    return mindsensors::CANLightDriver::GetLibraryVersion().c_str();
+    return LIBRARY_VERSION;
+}
+
+void CANLight_UseHALTransport(void) {
+    mindsensorsDriver::SetTransport(nullptr);
+}
+void CANLight_UseSocketCANTransport(const char* interfaceName, int32_t* status) {
+#ifdef __linux__
+    auto transport = std::make_shared<SocketCANTransport>(interfaceName, status);
+    if (*status != 0) return;
+    mindsensorsDriver::SetTransport(std::move(transport));
+#else
+    fprintf(stderr, "ERROR: SocketCAN is only available on Linux.\n");
+    *status = HAL_ERR_CANSessionMux_NotAllowed;
+#endif
+}
+
+void CANLight_SetBusBudget(double fraction) {
+    mindsensorsDriver::SetBusBudget(fraction);
+}
+double CANLight_GetBusUtilization(void) {
+    return mindsensorsDriver::GetBusUtilization();
+}
+
+void CANLight_StartJournal(const char* path, uint64_t capacity, int32_t* status) {
+    auto journal = std::make_shared<CANJournal>(path, capacity, status);
+    if (*status != 0) return;
+    mindsensorsDriver::SetJournal(std::move(journal));
+}
+void CANLight_StopJournal(void) {
+    mindsensorsDriver::SetJournal(nullptr);
+}
+size_t CANLight_ReplayJournal(const char* path, HAL_Bool includeReceived, double speed, int32_t* status) {
+    auto transport = mindsensorsDriver::GetTransport(); // held until the replay ends
+    return CANJournal::Replay(path, *transport, includeReceived, speed, status);
+}
+
+void CANLight_SetTraceEnabled(HAL_Bool enabled) {
+    Trace::SetEnabled(enabled);
+}
+void CANLight_ClearTrace(void) {
+    Trace::Clear();
+}
+void CANLight_WriteTrace(const char* path, int32_t* status) {
+    std::ofstream traceFile(path);
+    traceFile << Trace::DumpJSON();
+    if (!traceFile) {
+        fprintf(stderr, "ERROR: could not write CANLight trace to %s.\n", path);
+        *status = HAL_ERR_CANSessionMux_NotAllowed;
+    }
 }
 
 int CANLight_Constructor(int8_t deviceNumber, int32_t* status) {
-    std::shared_ptr<CANLightDriver> canlight = std::make_shared<CANLightDriver>(deviceNumber, status);
-    if (*status != 0) return HAL_kInvalidHandle;
-    
-    CANLight_Handle handle = canlightHandles.Allocate(deviceNumber - 1, canlight, status);
-    if (handle == HAL_kInvalidHandle) {
-        *status = NO_AVAILABLE_RESOURCES; // 0;
-        return HAL_kInvalidHandle; // (CANLight_Handle)285212671 + deviceNumber;
+    if (deviceNumber < 1 || deviceNumber > 60) {
+        *status = PARAMETER_OUT_OF_RANGE;
+        return HAL_kInvalidHandle;
     }
-    return handle;
+    return CANLightDriver::Open(deviceNumber, status);
 }
 void CANLight_Destructor(CANLight_Handle handle) {
-    canlightHandles.Free(handle);
+    CANLightDriver::Close(handle);
 }
 
 uint8_t CANLight_GetDeviceID(CANLight_Handle handle, int32_t* status) {
-	std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-	if (canlight == nullptr) {
+	CANLightDriver canlight(handle);
+	if (!canlight) {
 		*status = HAL_HANDLE_ERROR;
 		return 0;
 	}
-	return canlight->GetDeviceID(status);
+	return canlight.GetDeviceID(status);
 }
-const char* CANLight_GetDeviceName(CANLight_Handle handle, int32_t* status) {
-	std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-	if (canlight == nullptr) {
+size_t CANLight_GetDeviceName(CANLight_Handle handle, char* buffer, size_t bufferSize, int32_t* status) {
+	CANLightDriver canlight(handle);
+	if (!canlight) {
 		*status = HAL_HANDLE_ERROR;
-		return "";
+		return CopyMetadata({}, buffer, bufferSize);
 	}
-	return canlight->GetDeviceName(status).c_str();
+	return canlight.GetDeviceName(buffer, bufferSize);
 }
-const char* CANLight_GetFirmwareVersion(CANLight_Handle handle, int32_t* status) {
-	std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-	if (canlight == nullptr) {
+size_t CANLight_GetFirmwareVersion(CANLight_Handle handle, char* buffer, size_t bufferSize, int32_t* status) {
+	CANLightDriver canlight(handle);
+	if (!canlight) {
 		*status = HAL_HANDLE_ERROR;
-		return "";
+		return CopyMetadata({}, buffer, bufferSize);
 	}
-	return canlight->GetFirmwareVersion(status).c_str();
+	return canlight.GetFirmwareVersion(buffer, bufferSize);
 }
-const char* CANLight_GetHardwareVersion(CANLight_Handle handle, int32_t* status) {
-	std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-	if (canlight == nullptr) {
+size_t CANLight_GetHardwareVersion(CANLight_Handle handle, char* buffer, size_t bufferSize, int32_t* status) {
+	CANLightDriver canlight(handle);
+	if (!canlight) {
 		*status = HAL_HANDLE_ERROR;
-		return "";
+		return CopyMetadata({}, buffer, bufferSize);
 	}
-	return canlight->GetHardwareVersion(status).c_str();
+	return canlight.GetHardwareVersion(buffer, bufferSize);
 }
-const char* CANLight_GetBootloaderVersion(CANLight_Handle handle, int32_t* status) {
-	std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-	if (canlight == nullptr) {
+size_t CANLight_GetBootloaderVersion(CANLight_Handle handle, char* buffer, size_t bufferSize, int32_t* status) {
+	CANLightDriver canlight(handle);
+	if (!canlight) {
 		*status = HAL_HANDLE_ERROR;
-		return "";
+		return CopyMetadata({}, buffer, bufferSize);
 	}
-	return canlight->GetBootloaderVersion(status).c_str();
+	return canlight.GetBootloaderVersion(buffer, bufferSize);
 }
-const char* CANLight_GetSerialNumber(CANLight_Handle handle, int32_t* status) {
-	std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-	if (canlight == nullptr) {
+size_t CANLight_GetSerialNumber(CANLight_Handle handle, char* buffer, size_t bufferSize, int32_t* status) {
+	CANLightDriver canlight(handle);
+	if (!canlight) {
 		*status = HAL_HANDLE_ERROR;
-		return "";
+		return CopyMetadata({}, buffer, bufferSize);
 	}
-	return canlight->GetSerialNumber(status).c_str();
+	return canlight.GetSerialNumber(buffer, bufferSize);
 }
 
-void CANLight_BlinkLED(CANLight_Handle handle, uint8_t seconds, int32_t* status) {
-	std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-	if (canlight == nullptr) {
+uint32_t CANLight_BlinkLED(CANLight_Handle handle, uint8_t seconds, int32_t* status) {
+	CANLightDriver canlight = GetCommandDriver(handle);
+	if (!canlight) {
 		*status = HAL_HANDLE_ERROR;
-		return;
+		return 0;
 	}
-	canlight->BlinkLED(seconds, status);
+	return canlight.BlinkLED(seconds, status);
 }
 
-void CANLight_ShowRGB(CANLight_Handle handle, uint8_t red, uint8_t green, uint8_t blue, int32_t* status) {
-	std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-	if (canlight == nullptr) {
+uint32_t CANLight_ShowRGB(CANLight_Handle handle, uint8_t red, uint8_t green, uint8_t blue, int32_t* status) {
+	CANLightDriver canlight = GetCommandDriver(handle);
+	if (!canlight) {
 		*status = HAL_HANDLE_ERROR;
-		return;
+		return 0;
 	}
-	canlight->ShowRGB(red, green, blue, status);
+	return canlight.ShowRGB(red, green, blue, status);
 }
-void CANLight_WriteRegister(CANLight_Handle handle, uint8_t index, uint8_t time, uint8_t red, uint8_t green, int8_t blue, int32_t* status) {
-	std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-	if (canlight == nullptr) {
+uint32_t CANLight_WriteRegister(CANLight_Handle handle, uint8_t index, uint8_t time, uint8_t red, uint8_t green, int8_t blue, int32_t* status) {
+	CANLightDriver canlight = GetCommandDriver(handle);
+	if (!canlight) {
 		*status = HAL_HANDLE_ERROR;
-		return;
+		return 0;
 	}
-	canlight->WriteRegister(index, time, red, green, blue, status);
+	return canlight.WriteRegister(index, time, red, green, blue, status);
 }
-void CANLight_Reset(CANLight_Handle handle, int32_t* status) {
-	std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-	if (canlight == nullptr) {
+uint32_t CANLight_Reset(CANLight_Handle handle, int32_t* status) {
+	CANLightDriver canlight = GetCommandDriver(handle);
+	if (!canlight) {
 		*status = HAL_HANDLE_ERROR;
-		return;
+		return 0;
 	}
-	canlight->Reset(status);
+	return canlight.Reset(status);
 }
-void CANLight_ShowRegister(CANLight_Handle handle, uint8_t index, int32_t* status) {
-	std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-	if (canlight == nullptr) {
+uint32_t CANLight_ShowRegister(CANLight_Handle handle, uint8_t index, int32_t* status) {
+	CANLightDriver canlight = GetCommandDriver(handle);
+	if (!canlight) {
 		*status = HAL_HANDLE_ERROR;
-		return;
+		return 0;
 	}
-	canlight->ShowRegister(index, status);
+	return canlight.ShowRegister(index, status);
 }
-void CANLight_Flash(CANLight_Handle handle, uint8_t index, int32_t* status) {
-	std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-	if (canlight == nullptr) {
+uint32_t CANLight_Flash(CANLight_Handle handle, uint8_t index, int32_t* status) {
+	CANLightDriver canlight = GetCommandDriver(handle);
+	if (!canlight) {
 		*status = HAL_HANDLE_ERROR;
-		return;
+		return 0;
 	}
-	canlight->Flash(index, status);
+	return canlight.Flash(index, status);
 }
-void CANLight_Cycle(CANLight_Handle handle, uint8_t fromIndex, uint8_t toIndex, int32_t* status) {
-	std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-	if (canlight == nullptr) {
+uint32_t CANLight_Cycle(CANLight_Handle handle, uint8_t fromIndex, uint8_t toIndex, int32_t* status) {
+	CANLightDriver canlight = GetCommandDriver(handle);
+	if (!canlight) {
 		*status = HAL_HANDLE_ERROR;
-		return;
+		return 0;
 	}
-	canlight->Cycle(fromIndex, toIndex, status);
+	return canlight.Cycle(fromIndex, toIndex, status);
 }
-void CANLight_Fade(CANLight_Handle handle, uint8_t startIndex, uint8_t endIndex, int32_t* status) {
-	std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-	if (canlight == nullptr) {
+uint32_t CANLight_Fade(CANLight_Handle handle, uint8_t startIndex, uint8_t endIndex, int32_t* status) {
+	CANLightDriver canlight = GetCommandDriver(handle);
+	if (!canlight) {
 		*status = HAL_HANDLE_ERROR;
-		return;
+		return 0;
 	}
-	canlight->Fade(startIndex, endIndex, status);
+	return canlight.Fade(startIndex, endIndex, status);
 }
 
 double CANLight_GetBatteryVoltage(CANLight_Handle handle, int32_t* status) {
-    std::shared_ptr<CANLightDriver> canlight = canlightHandles.Get(handle);
-    if (canlight == nullptr) {
+    CANLightDriver canlight = GetCommandDriver(handle);
+    if (!canlight) {
       	*status = HAL_HANDLE_ERROR;
       	return 0;
     }
-    return canlight->GetBatteryVoltage(status);
+    return canlight.GetBatteryVoltage(status);
+}
+
+void CANLight_SetHoldPeriod(CANLight_Handle handle, uint16_t periodMs, int32_t* status) {
+    CANLightDriver canlight(handle);
+    if (!canlight) {
+        *status = HAL_HANDLE_ERROR;
+        return;
+    }
+    canlight.SetHoldPeriod(periodMs, status);
+}
+
+void CANLight_SetPresenceCallback(CANLight_Handle handle, CANLight_PresenceCallback callback, void* param, int32_t* status) {
+    CANLightDriver canlight(handle);
+    if (!canlight) {
+        *status = HAL_HANDLE_ERROR;
+        return;
+    }
+    if (callback == nullptr) {
+        canlight.SetPresenceCallback(nullptr);
+        return;
+    }
+    canlight.SetPresenceCallback([callback, param](uint8_t deviceID, bool present) {
+        callback(param, deviceID, present);
+    });
+}
+HAL_Bool CANLight_IsPresent(CANLight_Handle handle, int32_t* status) {
+    CANLightDriver canlight(handle);
+    if (!canlight) {
+        *status = HAL_HANDLE_ERROR;
+        return false;
+    }
+    return canlight.GetState() != CANLightDriver::State::NotFound;
+}
+
+void CANLight_RefreshMetadata(CANLight_Handle handle, int32_t* status) {
+    CANLightDriver canlight(handle);
+    if (!canlight) {
+        *status = HAL_HANDLE_ERROR;
+        return;
+    }
+    canlight.RefreshMetadata(status);
+}
+uint64_t CANLight_Discover(uint32_t timeoutMs, int32_t* status) {
+    return CANLightDriver::Discover(timeoutMs, status);
+}
+
+size_t CANLight_GetTelemetry(CANLight_Telemetry* telemetry, size_t maxDevices) {
+    CANLightDriver::Telemetry entries[CANLightTable::kSlots];
+    size_t count = CANLightDriver::GetTelemetry(entries, std::min(maxDevices, CANLightTable::kSlots));
+    for (size_t i = 0; i < count; i++) {
+        telemetry[i].deviceID = entries[i].deviceID;
+        telemetry[i].present = entries[i].state != CANLightDriver::State::NotFound;
+        telemetry[i].batteryVoltage = entries[i].batteryVoltage;
+        telemetry[i].statusAgeMs = entries[i].statusAgeMs;
+        telemetry[i].pending = entries[i].pending;
+        telemetry[i].synchronized = entries[i].synchronized;
+        telemetry[i].governorLevel = entries[i].governorLevel;
+        telemetry[i].governorTransitions = entries[i].governorTransitions;
+    }
+    return count;
+}
+
+void CANLight_SetGovernor(const CANLight_GovernorSettings* settings) {
+    if (settings == nullptr) {
+        CANLightDriver::SetGovernor(nullptr);
+        return;
+    }
+    CANLightDriver::GovernorSettings driverSettings;
+    driverSettings.reducedMillivolts = settings->reducedMillivolts;
+    driverSettings.criticalMillivolts = settings->criticalMillivolts;
+    driverSettings.hysteresisMillivolts = settings->hysteresisMillivolts;
+    driverSettings.reducedBrightness = settings->reducedBrightness;
+    driverSettings.criticalBrightness = settings->criticalBrightness;
+    driverSettings.reducedIntervalMs = settings->reducedIntervalMs;
+    driverSettings.criticalIntervalMs = settings->criticalIntervalMs;
+    CANLightDriver::SetGovernor(&driverSettings);
+}
+
+void CANLight_GetDeliveryReport(CANLight_Handle handle, CANLight_DeliveryReport* report, int32_t* status) {
+    CANLightDriver canlight(handle);
+    if (!canlight) {
+        *status = HAL_HANDLE_ERROR;
+        return;
+    }
+    CANLightDriver::DeliveryReport driverReport = canlight.GetDeliveryReport();
+    report->lastIssued = driverReport.lastIssued;
+    report->lastDelivered = driverReport.lastDelivered;
+    report->delivered = driverReport.delivered;
+    report->retries = driverReport.retries;
+    report->superseded = driverReport.superseded;
+    report->dropped = driverReport.dropped;
+    report->throttled = driverReport.throttled;
+    report->pending = driverReport.pending;
+    report->synchronized = driverReport.synchronized;
+    report->acknowledged = driverReport.acknowledged;
+}
+
+CANLight_CommandStatus CANLight_GetCommandStatus(CANLight_Handle handle, uint32_t sequence, int32_t* status) {
+    CANLightDriver canlight(handle);
+    if (!canlight) {
+        *status = HAL_HANDLE_ERROR;
+        return CANLight_CommandUnknown;
+    }
+    return (CANLight_CommandStatus) canlight.GetCommandStatus(sequence);
 }
 
 } // extern "C"
@@ -0,0 +1,64 @@
+#include "CANLightMonitor.h"
+
+#include "CANLightDriver.h"
+
+#include <utility> /* for std::exchange */
+
+using namespace mindsensors;
+
+CANLightMonitor& CANLightMonitor::GetInstance() {
+    static CANLightMonitor instance;
+    return instance;
+}
+
+CANLightMonitor::~CANLightMonitor() {
+    {
+        std::scoped_lock lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeup.notify_all();
+    m_fetchWakeup.notify_all();
+    if (m_thread.joinable()) m_thread.join();
+    if (m_fetchThread.joinable()) m_fetchThread.join();
+}
+
+void CANLightMonitor::Start() {
+    std::scoped_lock lock(m_mutex);
+    if (!m_thread.joinable()) m_thread = std::thread(&CANLightMonitor::Run, this);
+    if (!m_fetchThread.joinable()) m_fetchThread = std::thread(&CANLightMonitor::RunFetches, this);
+}
+
+void CANLightMonitor::Run() {
+    auto next = std::chrono::steady_clock::now();
+
+    while (true) {
+        {
+            std::unique_lock lock(m_mutex);
+            next += kPeriod;
+            if (m_wakeup.wait_until(lock, next, [this] { return m_stop; })) return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        uint64_t arrived = CANLightDriver::MonitorPass(now);
+        if (arrived != 0) {
+            std::scoped_lock lock(m_mutex);
+            m_fetchRequests |= arrived;
+            m_fetchWakeup.notify_one();
+        }
+
+        if (next < now) next = now; // fell behind (e.g. while reading metadata), don't try to catch up
+    }
+}
+
+void CANLightMonitor::RunFetches() {
+    while (true) {
+        uint64_t devices;
+        {
+            std::unique_lock lock(m_mutex);
+            m_fetchWakeup.wait(lock, [this] { return m_stop || m_fetchRequests != 0; });
+            if (m_stop) return;
+            devices = std::exchange(m_fetchRequests, 0);
+        }
+        CANLightDriver::FetchArrived(devices);
+    }
+}
@@ -0,0 +1,158 @@
+#include "CANLightRequests.h"
+#include "CANLightTable.h"
+#include "Trace.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h> /* for read, write */
+#endif
+
+using namespace mindsensors;
+
+namespace {
+
+/**
+ * One worker thread that runs requests in the order they were made, and a
+ * list of finished ones. Requests all talk to the same bus, so running them
+ * in parallel would not finish them sooner.
+ */
+class RequestEngine {
+public:
+    using Job = std::function<void(CANLightRequests::Completion&)>;
+
+    static RequestEngine& GetInstance() {
+        static RequestEngine instance;
+        return instance;
+    }
+
+    int GetNotifier() const { return m_notifier; }
+
+    uint64_t Submit(Job job) {
+        std::scoped_lock lock(m_mutex);
+        uint64_t request = ++m_lastRequest;
+        m_queue.push_back({request, Trace::IsEnabled() ? Trace::Now() : 0, std::move(job)});
+        if (!m_thread.joinable()) m_thread = std::thread(&RequestEngine::Run, this);
+        m_wakeup.notify_one();
+        return request;
+    }
+
+    std::vector<CANLightRequests::Completion> TakeCompletions() {
+        std::vector<CANLightRequests::Completion> completions;
+        std::scoped_lock lock(m_mutex);
+#ifdef __linux__
+        uint64_t count;
+        if (m_notifier >= 0 && read(m_notifier, &count, sizeof(count)) < 0) {} // clear readiness; EAGAIN if already clear
+#endif
+        completions.swap(m_completions);
+        return completions;
+    }
+
+private:
+    RequestEngine() {
+        CANLightTable::GetInstance(); // destroyed after the CANLights queued requests hold
+#ifdef __linux__
+        m_notifier = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+    }
+
+    ~RequestEngine() {
+        {
+            std::scoped_lock lock(m_mutex);
+            m_stop = true;
+        }
+        m_wakeup.notify_all();
+        if (m_thread.joinable()) m_thread.join();
+#ifdef __linux__
+        if (m_notifier >= 0) close(m_notifier);
+#endif
+    }
+
+    void Run() {
+        std::unique_lock lock(m_mutex);
+        while (true) {
+            m_wakeup.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+            if (m_stop) return;
+            Queued queued = std::move(m_queue.front());
+            m_queue.pop_front();
+            lock.unlock();
+
+            if (queued.submittedNs != 0) Trace::Record("CANLightRequests queued", queued.submittedNs, Trace::Now());
+            CANLIGHT_TRACE_SPAN("CANLightRequests run");
+            CANLightRequests::Completion completion;
+            completion.request = queued.request;
+            try {
+                queued.job(completion);
+            } catch (const std::exception& e) {
+                completion.error = e.what();
+            } catch (...) {
+                completion.error = "unknown error";
+            }
+
+            lock.lock();
+            m_completions.push_back(std::move(completion));
+#ifdef __linux__
+            uint64_t one = 1;
+            if (m_notifier >= 0 && write(m_notifier, &one, sizeof(one)) < 0) {} // can only fail if the counter overflows
+#endif
+        }
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    bool m_stop = false;
+    uint64_t m_lastRequest = 0;
+    struct Queued {
+        uint64_t request;
+        uint64_t submittedNs; // 0 unless tracing
+        Job job;
+    };
+    std::deque<Queued> m_queue;
+    std::vector<CANLightRequests::Completion> m_completions;
+    int m_notifier = -1;
+    std::thread m_thread; // started with the first request
+};
+
+} // namespace
+
+int CANLightRequests::GetNotifier() {
+	return RequestEngine::GetInstance().GetNotifier();
+}
+
+uint64_t CANLightRequests::Create(uint8_t deviceNumber) {
+	// fail now rather than later, as the constructor would
+	if (deviceNumber > 60 || deviceNumber < 1) throw std::invalid_argument("Device number must be between 1 and 60.");
+	return RequestEngine::GetInstance().Submit([deviceNumber](Completion& completion) {
+		completion.light.emplace(deviceNumber);
+	});
+}
+
+uint64_t CANLightRequests::RefreshInfo(const CANLight& light) {
+	return RequestEngine::GetInstance().Submit([light = light](Completion&) mutable { // a non-const copy
+		light.RefreshInfo();
+	});
+}
+
+uint64_t CANLightRequests::BatteryVoltage(const CANLight& light) {
+	return RequestEngine::GetInstance().Submit([light](Completion& completion) {
+		completion.voltage = light.GetBatteryVoltage();
+	});
+}
+
+uint64_t CANLightRequests::Discover(double timeout) {
+	if (timeout < 0) throw std::invalid_argument("Time/duration must be positive.");
+	return RequestEngine::GetInstance().Submit([timeout](Completion& completion) {
+		completion.deviceIDs = CANLight::Discover(timeout);
+	});
+}
+
+std::vector<CANLightRequests::Completion> CANLightRequests::TakeCompletions() {
+	return RequestEngine::GetInstance().TakeCompletions();
+}
@@ -0,0 +1,87 @@
+#include "CANLightTable.h"
+
+#include <array>
+#include <utility> /* for std::index_sequence */
+
+using namespace mindsensors;
+
+template <size_t... IDs>
+static constexpr std::array<messages::CANLightFrames, sizeof...(IDs)> MakeFrames(std::index_sequence<IDs...>) {
+    return {messages::CANLightFrames(IDs)...};
+}
+static constexpr auto FRAMES = MakeFrames(std::make_index_sequence<CANLightTable::kSlots>());
+
+CANLightTable& CANLightTable::GetInstance() {
+    static CANLightTable instance;
+    return instance;
+}
+
+const messages::CANLightFrames& CANLightTable::Frames(uint8_t deviceID) {
+    return FRAMES[deviceID & 63];
+}
+
+bool CANLightTable::Claim(uint8_t deviceID, uint8_t* generation) {
+    uint32_t current = refs[deviceID].load();
+    do {
+        if ((current & 0xFFFFFF) != 0) return false;
+    } while (!refs[deviceID].compare_exchange_weak(current, current + (1u << 24) + 1));
+    *generation = (current >> 24) + 1;
+    ResetSlot(deviceID);
+    return true;
+}
+
+bool CANLightTable::TryRef(uint8_t deviceID, int generation) {
+    uint32_t current = refs[deviceID].load();
+    do {
+        if ((current & 0xFFFFFF) == 0) return false;
+        if (generation >= 0 && (current >> 24) != (uint32_t) generation) return false;
+    } while (!refs[deviceID].compare_exchange_weak(current, current + 1));
+    return true;
+}
+
+void CANLightTable::Unref(uint8_t deviceID) {
+    refs[deviceID].fetch_sub(1);
+}
+
+void CANLightTable::ResetSlot(uint8_t deviceID) {
+    state[deviceID] = 1; // CANLightDriver::State::NotFound, until the device answers
+    lastStatus[deviceID] = 0;
+    modeAcknowledged[deviceID] = 0;
+    needsResync.fetch_and(~(uint64_t(1) << deviceID));
+    fetching.fetch_and(~(uint64_t(1) << deviceID));
+    connected.fetch_and(~(uint64_t(1) << deviceID));
+    for (auto& value : registerShadow[deviceID]) value = 0;
+
+    CommandState& command = commands[deviceID];
+    command.lastIssued = 0;
+    command.lastDelivered = 0;
+    command.lastModeIssued = 0;
+    command.lastModeDelivered = 0;
+    command.delivered = 0;
+    command.retries = 0;
+    command.superseded = 0;
+    command.dropped = 0;
+    command.modeShadow = 0;
+    command.traceModeSentNs = 0;
+    command.throttled = 0;
+    command.lastModeSentMs = 0;
+    command.pendingCount = 0;
+    command.registersWritten = 0;
+    command.governorLevel = 0;
+    command.governorTransitions = 0;
+
+    pending[deviceID].lostCount = 0;
+    pending[deviceID].lostForgotten = 0;
+    holdPeriodMs[deviceID] = 0;
+    held[deviceID].frame = CANFrame{}; // released when the previous owner closed
+    held[deviceID].periodMs = 0;
+    monitor[deviceID] = MonitorState();
+    monitor[deviceID].lastDiscovery = std::chrono::steady_clock::now();
+    {
+        std::scoped_lock lock(presence[deviceID].mutex);
+        presence[deviceID].callback = nullptr;
+    }
+
+    std::scoped_lock lock(metadataMutex[deviceID]);
+    metadata[deviceID] = Metadata();
+}
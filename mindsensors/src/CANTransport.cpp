@@ -0,0 +1,22 @@
+#include "CANTransport.h"
+
+#include "hal/CAN.h"
+
+using namespace mindsensors;
+
+/** Send frames one at a time; backends that can batch override this. */
+size_t CANTransport::SendMessages(const CANFrame* frames, size_t count, int32_t* status) {
+    for (size_t i = 0; i < count; i++) {
+        SendMessage(frames[i].messageID, frames[i].data, frames[i].dataSize, HAL_CAN_SEND_PERIOD_NO_REPEAT, status);
+        if (*status < 0) return i;
+    }
+    return count;
+}
+
+void HALCANTransport::SendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t periodMs, int32_t* status) {
+    HAL_CAN_SendMessage(messageID, data, dataSize, periodMs, status);
+}
+
+void HALCANTransport::ReceiveMessage(uint32_t* messageID, uint32_t messageIDMask, uint8_t* data, uint8_t* dataSize, uint32_t* timeStamp, int32_t* status) {
+    HAL_CAN_ReceiveMessage(messageID, messageIDMask, data, dataSize, timeStamp, status);
+}
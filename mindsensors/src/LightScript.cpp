@@ -0,0 +1,169 @@
+#include "LightScript.h"
+#include "CANLightTable.h"
+
+#include <exception>
+#include <iostream> /* for reporting script errors */
+
+using namespace mindsensors;
+
+void LightScript::promise_type::unhandled_exception() {
+    try {
+        std::rethrow_exception(std::current_exception());
+    } catch (const std::exception& e) {
+        std::cerr << "Warning: CANLight script stopped: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Warning: CANLight script stopped by an unknown exception" << std::endl;
+    }
+}
+
+LightScript& LightScript::operator=(LightScript&& other) noexcept {
+    if (this != &other) {
+        if (m_handle) m_handle.destroy();
+        m_handle = other.m_handle;
+        other.m_handle = nullptr;
+    }
+    return *this;
+}
+
+LightScript::~LightScript() {
+    if (m_handle) m_handle.destroy(); // never started
+}
+
+LightScriptExecutor& LightScriptExecutor::GetInstance() {
+    static LightScriptExecutor instance;
+    return instance;
+}
+
+// Scripts hold CANLights, which close into the device table when the last
+// copy goes, so the table is constructed first and destroyed after the
+// scripts left at exit.
+LightScriptExecutor::LightScriptExecutor() {
+    CANLightTable::GetInstance();
+}
+
+LightScriptExecutor::~LightScriptExecutor() {
+    {
+        std::scoped_lock lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeup.notify_all();
+    if (m_thread.joinable()) m_thread.join();
+    for (auto& task : m_tasks) task.coroutine.destroy();
+}
+
+int LightScriptExecutor::Start(uint8_t deviceID, LightScript script) {
+    auto coroutine = script.Release();
+    if (!coroutine) return 0;
+    coroutine.promise().wakeTime = std::chrono::steady_clock::now();
+
+    std::scoped_lock lock(m_mutex);
+    if (deviceID != 0) {
+        for (size_t i = m_tasks.size(); i-- > 0;) {
+            if (m_tasks[i].deviceID == deviceID) CancelLocked(i); // replaced
+        }
+    }
+    int handle = m_nextHandle++;
+    m_tasks.push_back(Task{handle, deviceID, coroutine});
+    if (!m_thread.joinable()) m_thread = std::thread(&LightScriptExecutor::Run, this);
+    m_wakeup.notify_one();
+    return handle;
+}
+
+void LightScriptExecutor::CancelLocked(size_t index) {
+    if (m_tasks[index].handle == m_running) { // can't destroy a running coroutine; the executor will
+        m_runningCancelled = true;
+        return;
+    }
+    m_tasks[index].coroutine.destroy();
+    m_tasks[index] = m_tasks.back();
+    m_tasks.pop_back();
+}
+
+void LightScriptExecutor::Cancel(int handle) {
+    std::scoped_lock lock(m_mutex);
+    for (size_t i = 0; i < m_tasks.size(); i++) {
+        if (m_tasks[i].handle == handle) { CancelLocked(i); return; }
+    }
+}
+
+void LightScriptExecutor::CancelDevice(uint8_t deviceID) {
+    std::scoped_lock lock(m_mutex);
+    for (size_t i = m_tasks.size(); i-- > 0;) {
+        if (m_tasks[i].deviceID == deviceID) CancelLocked(i);
+    }
+}
+
+bool LightScriptExecutor::IsRunning(int handle) {
+    std::scoped_lock lock(m_mutex);
+    for (const auto& task : m_tasks) {
+        if (task.handle == handle) return !(task.handle == m_running && m_runningCancelled);
+    }
+    return false;
+}
+
+/** Check a suspended script's Until condition. A condition that throws lets the script continue and see the error itself. */
+static bool ConditionHolds(LightScript::promise_type& promise) {
+    try {
+        return promise.condition();
+    } catch (...) {
+        return true;
+    }
+}
+
+void LightScriptExecutor::Run() {
+    std::vector<int> due;
+    std::unique_lock lock(m_mutex);
+
+    while (!m_stop) {
+        auto now = std::chrono::steady_clock::now();
+        due.clear();
+        for (auto& task : m_tasks) {
+            if (now >= task.coroutine.promise().wakeTime) due.push_back(task.handle);
+        }
+
+        for (int handle : due) {
+            // the task may have been cancelled while another one ran
+            size_t index = 0;
+            while (index < m_tasks.size() && m_tasks[index].handle != handle) index++;
+            if (index == m_tasks.size()) continue;
+
+            // marked running first, so a cancel during the condition or the
+            // resume is deferred and the coroutine stays alive until here
+            auto coroutine = m_tasks[index].coroutine;
+            m_running = handle;
+            bool ready = true;
+            if (coroutine.promise().condition) {
+                // user code, which may itself start or cancel scripts
+                lock.unlock();
+                ready = ConditionHolds(coroutine.promise());
+                lock.lock();
+            }
+            if (ready && !m_runningCancelled) {
+                lock.unlock();
+                coroutine.resume();
+                lock.lock();
+            }
+            m_running = 0;
+
+            if (coroutine.done() || m_runningCancelled) {
+                m_runningCancelled = false;
+                index = 0;
+                while (m_tasks[index].handle != handle) index++;
+                CancelLocked(index);
+            }
+        }
+
+        // sleep until the next timer, or poll conditions
+        if (m_tasks.empty()) {
+            m_wakeup.wait(lock);
+            continue;
+        }
+        auto next = std::chrono::steady_clock::time_point::max();
+        for (auto& task : m_tasks) {
+            auto& promise = task.coroutine.promise();
+            auto wake = promise.condition ? std::max(promise.wakeTime, now + kConditionPollPeriod) : promise.wakeTime;
+            next = std::min(next, wake);
+        }
+        m_wakeup.wait_until(lock, next);
+    }
+}
@@ -0,0 +1,75 @@
+#include "LightSequence.h"
+
+#include "LightScript.h"
+
+#include <stdexcept>
+
+using namespace mindsensors;
+
+void LightSequence::ShowRGB(uint8_t red, uint8_t green, uint8_t blue) {
+	m_steps.push_back(Step{StepType::ShowRGB, {red, green, blue}, 0});
+}
+
+void LightSequence::ShowRegister(uint8_t index) {
+	if (index > 7) throw std::out_of_range("Index must be between 0 and 7.");
+	m_steps.push_back(Step{StepType::ShowRegister, {index}, 0});
+}
+
+void LightSequence::Flash(uint8_t index) {
+	if (index > 7) throw std::out_of_range("Index must be between 0 and 7.");
+	m_steps.push_back(Step{StepType::Flash, {index}, 0});
+}
+
+void LightSequence::Cycle(uint8_t fromIndex, uint8_t toIndex) {
+	if (fromIndex > 7 || toIndex > 7) throw std::out_of_range("Indices must be between 0 and 7.");
+	m_steps.push_back(Step{StepType::Cycle, {fromIndex, toIndex}, 0});
+}
+
+void LightSequence::Fade(uint8_t startIndex, uint8_t endIndex) {
+	if (startIndex > 7 || endIndex > 7) throw std::out_of_range("Indices must be between 0 and 7.");
+	m_steps.push_back(Step{StepType::Fade, {startIndex, endIndex}, 0});
+}
+
+void LightSequence::Wait(double seconds) {
+	if (seconds < 0) throw std::invalid_argument("Time/duration must be positive.");
+	m_steps.push_back(Step{StepType::Wait, {}, seconds});
+}
+
+void LightSequence::WaitForDelivery() {
+	m_steps.push_back(Step{StepType::WaitForDelivery, {}, 0});
+}
+
+void LightSequence::SetRepeat(int times) {
+	if (times < 0) throw std::invalid_argument("Repeat count must not be negative.");
+	m_repeat = times;
+}
+
+LightScript LightSequence::Run(CANLight light, std::vector<Step> steps, int repeat) {
+	for (int i = 0; repeat == 0 || i < repeat; i++) {
+		for (const auto& step : steps) {
+			switch (step.type) {
+				case StepType::ShowRGB: light.ShowRGB(step.args[0], step.args[1], step.args[2]); break;
+				case StepType::ShowRegister: light.ShowRegister(step.args[0]); break;
+				case StepType::Flash: light.Flash(step.args[0]); break;
+				case StepType::Cycle: light.Cycle(step.args[0], step.args[1]); break;
+				case StepType::Fade: light.Fade(step.args[0], step.args[1]); break;
+				case StepType::Wait: co_await Delay(std::chrono::duration<double>(step.seconds)); break;
+				case StepType::WaitForDelivery: co_await Delivered(light); break;
+			}
+		}
+		co_await NextTick(); // a repeating sequence with no waits must not hog the executor
+	}
+}
+
+int LightSequence::Start(CANLight& light) const {
+	uint8_t deviceID = light.GetDeviceID();
+	return LightScriptExecutor::GetInstance().Start(deviceID, Run(light, m_steps, m_repeat));
+}
+
+void LightSequence::Cancel(int handle) {
+	LightScriptExecutor::GetInstance().Cancel(handle);
+}
+
+bool LightSequence::IsRunning(int handle) {
+	return LightScriptExecutor::GetInstance().IsRunning(handle);
+}
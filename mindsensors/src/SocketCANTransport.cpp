@@ -0,0 +1,237 @@
+#include "CANTransport.h"
+
+#ifdef __linux__
+
+#include <string.h> /* for strncpy, memcpy */
+#include <errno.h>
+#include <unistd.h> /* for close, write */
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/can/bcm.h>
+
+#include <algorithm> /* for std::min */
+#include <chrono> /* for receive timestamps */
+#include <iostream> /* for printing socket errors */
+
+#include "hal/CAN.h"
+#include "can_mindsensors.h"
+
+using namespace mindsensors;
+
+// frames moved per sendmmsg/recvmmsg call
+static constexpr size_t BATCH_SIZE = 32;
+
+// the manufacturer field of an FRC CAN identifier
+static constexpr uint32_t CAN_MSGID_MFR_M = 0x00FF0000;
+
+static uint32_t TimeStampMs() {
+    return (uint32_t) std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void ToSocketFrame(const CANFrame& in, can_frame* out) {
+    memset(out, 0, sizeof(*out));
+    out->can_id = (in.messageID & CAN_EFF_MASK) | CAN_EFF_FLAG;
+    if (in.messageID & HAL_CAN_IS_FRAME_REMOTE) out->can_id |= CAN_RTR_FLAG;
+    out->can_dlc = std::min<uint8_t>(in.dataSize, CAN_MAX_DLEN);
+    memcpy(out->data, in.data, out->can_dlc);
+}
+
+SocketCANTransport::SocketCANTransport(const char* interfaceName, int32_t* status) {
+    m_socket = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+    if (m_socket < 0) {
+        std::cerr << "ERROR: could not open CAN socket: " << strerror(errno) << std::endl;
+        *status = HAL_ERR_CANSessionMux_NotInitialized;
+        return;
+    }
+
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, interfaceName, IFNAMSIZ - 1);
+    if (ioctl(m_socket, SIOCGIFINDEX, &ifr) < 0) {
+        std::cerr << "ERROR: CAN interface " << interfaceName << " not found: " << strerror(errno) << std::endl;
+        *status = HAL_ERR_CANSessionMux_NotInitialized;
+        return;
+    }
+    m_interfaceIndex = ifr.ifr_ifindex;
+
+    // only wake up for mindsensors traffic
+    struct can_filter filter;
+    filter.can_id = CAN_MSGID_MFR_MS | CAN_EFF_FLAG;
+    filter.can_mask = CAN_MSGID_MFR_M | CAN_EFF_FLAG;
+    if (setsockopt(m_socket, SOL_CAN_RAW, CAN_RAW_FILTER, &filter, sizeof(filter)) < 0) {
+        std::cerr << "ERROR: could not filter CAN interface " << interfaceName << ": " << strerror(errno) << std::endl;
+        *status = HAL_ERR_CANSessionMux_NotInitialized;
+        return;
+    }
+
+    struct sockaddr_can addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.can_family = AF_CAN;
+    addr.can_ifindex = m_interfaceIndex;
+    if (bind(m_socket, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        std::cerr << "ERROR: could not bind to CAN interface " << interfaceName << ": " << strerror(errno) << std::endl;
+        *status = HAL_ERR_CANSessionMux_NotInitialized;
+        return;
+    }
+}
+
+SocketCANTransport::~SocketCANTransport() {
+    if (m_bcmSocket >= 0) close(m_bcmSocket); // closing the BCM socket stops all periodic frames
+    if (m_socket >= 0) close(m_socket);
+}
+
+void SocketCANTransport::SendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t periodMs, int32_t* status) {
+    CANFrame frame;
+    frame.messageID = messageID;
+    frame.dataSize = std::min<uint8_t>(dataSize, 8);
+    if (data != nullptr) memcpy(frame.data, data, frame.dataSize);
+
+    if (periodMs == HAL_CAN_SEND_PERIOD_NO_REPEAT) {
+        SendMessages(&frame, 1, status);
+    } else {
+        SendPeriodic(frame, periodMs, status);
+    }
+}
+
+size_t SocketCANTransport::SendMessages(const CANFrame* frames, size_t count, int32_t* status) {
+    if (m_socket < 0) { *status = HAL_ERR_CANSessionMux_NotInitialized; return 0; }
+
+    can_frame socketFrames[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE];
+    struct mmsghdr msgs[BATCH_SIZE];
+    size_t total = 0;
+
+    while (total < count) {
+        size_t batch = std::min(count - total, BATCH_SIZE);
+        memset(msgs, 0, sizeof(msgs[0]) * batch);
+        for (size_t i = 0; i < batch; i++) {
+            ToSocketFrame(frames[total + i], &socketFrames[i]);
+            iov[i].iov_base = &socketFrames[i];
+            iov[i].iov_len = sizeof(can_frame);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int sent = sendmmsg(m_socket, msgs, batch, 0);
+        if (sent < 0) {
+            // ENOBUFS/EAGAIN: the interface's transmit queue is full
+            *status = HAL_ERR_CANSessionMux_NotAllowed;
+            return total;
+        }
+        total += sent;
+    }
+    return total;
+}
+
+void SocketCANTransport::SendPeriodic(const CANFrame& frame, int32_t periodMs, int32_t* status) {
+    std::scoped_lock lock(m_bcmMutex);
+
+    if (m_bcmSocket < 0) {
+        m_bcmSocket = socket(PF_CAN, SOCK_DGRAM | SOCK_CLOEXEC, CAN_BCM);
+        struct sockaddr_can addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.can_family = AF_CAN;
+        addr.can_ifindex = m_interfaceIndex;
+        if (m_bcmSocket < 0 || connect(m_bcmSocket, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+            std::cerr << "ERROR: could not open CAN broadcast manager socket: " << strerror(errno) << std::endl;
+            if (m_bcmSocket >= 0) close(m_bcmSocket);
+            m_bcmSocket = -1;
+            *status = HAL_ERR_CANSessionMux_NotInitialized;
+            return;
+        }
+    }
+
+    // a BCM message is a header followed by its frames
+    alignas(bcm_msg_head) uint8_t msg[sizeof(bcm_msg_head) + sizeof(can_frame)];
+    memset(msg, 0, sizeof(msg));
+    bcm_msg_head* head = (bcm_msg_head*) msg;
+    ToSocketFrame(frame, &head->frames[0]);
+    head->can_id = head->frames[0].can_id;
+
+    if (periodMs == HAL_CAN_SEND_PERIOD_STOP_REPEATING) {
+        head->opcode = TX_DELETE;
+        // deleting a frame that was never set up is not an error for the HAL either
+        if (write(m_bcmSocket, head, sizeof(bcm_msg_head)) < 0 && errno != EINVAL) *status = HAL_ERR_CANSessionMux_NotAllowed;
+        return;
+    }
+
+    head->opcode = TX_SETUP;
+    head->flags = SETTIMER | STARTTIMER | TX_ANNOUNCE;
+    head->count = 0;
+    head->ival2.tv_sec = periodMs / 1000;
+    head->ival2.tv_usec = (periodMs % 1000) * 1000;
+    head->nframes = 1;
+    if (write(m_bcmSocket, msg, sizeof(msg)) < 0) *status = HAL_ERR_CANSessionMux_NotAllowed;
+}
+
+void SocketCANTransport::Drain() {
+    can_frame socketFrames[BATCH_SIZE];
+    struct iovec iov[BATCH_SIZE];
+    struct mmsghdr msgs[BATCH_SIZE];
+
+    while (true) {
+        memset(msgs, 0, sizeof(msgs));
+        for (size_t i = 0; i < BATCH_SIZE; i++) {
+            iov[i].iov_base = &socketFrames[i];
+            iov[i].iov_len = sizeof(can_frame);
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int received = recvmmsg(m_socket, msgs, BATCH_SIZE, MSG_DONTWAIT, nullptr);
+        if (received <= 0) return;
+
+        uint32_t now = TimeStampMs();
+        for (int i = 0; i < received; i++) {
+            const can_frame& in = socketFrames[i];
+            if (in.can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG)) continue;
+
+            ReceivedFrame& out = m_received[in.can_id & CAN_EFF_MASK];
+            out.frame.messageID = in.can_id & CAN_EFF_MASK;
+            out.frame.dataSize = std::min<uint8_t>(in.can_dlc, CAN_MAX_DLEN);
+            memcpy(out.frame.data, in.data, out.frame.dataSize);
+            out.timeStamp = now;
+            out.fresh = true;
+        }
+
+        if ((size_t) received < BATCH_SIZE) return;
+    }
+}
+
+void SocketCANTransport::ReceiveMessage(uint32_t* messageID, uint32_t messageIDMask, uint8_t* data, uint8_t* dataSize, uint32_t* timeStamp, int32_t* status) {
+    if (m_socket < 0) { *status = HAL_ERR_CANSessionMux_NotInitialized; return; }
+
+    std::scoped_lock lock(m_receivedMutex);
+    Drain();
+
+    ReceivedFrame* match = nullptr;
+    if ((messageIDMask & CAN_EFF_MASK) == CAN_EFF_MASK) {
+        auto it = m_received.find(*messageID & CAN_EFF_MASK);
+        if (it != m_received.end()) match = &it->second;
+    } else {
+        for (auto& entry : m_received) {
+            if (entry.second.fresh && ((entry.first ^ *messageID) & messageIDMask) == 0) {
+                match = &entry.second;
+                break;
+            }
+        }
+    }
+
+    if (match == nullptr || !match->fresh) {
+        *status = HAL_ERR_CANSessionMux_MessageNotFound;
+        return;
+    }
+
+    match->fresh = false;
+    *messageID = match->frame.messageID;
+    if (data != nullptr) memcpy(data, match->frame.data, match->frame.dataSize);
+    if (dataSize != nullptr) *dataSize = match->frame.dataSize;
+    if (timeStamp != nullptr) *timeStamp = match->timeStamp;
+    *status = 0;
+}
+
+#endif // __linux__
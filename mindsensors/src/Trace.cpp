@@ -0,0 +1,143 @@
+#include "Trace.h"
+
+#include <chrono>
+#include <cinttypes> /* for PRIu64 */
+#include <algorithm> /* for std::max */
+#include <cstdio> /* for snprintf */
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace mindsensors;
+
+std::atomic<bool> Trace::enabled{false};
+
+namespace {
+
+/**
+ * Spans recorded by one thread. Only that thread writes; a dump reads
+ * concurrently and discards any slot that may have been overwritten while it
+ * was being read.
+ */
+struct ThreadBuffer {
+    static constexpr uint64_t kCapacity = 8192;
+
+    struct Event {
+        std::atomic<const char*> name;
+        std::atomic<uint64_t> start;
+        std::atomic<uint64_t> end;
+        std::atomic<int32_t> deviceID;
+    };
+
+    uint32_t threadID;
+    std::atomic<uint64_t> count{0};   // spans ever recorded
+    std::atomic<uint64_t> cleared{0}; // count at the last Clear
+    Event events[kCapacity];
+};
+
+std::mutex buffersMutex;
+std::vector<std::shared_ptr<ThreadBuffer>> buffers; // every thread that has recorded, until cleared after it exits
+uint32_t nextThreadID = 1;
+
+/** This thread's buffer, registered the first time the thread records a span. */
+ThreadBuffer& LocalBuffer() {
+    thread_local std::shared_ptr<ThreadBuffer> local;
+    if (!local) {
+        local = std::make_shared<ThreadBuffer>();
+        std::scoped_lock lock(buffersMutex);
+        local->threadID = nextThreadID++;
+        buffers.push_back(local);
+    }
+    return *local;
+}
+
+} // namespace
+
+void Trace::SetEnabled(bool enable) {
+    enabled.store(enable);
+}
+
+uint64_t Trace::Now() {
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::Record(const char* name, uint64_t startNs, uint64_t endNs, int32_t deviceID) {
+    ThreadBuffer& buffer = LocalBuffer();
+    uint64_t index = buffer.count.load(std::memory_order_relaxed);
+    ThreadBuffer::Event& event = buffer.events[index % ThreadBuffer::kCapacity];
+    event.name.store(name, std::memory_order_relaxed);
+    event.start.store(startNs, std::memory_order_relaxed);
+    event.end.store(endNs, std::memory_order_relaxed);
+    event.deviceID.store(deviceID, std::memory_order_relaxed);
+    buffer.count.store(index + 1, std::memory_order_release);
+}
+
+static void AppendEscaped(std::string& out, const char* text) {
+    for (; *text != '\0'; text++) {
+        if (*text == '"' || *text == '\\') out += '\\';
+        out += *text;
+    }
+}
+
+std::string Trace::DumpJSON() {
+    std::vector<std::shared_ptr<ThreadBuffer>> snapshot;
+    {
+        std::scoped_lock lock(buffersMutex);
+        snapshot = buffers;
+    }
+
+    struct Copy {
+        const char* name;
+        uint64_t start, end;
+        int32_t deviceID;
+    };
+    std::vector<Copy> copies;
+    std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    char number[128];
+
+    for (const auto& buffer : snapshot) {
+        uint64_t end = buffer->count.load(std::memory_order_acquire);
+        uint64_t begin = std::max(buffer->cleared.load(), end > ThreadBuffer::kCapacity ? end - ThreadBuffer::kCapacity : 0);
+        copies.clear();
+        for (uint64_t i = begin; i < end; i++) {
+            const ThreadBuffer::Event& event = buffer->events[i % ThreadBuffer::kCapacity];
+            copies.push_back({event.name.load(std::memory_order_relaxed), event.start.load(std::memory_order_relaxed),
+                              event.end.load(std::memory_order_relaxed), event.deviceID.load(std::memory_order_relaxed)});
+        }
+        // the owner may have lapped the ring while we copied, and may be
+        // writing event `after` now, into the slot of after - kCapacity
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t after = buffer->count.load(std::memory_order_relaxed);
+        uint64_t firstValid = after + 1 > ThreadBuffer::kCapacity ? after + 1 - ThreadBuffer::kCapacity : 0;
+
+        for (uint64_t i = std::max(begin, firstValid); i < end; i++) {
+            const Copy& event = copies[i - begin];
+            json += first ? "{\"name\":\"" : ",{\"name\":\"";
+            first = false;
+            AppendEscaped(json, event.name);
+            snprintf(number, sizeof(number), "\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u",
+                     buffer->threadID, event.start / 1000, (unsigned) (event.start % 1000),
+                     (event.end - event.start) / 1000, (unsigned) ((event.end - event.start) % 1000));
+            json += number;
+            if (event.deviceID >= 0) {
+                snprintf(number, sizeof(number), ",\"args\":{\"device\":%d}", event.deviceID);
+                json += number;
+            }
+            json += '}';
+        }
+    }
+    json += "]}";
+    return json;
+}
+
+void Trace::Clear() {
+    std::scoped_lock lock(buffersMutex);
+    std::vector<std::shared_ptr<ThreadBuffer>> live;
+    for (auto& buffer : buffers) {
+        buffer->cleared.store(buffer->count.load());
+        if (buffer.use_count() > 1) live.push_back(std::move(buffer)); // otherwise its thread has exited
+    }
+    buffers.swap(live);
+}
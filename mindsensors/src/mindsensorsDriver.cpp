@@ -3,11 +3,111 @@
 #include <thread> /* for std::this_thread::sleep_for */
 #include <chrono> /* for milliseconds type */
 #include <iostream> /* for printing on -35007 status */
+#include <algorithm> /* for std::min */
+#include <atomic>
 
 #include "hal/CAN.h"
+#include "Trace.h"
 
 using namespace mindsensors;
 
+static HALCANTransport halTransport;
+static SwappablePointer<CANTransport> currentTransport{&halTransport};
+
+/** Route all mindsensors CAN traffic through a different transport. */
+void mindsensorsDriver::SetTransport(std::shared_ptr<CANTransport> transport) {
+    CANTransport* next = transport ? transport.get() : &halTransport;
+    currentTransport.Replace(std::move(transport), next); // the previous transport is released here
+}
+
+mindsensorsDriver::TransportUse mindsensorsDriver::GetTransport() {
+    return TransportUse(currentTransport);
+}
+
+static SwappablePointer<CANJournal> currentJournal{nullptr};
+
+/** Start or stop recording CAN traffic. */
+void mindsensorsDriver::SetJournal(std::shared_ptr<CANJournal> journal) {
+    CANJournal* next = journal.get();
+    std::shared_ptr<CANJournal> previous = currentJournal.Replace(std::move(journal), next);
+    if (previous) previous->Flush(); // and unmapped as it goes out of scope
+}
+
+static void Journal(CANJournal::Direction direction, uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t periodMs) {
+    SwappablePointer<CANJournal>::Use journal(currentJournal);
+    if (journal) journal->Record(direction, messageID, data, dataSize, periodMs);
+}
+
+// FRC CAN runs at 1 Mbit/s, so one bit is one microsecond
+static constexpr int64_t BUS_BITS_PER_SECOND = 1000000;
+static constexpr int BUS_WINDOW_BUCKETS = 10;
+static constexpr int64_t BUS_BUCKET_MICROSECONDS = 10000; // 100ms window
+static constexpr uint64_t BUS_BUCKET_BITS_M = 0xFFFFFF; // low 24 bits count bits, the rest is the bucket's epoch
+
+static std::atomic<uint64_t> busLoadBuckets[BUS_WINDOW_BUCKETS];
+static std::atomic<double> busBudget{1.0};
+static std::atomic<int64_t> periodicBitsPerSecond{0};
+
+static int64_t BusEpochNow() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::microseconds>(now).count() / BUS_BUCKET_MICROSECONDS;
+}
+
+/** Add a sent frame to the sliding window. Each bucket packs its epoch and bit count so it can be reset without a lock. */
+static void RecordBusLoad(uint32_t bits) {
+    int64_t epoch = BusEpochNow();
+    std::atomic<uint64_t>& bucket = busLoadBuckets[epoch % BUS_WINDOW_BUCKETS];
+    uint64_t current = bucket.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+        // saturate rather than carry into the epoch: the count can only exceed
+        // the bus's capacity on a virtual bus, which is over budget anyway
+        uint64_t count = (int64_t)(current >> 24) == epoch ? (current & BUS_BUCKET_BITS_M) + bits : bits;
+        next = ((uint64_t) epoch << 24) | std::min<uint64_t>(count, BUS_BUCKET_BITS_M);
+    } while (!bucket.compare_exchange_weak(current, next, std::memory_order_relaxed));
+}
+
+static uint64_t BusLoadBits() {
+    int64_t epoch = BusEpochNow();
+    uint64_t bits = 0;
+    for (auto& bucket : busLoadBuckets) {
+        uint64_t value = bucket.load(std::memory_order_relaxed);
+        if (epoch - (int64_t)(value >> 24) < BUS_WINDOW_BUCKETS) bits += value & BUS_BUCKET_BITS_M;
+    }
+    return bits;
+}
+
+static constexpr double BUS_WINDOW_BITS = (double) BUS_BITS_PER_SECOND * BUS_WINDOW_BUCKETS * BUS_BUCKET_MICROSECONDS / 1000000;
+
+void mindsensorsDriver::SetBusBudget(double fraction) {
+    if (fraction < 0.0) fraction = 0.0;
+    if (fraction > 1.0) fraction = 1.0;
+    busBudget.store(fraction);
+}
+
+double mindsensorsDriver::GetBusBudget() {
+    return busBudget.load();
+}
+
+static double PeriodicUtilization() {
+    int64_t bits = periodicBitsPerSecond.load(std::memory_order_relaxed);
+    return bits > 0 ? (double) bits / BUS_BITS_PER_SECOND : 0.0;
+}
+
+double mindsensorsDriver::GetBusUtilization() {
+    return BusLoadBits() / BUS_WINDOW_BITS + PeriodicUtilization();
+}
+
+bool mindsensorsDriver::busBudgetAvailable(uint8_t dataSize, uint32_t batchedBits) {
+    double budget = busBudget.load(std::memory_order_relaxed);
+    if (budget >= 1.0) return true;
+    return (BusLoadBits() + batchedBits + FrameBits(dataSize)) / BUS_WINDOW_BITS + PeriodicUtilization() <= budget;
+}
+
+void mindsensorsDriver::addPeriodicLoad(int64_t bitsPerSecond) {
+    periodicBitsPerSecond.fetch_add(bitsPerSecond, std::memory_order_relaxed);
+}
+
 /**
  * Send a message on the CAN bus.
  *
@@ -19,7 +119,10 @@ using namespace mindsensors;
  *                  message every "period" milliseconds.
  */
 void mindsensorsDriver::sendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t period, int32_t* status) {
-    HAL_CAN_SendMessage(messageID, data, dataSize, period, status);
+    CANLIGHT_TRACE_SPAN("CANTransport::SendMessage", messageID & 0x3F);
+    GetTransport()->SendMessage(messageID, data, dataSize, period, status);
+    if (*status == 0 && period != HAL_CAN_SEND_PERIOD_STOP_REPEATING) RecordBusLoad(FrameBits(dataSize));
+    if (*status == 0) Journal(CANJournal::Sent, messageID, data, dataSize, period);
     
     if (*status < 0) {
         std::cerr << "Warning: CAN error" << std::endl;
@@ -30,6 +133,32 @@ void mindsensorsDriver::sendMessage(uint32_t messageID, const uint8_t* data, uin
 void mindsensorsDriver::sendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t* status) {
     sendMessage(messageID, data, dataSize, HAL_CAN_SEND_PERIOD_NO_REPEAT, status);
 }
+/** Send a CAN message once without reporting or clearing errors. */
+void mindsensorsDriver::trySendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t* status) {
+    trySendMessage(messageID, data, dataSize, HAL_CAN_SEND_PERIOD_NO_REPEAT, status);
+}
+/** Send, start repeating or stop repeating a CAN message without reporting or clearing errors. */
+void mindsensorsDriver::trySendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t period, int32_t* status) {
+    CANLIGHT_TRACE_SPAN("CANTransport::SendMessage", messageID & 0x3F);
+    *status = 0;
+    GetTransport()->SendMessage(messageID, data, dataSize, period, status);
+    if (*status == 0) {
+        if (period != HAL_CAN_SEND_PERIOD_STOP_REPEATING) RecordBusLoad(FrameBits(dataSize));
+        Journal(CANJournal::Sent, messageID, data, dataSize, period);
+    }
+}
+
+/** Send a batch of CAN messages without repeat. */
+size_t mindsensorsDriver::sendMessages(const CANFrame* frames, size_t count, int32_t* status) {
+    CANLIGHT_TRACE_SPAN("CANTransport::SendMessages");
+    *status = 0;
+    size_t sent = GetTransport()->SendMessages(frames, count, status);
+    for (size_t i = 0; i < sent; i++) {
+        RecordBusLoad(FrameBits(frames[i].dataSize));
+        Journal(CANJournal::Sent, frames[i].messageID, frames[i].data, frames[i].dataSize, HAL_CAN_SEND_PERIOD_NO_REPEAT);
+    }
+    return sent;
+}
 
 /** Request a message from the CANLight, but don't wait for it to arrive. */
 void mindsensorsDriver::requestMessage(uint32_t messageID, int32_t* status) {
@@ -44,7 +173,10 @@ void mindsensorsDriver::getMessage(uint32_t messageID, uint32_t messageMask, uin
     // caller may have set bit31 for remote frame transmission so clear invalid bits[31-29]
 	targetedMessageID &= CAN_MSGID_FULL_M;
 
-	HAL_CAN_ReceiveMessage(&targetedMessageID, messageMask, data, dataSize, &timeStamp, status);
+	uint8_t receivedSize = 0;
+	GetTransport()->ReceiveMessage(&targetedMessageID, messageMask, data, &receivedSize, &timeStamp, status);
+	if (*status == 0) Journal(CANJournal::Received, targetedMessageID, data, receivedSize, 0);
+	if (dataSize != nullptr) *dataSize = receivedSize;
 }
 /** Get a previously requested message, assuming message mask. */
 void mindsensorsDriver::getMessage(uint32_t messageID, uint8_t* data, uint8_t* dataSize, int32_t* status) {
@@ -0,0 +1,140 @@
+#include "FakeHAL.h"
+
+#include "hal/CAN.h"
+#include "CANLightMessages.h"
+
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <thread>
+
+using namespace mindsensors;
+
+static std::atomic<bool> present[64];
+static std::atomic<bool> nameOnly[64];
+static std::atomic<uint64_t> sent[64];
+static std::atomic<uint32_t> lastSentID[64];
+static std::atomic<uint64_t> lastSentData[64];
+// bit n: the frame with API number n is repeating
+static std::atomic<uint64_t> repeating[64];
+static std::atomic<uint32_t> batteryRaw{4112}; // about 11.5V
+static std::atomic<int> failSends{0};
+static std::atomic<int64_t> sendCostNs{0};
+// requested but unread name, version and serial number replies: bit 0, 1, 2
+static std::atomic<uint8_t> replies[64];
+
+// the bit for a request/reply message, 0 if the API is broadcast or a command
+static uint8_t ReplyBit(uint32_t api) {
+    if (api == messages::DeviceName::kApiID) return 1;
+    if (api == messages::FirmwareVersion::kApiID) return 2;
+    if (api == messages::SerialNumber::kApiID) return 4;
+    return 0;
+}
+
+static uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void fakehal::SetPresent(uint8_t deviceID, bool isPresent) {
+    present[deviceID & 63] = isPresent;
+}
+
+void fakehal::SetNameOnly(uint8_t deviceID, bool isNameOnly) {
+    nameOnly[deviceID & 63] = isNameOnly;
+}
+
+void fakehal::SetBatteryVoltage(double volts) {
+    batteryRaw = (uint32_t) (volts * 1000 / 2.8); // inverse of StatusData::DecodeBatteryVoltage
+}
+
+void fakehal::FailNextSends(int count) {
+    failSends = count;
+}
+
+void fakehal::SetSendCost(std::chrono::nanoseconds cost) {
+    sendCostNs = cost.count();
+}
+
+uint64_t fakehal::SentFrames(uint8_t deviceID) {
+    return sent[deviceID & 63];
+}
+
+uint32_t fakehal::LastSent(uint8_t deviceID, uint8_t data[8]) {
+    uint64_t packed = lastSentData[deviceID & 63];
+    memcpy(data, &packed, 8);
+    return lastSentID[deviceID & 63];
+}
+
+int fakehal::RepeatingFrames(uint8_t deviceID) {
+    return std::popcount(repeating[deviceID & 63].load());
+}
+
+extern "C" {
+
+void HAL_CAN_SendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t periodMs, int32_t* status) {
+    int64_t cost = sendCostNs.load(std::memory_order_relaxed);
+    if (cost > 0) std::this_thread::sleep_for(std::chrono::nanoseconds(cost));
+
+    int failures = failSends.load(std::memory_order_relaxed);
+    while (failures > 0 && !failSends.compare_exchange_weak(failures, failures - 1)) {}
+    if (failures > 0) {
+        *status = HAL_ERR_CANSessionMux_NotAllowed;
+        return;
+    }
+    sent[messageID & 63].fetch_add(1, std::memory_order_relaxed);
+    uint64_t api = (uint64_t) 1 << ((messageID >> CAN_MSGID_API_S) & 63);
+    if (periodMs > 0) repeating[messageID & 63] |= api;
+    else if (periodMs == HAL_CAN_SEND_PERIOD_STOP_REPEATING) repeating[messageID & 63] &= ~api;
+    if (dataSize != 0) {
+        uint64_t packed = 0;
+        memcpy(&packed, data, dataSize);
+        lastSentID[messageID & 63] = messageID;
+        lastSentData[messageID & 63] = packed;
+    }
+    uint8_t reply = ReplyBit(messageID & ~0x3Fu);
+    if (nameOnly[messageID & 63]) reply &= 1;
+    if (dataSize == 0 && present[messageID & 63]) replies[messageID & 63] |= reply;
+    *status = 0;
+}
+
+void HAL_CAN_ReceiveMessage(uint32_t* messageID, uint32_t messageIDMask, uint8_t* data, uint8_t* dataSize, uint32_t* timeStamp, int32_t* status) {
+    uint8_t deviceID = *messageID & 0x3F;
+    if (!present[deviceID]) {
+        *status = HAL_ERR_CANSessionMux_MessageNotFound;
+        return;
+    }
+
+    // like the roboRIO, a requested reply can be read once, by whoever asks first
+    uint32_t api = *messageID & ~0x3Fu;
+    uint8_t bit = ReplyBit(api);
+    if (bit != 0 && !(replies[deviceID].fetch_and(~bit) & bit)) {
+        *status = HAL_ERR_CANSessionMux_MessageNotFound;
+        return;
+    }
+
+    uint8_t reply[8] = {};
+    uint8_t replySize = 8;
+    if (api == messages::DeviceName::kApiID) {
+        memcpy(reply, "CANLight", 8);
+    } else if (api == messages::FirmwareVersion::kApiID) {
+        const uint8_t versions[6] = {1, 2, 1, 0, 1, 0};
+        memcpy(reply, versions, sizeof(versions));
+        replySize = sizeof(versions);
+    } else if (api == messages::SerialNumber::kApiID) {
+        memcpy(reply, "1234567", 8);
+    } else if (api == messages::StatusData::kApiID) {
+        uint32_t raw = batteryRaw;
+        reply[1] = raw & 0xFF;
+        reply[2] = (raw >> 8) & 0xFF;
+    } else {
+        *status = HAL_ERR_CANSessionMux_MessageNotFound;
+        return;
+    }
+
+    if (data != nullptr) memcpy(data, reply, replySize);
+    if (dataSize != nullptr) *dataSize = replySize;
+    if (timeStamp != nullptr) *timeStamp = (uint32_t) (NowNs() / 1000000);
+    *status = 0;
+}
+
+} // extern "C"
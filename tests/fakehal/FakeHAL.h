@@ -0,0 +1,34 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * A stand-in for the HAL's CAN functions, for exercising the library
+ * without a roboRIO. Devices answer metadata requests and status polls as a
+ * CANLight does: each request yields one reply, which the first receive for
+ * that message takes. Sent commands are only counted. Everything here is lock free,
+ * so the fake adds no serialization of its own to what is measured.
+ */
+namespace fakehal {
+
+void SetPresent(uint8_t deviceID, bool present);
+// answer name requests but not version or serial number requests, so that
+// reading the device's metadata waits out the timeouts
+void SetNameOnly(uint8_t deviceID, bool nameOnly);
+void SetBatteryVoltage(double volts);
+
+// the next `count` sends fail with HAL_ERR_CANSessionMux_NotAllowed
+void FailNextSends(int count);
+// block this long in every send, as the real netcomm call does; a blocked
+// sender yields the CPU, so scaling shows up even on a single core
+void SetSendCost(std::chrono::nanoseconds cost);
+
+uint64_t SentFrames(uint8_t deviceID);
+// the last frame sent to a device: returns its message ID and copies its data
+uint32_t LastSent(uint8_t deviceID, uint8_t data[8]);
+// frames sent with a period and not yet stopped, which netcomm would still be
+// repeating to a device
+int RepeatingFrames(uint8_t deviceID);
+
+} // namespace fakehal
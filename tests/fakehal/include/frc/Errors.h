@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+#define FRC_CheckErrorStatus(status, format, ...) \
+    do { \
+        if ((status) != 0) throw std::runtime_error("HAL error " + std::to_string(status)); \
+    } while (0)
@@ -0,0 +1,9 @@
+#pragma once
+
+namespace frc {
+struct Color8Bit {
+    int red = 0;
+    int green = 0;
+    int blue = 0;
+};
+} // namespace frc
@@ -0,0 +1,6 @@
+#pragma once
+
+#define NO_AVAILABLE_RESOURCES -1004
+#define PARAMETER_OUT_OF_RANGE -1028
+#define RESOURCE_IS_ALLOCATED -1029
+#define HAL_HANDLE_ERROR -1098
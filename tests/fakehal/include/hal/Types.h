@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef int32_t HAL_Handle;
+typedef int32_t HAL_Bool;
+
+#define HAL_kInvalidHandle 0
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "hal/Types.h"
+
+namespace hal {
+enum class HAL_HandleEnum { Undefined = 0, Vendor = 17 };
+} // namespace hal
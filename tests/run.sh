@@ -0,0 +1,25 @@
+#!/bin/sh
+# Build the stress tests against the fake HAL in tests/fakehal and run them.
+#
+#   tests/run.sh           optimized build; reports throughput scaling
+#   tests/run.sh thread    ThreadSanitizer build (also: address, undefined)
+#
+# The Python package is built by robotpy-build; this only needs a C++20
+# compiler, so the library can be exercised without wpilib or a roboRIO.
+set -e
+cd "$(dirname "$0")/.."
+
+CXX=${CXX:-g++}
+FLAGS="-std=c++20 -O2 -g -pthread"
+[ -n "$1" ] && FLAGS="$FLAGS -fsanitize=$1"
+OUT=tests/build
+mkdir -p "$OUT"
+
+SOURCES=$(ls mindsensors/src/*.cpp | grep -v main.cpp)
+for test in tests/stress_*.cpp; do
+    name=$(basename "$test" .cpp)
+    $CXX $FLAGS -I mindsensors/include -I tests/fakehal/include -I tests/fakehal \
+        $SOURCES tests/fakehal/FakeHAL.cpp "$test" -o "$OUT/$name"
+    echo "== $name"
+    "$OUT/$name"
+done
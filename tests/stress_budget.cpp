@@ -0,0 +1,117 @@
+/*
+ * The bus budget, against the load the library records for its own frames.
+ *
+ *  - the reported utilization matches the frames that were sent
+ *  - a thread changing colors as fast as it can stays within the budget,
+ *    and the device ends up showing the last color commanded
+ *  - register writes are not held back for bus time, but do wait behind a
+ *    color that is
+ */
+
+#include "CANLight.h"
+#include "CANLightMessages.h"
+#include "mindsensorsDriver.h"
+#include "FakeHAL.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+using namespace mindsensors;
+using namespace std::chrono_literals;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+static const uint8_t kID = 40;
+static const double kColorBits = mindsensorsDriver::FrameBits(messages::ColorSet::kSize);
+static const double kWindowBits = 100000; // 100ms at 1Mbit/s
+
+static void WaitForPending(CANLight& light) {
+    auto deadline = std::chrono::steady_clock::now() + 2s;
+    while (light.GetDeliveryReport().pending != 0 && std::chrono::steady_clock::now() < deadline) std::this_thread::sleep_for(5ms);
+    CHECK(light.GetDeliveryReport().pending == 0);
+}
+
+static void Utilization(CANLight& light) {
+    std::this_thread::sleep_for(150ms); // until earlier frames have left the window
+    CHECK(CANLight::GetBusUtilization() == 0);
+    for (uint8_t i = 0; i < 50; i++) light.ShowRGB(i, 0, 0);
+    double utilization = CANLight::GetBusUtilization();
+    double expected = 50 * kColorBits / kWindowBits;
+    printf("50 colors: %.4f of the bus, %.4f expected\n", utilization, expected);
+    CHECK(utilization >= expected - 1e-9 && utilization <= expected + 1e-9);
+}
+
+static void Stream(CANLight& light) {
+    const double budget = 0.02;
+    std::this_thread::sleep_for(150ms);
+    CANLight::SetBusBudget(budget);
+    CANLight::DeliveryReport before = light.GetDeliveryReport();
+    uint64_t sentBefore = fakehal::SentFrames(kID);
+    double highest = 0;
+    uint8_t last = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint8_t i = 1; std::chrono::steady_clock::now() - start < 1s; i = i % 250 + 1) {
+        light.ShowRGB(i, 0, 0);
+        last = i;
+        highest = std::max(highest, CANLight::GetBusUtilization());
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t sent = fakehal::SentFrames(kID) - sentBefore;
+    CANLight::DeliveryReport report = light.GetDeliveryReport();
+    // a full window may go out at the start, then the window's worth each 100ms
+    double allowed = (budget * 1e6 * seconds + budget * kWindowBits) / kColorBits;
+    printf("%llu colors sent in %.2fs (at most %.0f), %u superseded, highest utilization %.4f\n",
+           (unsigned long long) sent, seconds, allowed, report.superseded - before.superseded, highest);
+    CHECK(sent <= allowed + 1);
+    CHECK(sent >= allowed / 2); // the budget is used, not starved
+    CHECK(highest <= budget + 1e-9);
+    CHECK(report.superseded > before.superseded);
+
+    WaitForPending(light);
+    uint8_t data[8];
+    CHECK(fakehal::LastSent(kID, data) == messages::ColorSet::ArbitrationID(kID));
+    CHECK(data[1] == last);
+    CANLight::SetBusBudget(1.0);
+}
+
+static void Registers(CANLight& light) {
+    CANLight::SetBusBudget(0); // no color fits
+    uint8_t data[8];
+    uint32_t write = light.WriteRegister(1, 0.1, 1, 2, 3);
+    CHECK(light.GetCommandStatus(write) == CANLight::CommandStatus::Delivered);
+    CHECK(fakehal::LastSent(kID, data) == messages::ColorLoad::ArbitrationID(kID));
+
+    uint32_t color = light.ShowRGB(4, 5, 6);
+    write = light.WriteRegister(2, 0.1, 7, 8, 9);
+    std::this_thread::sleep_for(100ms);
+    CHECK(light.GetCommandStatus(color) == CANLight::CommandStatus::Pending);
+    CHECK(light.GetCommandStatus(write) == CANLight::CommandStatus::Pending);
+    CHECK(fakehal::LastSent(kID, data) == messages::ColorLoad::ArbitrationID(kID));
+    CHECK(data[0] == 1); // still the first write
+
+    CANLight::SetBusBudget(1.0);
+    WaitForPending(light);
+    CHECK(light.GetCommandStatus(color) == CANLight::CommandStatus::Delivered);
+    CHECK(light.GetCommandStatus(write) == CANLight::CommandStatus::Delivered);
+    CHECK(fakehal::LastSent(kID, data) == messages::ColorLoad::ArbitrationID(kID));
+    CHECK(data[0] == 2);
+}
+
+int main() {
+    fakehal::SetPresent(kID, true);
+    CANLight light(kID);
+    Utilization(light);
+    Stream(light);
+    Registers(light);
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+ * Many threads commanding CANLights at once, on the fake HAL.
+ *
+ * First each thread drives its own device, with 1 to 8 threads, and the
+ * command throughput is reported: sends block for a while, as on the
+ * robot, and since the command path shares no lock between devices the
+ * throughput should grow with the thread count. Then every thread
+ * drives the same device while also reading its metadata, voltage and the
+ * telemetry, with some sends failing, and the counters are checked.
+ * Last, single commands are followed by their sequence numbers while the
+ * bus budget holds them back and the device disconnects.
+ */
+
+#include "CANLight.h"
+#include "FakeHAL.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <thread>
+#include <vector>
+
+using namespace mindsensors;
+using Clock = std::chrono::steady_clock;
+
+static constexpr int kMaxThreads = 8;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+static double ThroughputWithThreads(std::vector<CANLight>& lights, int threadCount, std::chrono::milliseconds duration) {
+    std::atomic<bool> go{false}, stop{false};
+    std::atomic<uint64_t> total{0};
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < threadCount; t++) {
+        threads.emplace_back([&, t] {
+            CANLight& light = lights[t];
+            uint64_t count = 0;
+            while (!go) {}
+            while (!stop) {
+                light.ShowRGB(count & 0xFF, t, 0);
+                count++;
+            }
+            total += count;
+        });
+    }
+    auto start = Clock::now();
+    go = true;
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    for (auto& thread : threads) thread.join();
+    return total / std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void SharedDevice(CANLight& light) {
+    static constexpr int kCommandsPerThread = 2000;
+    CANLight::DeliveryReport before = light.GetDeliveryReport();
+    std::atomic<bool> metadataOk{true};
+    std::vector<std::thread> threads;
+
+    fakehal::FailNextSends(50);
+    for (int t = 0; t < kMaxThreads; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < kCommandsPerThread; i++) {
+                switch (i % 4) {
+                    case 0: light.ShowRGB(i & 0xFF, t, 0); break;
+                    case 1: light.WriteRegister(t % 8, 0.5, i & 0xFF, 0, t); break;
+                    case 2: light.Flash(t % 8); break;
+                    case 3: light.ShowRegister(t % 8); break;
+                }
+                if (i % 50 == 0) {
+                    if (light.GetDeviceName() != "CANLight" || light.GetFirmwareVersion() != "1.2") metadataOk = false;
+                    light.GetBatteryVoltage();
+                    CANLight::GetTelemetry();
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    CHECK(metadataOk);
+
+    // the monitor retries failed sends in the background
+    auto deadline = Clock::now() + std::chrono::seconds(2);
+    CANLight::DeliveryReport report = light.GetDeliveryReport();
+    while (report.pending != 0 && Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        report = light.GetDeliveryReport();
+    }
+    printf("shared device: issued %u delivered %u retries %u superseded %u dropped %u pending %u\n",
+           report.lastIssued - before.lastIssued, report.delivered - before.delivered, report.retries - before.retries,
+           report.superseded - before.superseded, report.dropped - before.dropped, report.pending);
+
+    uint32_t issued = report.lastIssued - before.lastIssued;
+    CHECK(issued == kMaxThreads * kCommandsPerThread);
+    CHECK(report.pending == 0);
+    CHECK(report.synchronized);
+    CHECK(report.retries - before.retries >= 1);
+    // every command is accounted for exactly once
+    CHECK(report.delivered - before.delivered + report.superseded - before.superseded + report.dropped - before.dropped == issued);
+}
+
+static bool WaitFor(const std::function<bool()>& condition, std::chrono::milliseconds timeout) {
+    auto deadline = Clock::now() + timeout;
+    while (!condition() && Clock::now() < deadline) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    return condition();
+}
+
+static void CommandStatuses(CANLight& light, uint8_t id) {
+    using Status = CANLight::CommandStatus;
+    uint32_t sent = light.ShowRGB(1, 0, 0);
+    CHECK(light.GetCommandStatus(sent) == Status::Delivered);
+    CHECK(light.GetCommandStatus(0) == Status::Unknown);
+    CHECK(light.GetCommandStatus(sent + 1) == Status::Unknown);
+
+    // less than one frame's worth: every color change is held back
+    CANLight::SetBusBudget(0.00001);
+    uint32_t replaced = light.ShowRGB(2, 0, 0);
+    uint32_t color = light.ShowRGB(3, 0, 0);
+    uint32_t write = light.WriteRegister(1, 0.5, 4, 5, 6);
+    CHECK(replaced == sent + 1 && color == sent + 2 && write == sent + 3);
+    CHECK(light.GetCommandStatus(replaced) == Status::Superseded);
+    CHECK(light.GetCommandStatus(color) == Status::Pending);
+    CHECK(light.GetCommandStatus(write) == Status::Pending); // behind the color
+
+    // a disconnected device keeps its queue instead of being sent to
+    fakehal::SetPresent(id, false);
+    CHECK(WaitFor([&] { return !light.IsPresent(); }, std::chrono::seconds(3)));
+    uint64_t frames = fakehal::SentFrames(id);
+    CANLight::SetBusBudget(1.0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    CHECK(fakehal::SentFrames(id) == frames);
+    CHECK(light.GetCommandStatus(color) == Status::Pending);
+    CHECK(light.GetDeliveryReport().pending == 2);
+    CHECK(light.ShowRGB(7, 0, 0) == 0); // disabled
+
+    fakehal::SetPresent(id, true);
+    CHECK(WaitFor([&] { return light.GetDeliveryReport().pending == 0; }, std::chrono::seconds(3)));
+    CHECK(light.GetCommandStatus(color) == Status::Delivered);
+    CHECK(light.GetCommandStatus(write) == Status::Delivered);
+    CHECK(light.GetCommandStatus(replaced) == Status::Superseded);
+
+    // a full queue gives up on its oldest command
+    CANLight::SetBusBudget(0.00001);
+    uint32_t dropped = light.ShowRGB(8, 0, 0);
+    for (uint8_t index = 0; index < 8; index++) light.WriteRegister(index, 0.5, index, 0, 0);
+    CHECK(light.GetCommandStatus(dropped) == Status::Dropped);
+
+    // only the last 16 losses are remembered
+    uint32_t first = light.ShowRGB(0, 0, 0);
+    for (int i = 0; i < 20; i++) light.ShowRGB(i, 0, 0);
+    CHECK(light.GetCommandStatus(first) == Status::Unknown);
+    CHECK(light.GetCommandStatus(light.GetDeliveryReport().lastIssued - 1) == Status::Superseded);
+    CANLight::SetBusBudget(1.0);
+    CHECK(WaitFor([&] { return light.GetDeliveryReport().pending == 0; }, std::chrono::seconds(2)));
+    CHECK(light.GetCommandStatus(light.GetDeliveryReport().lastIssued) == Status::Delivered);
+    printf("command statuses ok\n");
+}
+
+int main() {
+    std::vector<CANLight> lights;
+    for (uint8_t id = 1; id <= kMaxThreads; id++) {
+        fakehal::SetPresent(id, true);
+        lights.emplace_back(id);
+    }
+    fakehal::SetSendCost(std::chrono::microseconds(200));
+
+    double single = 0, best = 0;
+    for (int threads = 1; threads <= kMaxThreads; threads *= 2) {
+        double throughput = ThroughputWithThreads(lights, threads, std::chrono::milliseconds(300));
+        if (threads == 1) single = throughput;
+        best = std::max(best, throughput);
+        printf("%d thread(s), one device each: %9.0f commands/s (%.2fx)\n", threads, throughput, throughput / single);
+    }
+    // the sends overlap unless something serializes them: a shared lock
+    // held across the send would keep this near 1x
+    CHECK(best > single * 3);
+    for (auto& light : lights) CHECK(light.GetDeliveryReport().synchronized);
+
+    fakehal::SetSendCost(std::chrono::nanoseconds(0));
+    SharedDevice(lights[0]);
+    CommandStatuses(lights[1], 2);
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,227 @@
+/*
+ * Threads constructing and destroying CANLights with random device IDs from
+ * 1 to 63 through the C API, while sends fail now and then so that commands
+ * are still pending, and the monitor busy with the slot, when a handle is
+ * freed. The seed is printed; pass it as the first argument to repeat a run.
+ * Each Constructor and Destructor call is timed, and the call rate and the
+ * p50/p99 latencies are reported.
+ *
+ * Checked throughout:
+ *  - an ID has at most one owner at a time, and a failed construction says
+ *    so with NO_AVAILABLE_RESOURCES
+ *  - each owner's delivery report counts only that owner's commands, and
+ *    every command is delivered, superseded or dropped exactly once
+ *  - out of range IDs are refused
+ *  - an ID is available again right after its CANLight is destroyed
+ */
+
+#include "CANLightDriver.h"
+#include "FakeHAL.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr int kThreads = 8;
+static constexpr int kMaxDeviceID = 60; // 61 to 63 are picked too, and refused
+static constexpr auto kDuration = 3s;
+static constexpr uint32_t kCommands = 20;
+
+static std::atomic<int> owner[64];
+static std::atomic<int> constructed{0}, refused{0}, outOfRange{0}, drained{0};
+
+// per thread, so that timing a call takes no shared lock
+struct Latencies {
+    std::vector<Clock::duration> constructor, destructor;
+};
+static Latencies latencies[kThreads];
+
+static CANLight_DeliveryReport Report(CANLight_Handle handle) {
+    CANLight_DeliveryReport report;
+    int32_t status = 0;
+    CANLight_GetDeliveryReport(handle, &report, &status);
+    CHECK(status == 0);
+    return report;
+}
+
+static void Owner(int thread, unsigned seed) {
+    std::mt19937 random(seed + thread);
+    std::uniform_int_distribution<int> pickID(1, 63);
+    Latencies& latency = latencies[thread];
+    auto end = Clock::now() + kDuration;
+    for (int i = 0; Clock::now() < end; i++) {
+        int id = pickID(random);
+        int32_t status = 0;
+        auto start = Clock::now();
+        CANLight_Handle handle = CANLight_Constructor(id, &status);
+        latency.constructor.push_back(Clock::now() - start);
+        if (id > kMaxDeviceID) {
+            CHECK(handle == HAL_kInvalidHandle);
+            CHECK(status == PARAMETER_OUT_OF_RANGE);
+            outOfRange++;
+            continue;
+        }
+        if (handle == HAL_kInvalidHandle) {
+            CHECK(status == NO_AVAILABLE_RESOURCES);
+            refused++;
+            std::this_thread::sleep_for(50us);
+            continue;
+        }
+        CHECK(status == 0);
+        int none = 0;
+        CHECK(owner[id].compare_exchange_strong(none, thread + 1));
+        constructed++;
+
+        // a new owner starts from an empty slot, whatever the last one left behind
+        CANLight_DeliveryReport report = Report(handle);
+        CHECK(report.lastIssued == 0);
+        CHECK(report.delivered + report.superseded + report.dropped == 0);
+
+        fakehal::FailNextSends(4);
+        for (uint32_t c = 0; c < kCommands; c++) {
+            if (c % 2 == 0) CANLight_ShowRGB(handle, c, thread, id, &status);
+            else CANLight_WriteRegister(handle, c % 8, 10, c, thread, id, &status);
+            CHECK(status == 0);
+        }
+
+        // half the time leave commands pending for the monitor to retry
+        // after the handle is gone
+        if (i % 2 == 0) {
+            auto deadline = std::chrono::steady_clock::now() + 2s;
+            while (Report(handle).pending != 0 && std::chrono::steady_clock::now() < deadline) std::this_thread::sleep_for(5ms);
+            report = Report(handle);
+            CHECK(report.pending == 0);
+            CHECK(report.lastIssued == kCommands);
+            CHECK(report.delivered + report.superseded + report.dropped == kCommands);
+            drained++;
+        }
+
+        CHECK(owner[id].exchange(0) == thread + 1);
+        start = Clock::now();
+        CANLight_Destructor(handle);
+        latency.destructor.push_back(Clock::now() - start);
+    }
+}
+
+static void PrintLatency(const char* name, std::vector<Clock::duration> calls) {
+    CHECK(!calls.empty());
+    std::sort(calls.begin(), calls.end());
+    auto percentile = [&](double fraction) {
+        size_t index = std::min(calls.size() - 1, (size_t) (fraction * calls.size()));
+        return std::chrono::duration<double, std::micro>(calls[index]).count();
+    };
+    printf("%s: %zu calls, %.0f/s, p50 %.1fus, p99 %.1fus\n", name, calls.size(),
+           calls.size() / std::chrono::duration<double>(kDuration).count(), percentile(0.5), percentile(0.99));
+}
+
+static void SlowPresenceCallback(void*, uint8_t, HAL_Bool present) {
+    if (present) std::this_thread::sleep_for(300ms);
+}
+
+/*
+ * A CANLight destroyed while the monitor is part way through a pass, here
+ * stuck in a presence callback for another device, is still referenced by
+ * that pass until it ends. A new CANLight with the same ID must wait for the
+ * slot rather than have it reset under the pass.
+ */
+static void SlowMonitorPass() {
+    const int lateID = 10, id = 11;
+    fakehal::SetPresent(lateID, false);
+    int32_t status = 0;
+    CANLight_Handle late = CANLight_Constructor(lateID, &status); // not present: NotFound
+    CANLight_SetPresenceCallback(late, SlowPresenceCallback, nullptr, &status);
+    fakehal::SetPresent(id, true);
+    CANLight_Handle old = CANLight_Constructor(id, &status);
+    CHECK(status == 0);
+    fakehal::FailNextSends(2);
+    for (uint8_t i = 0; i < 4; i++) CANLight_WriteRegister(old, i, 10, 200, 0, 0, &status);
+    CHECK(Report(old).pending > 0);
+
+    fakehal::SetPresent(lateID, true); // the next pass blocks in the callback
+    std::this_thread::sleep_for(100ms);
+    CANLight_Destructor(old);
+
+    CANLight_Handle handle = CANLight_Constructor(id, &status);
+    CHECK(handle != HAL_kInvalidHandle);
+    fakehal::FailNextSends(1);
+    CANLight_WriteRegister(handle, 5, 10, 1, 2, 3, &status);
+    CANLight_WriteRegister(handle, 6, 10, 4, 5, 6, &status);
+
+    auto deadline = std::chrono::steady_clock::now() + 2s;
+    while (Report(handle).pending != 0 && std::chrono::steady_clock::now() < deadline) std::this_thread::sleep_for(5ms);
+    CANLight_DeliveryReport report = Report(handle);
+    printf("after a slow monitor pass: issued %u delivered %u superseded %u dropped %u pending %u\n",
+           report.lastIssued, report.delivered, report.superseded, report.dropped, report.pending);
+    CHECK(report.lastIssued == 2);
+    CHECK(report.pending == 0);
+    CHECK(report.delivered + report.superseded + report.dropped == 2);
+    // and what reached the device is the new owner's last command
+    uint8_t data[8];
+    CHECK(fakehal::LastSent(id, data) == mindsensors::messages::ColorLoad::ArbitrationID(id));
+    CHECK(data[0] == 6 && data[2] == 4 && data[3] == 5 && data[4] == 6);
+    CANLight_Destructor(handle);
+    CANLight_Destructor(late);
+}
+
+int main(int argc, char** argv) {
+    unsigned seed = argc > 1 ? (unsigned) strtoul(argv[1], nullptr, 0) : std::random_device{}();
+    printf("seed %u\n", seed);
+    for (int id = 1; id <= kMaxDeviceID; id++) fakehal::SetPresent(id, true);
+    fakehal::SetSendCost(200us);
+
+    for (int id : {-1, 0, 61, 64}) {
+        int32_t status = 0;
+        CHECK(CANLight_Constructor(id, &status) == HAL_kInvalidHandle);
+        CHECK(status == PARAMETER_OUT_OF_RANGE);
+    }
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) threads.emplace_back(Owner, t, seed);
+    for (auto& thread : threads) thread.join();
+    printf("constructed %d, refused %d, out of range %d, drained %d\n",
+           constructed.load(), refused.load(), outOfRange.load(), drained.load());
+    CHECK(constructed > 0 && refused > 0 && outOfRange > 0 && drained > 0);
+
+    std::vector<Clock::duration> constructors, destructors;
+    for (auto& latency : latencies) {
+        constructors.insert(constructors.end(), latency.constructor.begin(), latency.constructor.end());
+        destructors.insert(destructors.end(), latency.destructor.begin(), latency.destructor.end());
+    }
+    PrintLatency("CANLight_Constructor", constructors);
+    PrintLatency("CANLight_Destructor", destructors);
+
+    // the monitor's pass may still reference the destroyed CANLight's slot;
+    // the ID is taken again once it lets go, not refused
+    int id = 4;
+    for (int i = 0; i < 20; i++) {
+        int32_t status = 0;
+        CANLight_Handle handle = CANLight_Constructor(id, &status);
+        CHECK(handle != HAL_kInvalidHandle);
+        CHECK(Report(handle).lastIssued == 0);
+        fakehal::FailNextSends(1);
+        CANLight_ShowRGB(handle, 1, 2, 3, &status);
+        CHECK(Report(handle).pending == 1);
+        CANLight_Destructor(handle);
+    }
+
+    SlowMonitorPass();
+    printf("ok\n");
+    return 0;
+}
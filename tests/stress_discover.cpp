@@ -0,0 +1,87 @@
+/*
+ * Discover running while CANLights re-read their metadata and the monitor
+ * probes a device that has not answered yet. A reply can be read only once,
+ * so every reader must hold the device's fetch lock: each Discover has to
+ * see every connected device, and each metadata read has to succeed.
+ */
+
+#include "CANLight.h"
+#include "FakeHAL.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace mindsensors;
+using namespace std::chrono_literals;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+int main() {
+    std::vector<CANLight> lights;
+    for (uint8_t id = 1; id <= 4; id++) {
+        fakehal::SetPresent(id, true);
+        lights.emplace_back(id);
+    }
+    CANLight late(5); // not connected yet: the monitor asks for its name once a second
+    CHECK(!late.IsPresent());
+
+    std::atomic<bool> stop{false};
+    std::atomic<int> refreshes{0}, refreshFailures{0};
+    std::vector<std::thread> threads;
+    for (auto& light : lights) {
+        threads.emplace_back([&] {
+            while (!stop) {
+                try {
+                    light.RefreshInfo();
+                    refreshes++;
+                } catch (const std::runtime_error&) {
+                    refreshFailures++;
+                }
+            }
+        });
+    }
+
+    std::atomic<int> discoveries{0}, misses{0};
+    auto discover = [&](std::vector<uint8_t> expected) {
+        std::vector<uint8_t> found = CANLight::Discover(0.05);
+        discoveries++;
+        if (found != expected) misses++;
+    };
+    std::vector<std::thread> discoverers;
+    for (int t = 0; t < 2; t++) {
+        discoverers.emplace_back([&] {
+            for (int i = 0; i < 10; i++) discover({1, 2, 3, 4});
+        });
+    }
+    for (auto& thread : discoverers) thread.join();
+
+    // connect the late device while discoveries keep the monitor's probe waiting
+    fakehal::SetPresent(5, true);
+    for (int i = 0; i < 10; i++) discover({1, 2, 3, 4, 5});
+    stop = true;
+    for (auto& thread : threads) thread.join();
+
+    auto deadline = std::chrono::steady_clock::now() + 3s;
+    while (!late.IsPresent() && std::chrono::steady_clock::now() < deadline) std::this_thread::sleep_for(10ms);
+
+    printf("discoveries %d (missed a device: %d), metadata reads %d (failed: %d)\n",
+           discoveries.load(), misses.load(), refreshes.load(), refreshFailures.load());
+    CHECK(misses == 0);
+    CHECK(refreshFailures == 0);
+    CHECK(refreshes > 0);
+    CHECK(late.IsPresent());
+    CHECK(late.GetDeviceName() == "CANLight");
+    printf("ok\n");
+    return 0;
+}
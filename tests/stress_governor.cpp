@@ -0,0 +1,118 @@
+/*
+ * The battery governor, driven by the voltage in the fake device's status
+ * broadcasts.
+ *
+ *  - the level drops as soon as the voltage is below a threshold, straight
+ *    to critical if need be, and rises only once the voltage has recovered
+ *    past the threshold plus the hysteresis
+ *  - colors are dimmed for the level, and the current color is sent again
+ *    at the new brightness when the level changes
+ *  - at a reduced level color changes are limited to one per update period
+ */
+
+#include "CANLight.h"
+#include "CANLightMessages.h"
+#include "FakeHAL.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+using namespace mindsensors;
+using namespace std::chrono_literals;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+static const uint8_t kID = 45;
+
+static CANLight::Telemetry Telemetry() {
+    for (const CANLight::Telemetry& entry : CANLight::GetTelemetry()) {
+        if (entry.deviceID == kID) return entry;
+    }
+    CHECK(false);
+    return {};
+}
+
+// set the battery voltage and wait for the monitor to act on it
+static CANLight::Telemetry SetVoltage(double volts, uint8_t expectedLevel) {
+    fakehal::SetBatteryVoltage(volts);
+    auto deadline = std::chrono::steady_clock::now() + 2s;
+    while (Telemetry().governorLevel != expectedLevel && std::chrono::steady_clock::now() < deadline) std::this_thread::sleep_for(5ms);
+    std::this_thread::sleep_for(300ms); // and stays there for a few monitor passes
+    CANLight::Telemetry telemetry = Telemetry();
+    printf("%.1fV: level %u, %u transitions\n", volts, telemetry.governorLevel, telemetry.governorTransitions);
+    CHECK(telemetry.governorLevel == expectedLevel);
+    return telemetry;
+}
+
+// the color sent to the device, allowing for the governor's update period
+static void CheckShown(uint8_t red, uint8_t green, uint8_t blue) {
+    uint8_t data[8];
+    auto deadline = std::chrono::steady_clock::now() + 2s;
+    while (std::chrono::steady_clock::now() < deadline) {
+        fakehal::LastSent(kID, data);
+        if (data[1] == red && data[2] == green && data[3] == blue) break;
+        std::this_thread::sleep_for(5ms);
+    }
+    CHECK(fakehal::LastSent(kID, data) == messages::ColorSet::ArbitrationID(kID));
+    printf("  device shows %u %u %u\n", data[1], data[2], data[3]);
+    CHECK(data[1] == red && data[2] == green && data[3] == blue);
+}
+
+int main() {
+    fakehal::SetPresent(kID, true);
+    fakehal::SetBatteryVoltage(12);
+    CANLight light(kID);
+    CANLight::Governor governor;
+    governor.reducedVoltage = 11;
+    governor.reducedBrightness = 0.5;
+    governor.reducedUpdatePeriod = 0.1;
+    governor.criticalVoltage = 10;
+    governor.criticalBrightness = 0.25;
+    governor.criticalUpdatePeriod = 0.3;
+    governor.hysteresis = 0.5;
+    CANLight::EnableGovernor(governor);
+
+    CHECK(SetVoltage(12, 0).governorTransitions == 0);
+    CHECK(SetVoltage(10.8, 1).governorTransitions == 1);
+    light.ShowRGB(200, 100, 40);
+    CheckShown(100, 50, 20);
+
+    // above the threshold, but not past the hysteresis
+    CHECK(SetVoltage(11.3, 1).governorTransitions == 1);
+    CHECK(SetVoltage(11.6, 0).governorTransitions == 2);
+    CheckShown(200, 100, 40);
+
+    // both thresholds at once, then back up one level at a time
+    CHECK(SetVoltage(9.5, 2).governorTransitions == 3);
+    CheckShown(50, 25, 10);
+    CHECK(SetVoltage(10.3, 2).governorTransitions == 3);
+    CHECK(SetVoltage(10.6, 1).governorTransitions == 4);
+    CheckShown(100, 50, 20);
+    CHECK(SetVoltage(12, 0).governorTransitions == 5);
+
+    // as many color changes as the caller likes, at most one per 100ms sent
+    SetVoltage(10.8, 1);
+    uint64_t before = fakehal::SentFrames(kID);
+    auto start = std::chrono::steady_clock::now();
+    for (uint8_t i = 0; std::chrono::steady_clock::now() - start < 1s; i++) {
+        light.ShowRGB(i, 0, 0);
+        std::this_thread::sleep_for(1ms);
+    }
+    uint64_t sent = fakehal::SentFrames(kID) - before;
+    printf("%llu colors sent in 1s at the reduced level\n", (unsigned long long) sent);
+    CHECK(sent >= 5 && sent <= 12);
+
+    CANLight::DisableGovernor();
+    SetVoltage(10.8, 0);
+    fakehal::SetBatteryVoltage(11.5);
+    printf("ok\n");
+    return 0;
+}
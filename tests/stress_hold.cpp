@@ -0,0 +1,116 @@
+/*
+ * Hold mode hands the current color to the CAN layer to repeat. Whatever it
+ * was given must be stopped again, not left repeating after the program has
+ * let go of the CANLight.
+ *
+ *  - a new color replaces the repeating frame rather than adding another,
+ *    and its bus load is counted once
+ *  - destroying the last copy of a CANLight stops the repeating frame and
+ *    releases its bus load
+ *  - the same holds after threads have raced commands against changes of
+ *    the hold period
+ */
+
+#include "CANLight.h"
+#include "CANLightMessages.h"
+#include "mindsensorsDriver.h"
+#include "FakeHAL.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <optional>
+#include <thread>
+#include <vector>
+
+using namespace mindsensors;
+using namespace std::chrono_literals;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+// the utilization once one-off frames have left the 100ms window
+static double SettledUtilization() {
+    std::this_thread::sleep_for(150ms);
+    return CANLight::GetBusUtilization();
+}
+
+static void ReleaseOnDestroy() {
+    const uint8_t id = 30;
+    fakehal::SetPresent(id, true);
+    {
+        CANLight light(id);
+        light.SetHoldPeriod(0.05);
+        CHECK(fakehal::RepeatingFrames(id) == 0); // nothing to hold yet
+        light.ShowRGB(1, 2, 3);
+        CHECK(fakehal::RepeatingFrames(id) == 1);
+        uint8_t data[8];
+        CHECK(fakehal::LastSent(id, data) == messages::ColorSet::ArbitrationID(id));
+
+        for (uint8_t i = 0; i < 20; i++) light.ShowRGB(i, 0, 0);
+        CHECK(fakehal::RepeatingFrames(id) == 1);
+        light.ShowRegister(2);
+        CHECK(fakehal::RepeatingFrames(id) == 1);
+        CHECK(fakehal::LastSent(id, data) == messages::ColorShow::ArbitrationID(id));
+        double utilization = SettledUtilization();
+        double held = mindsensorsDriver::PeriodicBitsPerSecond(messages::ColorShow::kSize, 50) / 1e6;
+        printf("holding one color: %.4f of the bus, %.4f expected\n", utilization, held);
+        CHECK(utilization > held * 0.9 && utilization < held * 1.1);
+
+        CANLight copy = light; // the copy still owns the device after this one goes
+    }
+    CHECK(fakehal::RepeatingFrames(id) == 0);
+    CHECK(SettledUtilization() == 0);
+}
+
+static void ReleaseAfterRace() {
+    std::vector<std::optional<CANLight>> lights;
+    for (uint8_t id = 31; id <= 34; id++) {
+        fakehal::SetPresent(id, true);
+        lights.emplace_back(std::in_place, id);
+    }
+
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> threads;
+    for (auto& light : lights) {
+        threads.emplace_back([&, copy = *light] () mutable {
+            for (uint8_t i = 0; !stop; i++) {
+                if (i % 3 == 0) copy.ShowRegister(i % 8);
+                else copy.ShowRGB(i, 0, 0);
+            }
+        });
+        threads.emplace_back([&, copy = *light] () mutable {
+            for (int i = 0; !stop; i++) {
+                copy.SetHoldPeriod(i % 2 == 0 ? 0.02 : 0);
+                std::this_thread::sleep_for(100us);
+            }
+        });
+    }
+    std::this_thread::sleep_for(1s);
+    stop = true;
+    for (auto& thread : threads) thread.join();
+    threads.clear();
+
+    for (uint8_t id = 31; id <= 34; id++) CHECK(fakehal::RepeatingFrames(id) <= 1);
+    lights[0]->SetHoldPeriod(0.02);
+    lights[0]->ShowRGB(1, 1, 1); // one is certainly repeating when destroyed
+    CHECK(fakehal::RepeatingFrames(31) == 1);
+    lights.clear();
+    for (uint8_t id = 31; id <= 34; id++) CHECK(fakehal::RepeatingFrames(id) == 0);
+    double utilization = SettledUtilization();
+    printf("after the race: %.4f of the bus\n", utilization);
+    CHECK(utilization == 0);
+}
+
+int main() {
+    ReleaseOnDestroy();
+    ReleaseAfterRace();
+    printf("ok\n");
+    return 0;
+}
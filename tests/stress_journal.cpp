@@ -0,0 +1,99 @@
+/*
+ * Switching journals while threads command CANLights. Each journal maps its
+ * file; a replaced journal must be unmapped once nothing records to it, not
+ * kept until exit. The last journal is then replayed into a transport that
+ * counts what it is given.
+ */
+
+#include "CANLight.h"
+#include "CANJournal.h"
+#include "hal/CAN.h"
+#include "FakeHAL.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace mindsensors;
+using namespace std::chrono_literals;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+static const std::string kPrefix = "/tmp/stress_journal_";
+
+// journal files this process has mapped
+static int MappedJournals() {
+    std::ifstream maps("/proc/self/maps");
+    int count = 0;
+    for (std::string line; std::getline(maps, line);) {
+        if (line.find(kPrefix) != std::string::npos) count++;
+    }
+    return count;
+}
+
+class CountingTransport : public CANTransport {
+public:
+    void SendMessage(uint32_t messageID, const uint8_t*, uint8_t, int32_t periodMs, int32_t*) override {
+        if (periodMs == HAL_CAN_SEND_PERIOD_STOP_REPEATING) return;
+        uint8_t id = messageID & 0x3F;
+        if (id >= 1 && id <= 4) frames++;
+        else strays++;
+    }
+    void ReceiveMessage(uint32_t*, uint32_t, uint8_t*, uint8_t*, uint32_t*, int32_t* status) override {
+        *status = HAL_ERR_CANSessionMux_MessageNotFound;
+    }
+    size_t frames = 0, strays = 0;
+};
+
+int main() {
+    std::vector<CANLight> lights;
+    for (uint8_t id = 1; id <= 4; id++) {
+        fakehal::SetPresent(id, true);
+        lights.emplace_back(id);
+    }
+
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> threads;
+    for (auto& light : lights) {
+        threads.emplace_back([&] {
+            for (uint8_t i = 0; !stop; i++) {
+                light.ShowRGB(i, 0, 0);
+                light.GetBatteryVoltage();
+                std::this_thread::sleep_for(50us);
+            }
+        });
+    }
+
+    int swaps = 0;
+    for (auto end = std::chrono::steady_clock::now() + 1s; std::chrono::steady_clock::now() < end; swaps++) {
+        CANLight::StartJournal(kPrefix + std::to_string(swaps % 2), 4096);
+        CHECK(MappedJournals() == 1);
+        std::this_thread::sleep_for(2ms);
+    }
+    stop = true;
+    for (auto& thread : threads) thread.join();
+    CANLight::StopJournal();
+    CHECK(MappedJournals() == 0);
+
+    CountingTransport transport;
+    int32_t status = 0;
+    size_t replayed = CANJournal::Replay((kPrefix + std::to_string((swaps - 1) % 2)).c_str(), transport, true, 1e6, &status);
+    printf("%d journal swaps, %zu frames replayed from the last one\n", swaps, replayed);
+    CHECK(status == 0);
+    CHECK(replayed > 0 && transport.frames == replayed && transport.strays == 0);
+
+    for (int i = 0; i < 2; i++) std::remove((kPrefix + std::to_string(i)).c_str());
+    printf("ok\n");
+    return 0;
+}
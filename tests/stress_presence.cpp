@@ -0,0 +1,105 @@
+/*
+ * Presence callbacks and devices that connect late.
+ *
+ *  - a destroyed CANLight's callback is released, not kept for the ID, and
+ *    the next CANLight with that ID is not called with it
+ *  - copies share the device, which stays open until the last one goes
+ *  - reading a late device's metadata, slow here because it answers only
+ *    name requests, does not hold up the monitor's retries for the others
+ */
+
+#include "CANLight.h"
+#include "FakeHAL.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+using namespace mindsensors;
+using namespace std::chrono_literals;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+static bool WaitFor(const CANLight& light, bool present) {
+    auto deadline = std::chrono::steady_clock::now() + 3s;
+    while (light.IsPresent() != present && std::chrono::steady_clock::now() < deadline) std::this_thread::sleep_for(5ms);
+    return light.IsPresent() == present;
+}
+
+static void CallbackReleased() {
+    const uint8_t id = 30;
+    auto token = std::make_shared<int>(0);
+    std::atomic<int> oldCalls{0}, newCalls{0};
+    {
+        CANLight first(id); // not connected
+        CANLight copy = first;
+        copy.SetPresenceCallback([token, &oldCalls](bool) { oldCalls++; });
+        CHECK(token.use_count() == 2);
+    }
+    CHECK(token.use_count() == 1); // released with the last copy
+
+    CANLight second(id);
+    fakehal::SetPresent(id, true);
+    CHECK(WaitFor(second, true));
+    second.SetPresenceCallback([&newCalls](bool present) { if (!present) newCalls++; });
+    fakehal::SetPresent(id, false);
+    CHECK(WaitFor(second, false));
+    std::this_thread::sleep_for(50ms); // the callback follows the state change
+    printf("old callback calls %d, new callback calls %d\n", oldCalls.load(), newCalls.load());
+    CHECK(oldCalls == 0);
+    CHECK(newCalls == 1);
+
+    {
+        CANLight copy = second;
+    }
+    second.ShowRGB(1, 2, 3); // still open
+    bool refused = false;
+    try {
+        CANLight duplicate(id);
+    } catch (const std::runtime_error&) {
+        refused = true;
+    }
+    CHECK(refused);
+}
+
+static void SlowMetadata() {
+    const uint8_t busy = 40, late = 41;
+    fakehal::SetPresent(busy, true);
+    CANLight light(busy);
+    CANLight slow(late);
+    fakehal::SetNameOnly(late, true);
+    fakehal::SetPresent(late, true);
+
+    // each command fails once and is left for the monitor to retry
+    auto worst = 0ms;
+    auto end = std::chrono::steady_clock::now() + 2500ms;
+    int commands = 0;
+    while (std::chrono::steady_clock::now() < end) {
+        fakehal::FailNextSends(1);
+        light.ShowRGB(commands++, 0, 0);
+        auto sent = std::chrono::steady_clock::now();
+        while (light.GetDeliveryReport().pending != 0) std::this_thread::sleep_for(1ms);
+        worst = std::max(worst, std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - sent));
+    }
+    printf("%d retried commands, slowest retry %lldms, late device present: %d\n", commands, (long long) worst.count(), slow.IsPresent());
+    CHECK(slow.IsPresent());
+    CHECK(worst < 150ms); // reading the late device's metadata takes 200ms
+}
+
+int main() {
+    CallbackReleased();
+    SlowMetadata();
+    printf("ok\n");
+    return 0;
+}
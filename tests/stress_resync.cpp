@@ -0,0 +1,158 @@
+/*
+ * Devices that reset, seen as a gap in their status broadcasts, get their
+ * registers and mode replayed.
+ *
+ *  - a brief disconnect is detected and the shadowed state is sent again,
+ *    registers first and the mode last
+ *  - a replay racing with new commands never leaves the device showing an
+ *    older color than the last one commanded
+ *  - the replay stays within the bus budget, and waits for the battery
+ *    governor's update period like any color change
+ */
+
+#include "CANLight.h"
+#include "CANLightMessages.h"
+#include "FakeHAL.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+using namespace mindsensors;
+using namespace std::chrono_literals;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+// longer than the reset gap the monitor looks for, shorter than a disconnect
+static void Reset(uint8_t id) {
+    fakehal::SetPresent(id, false);
+    std::this_thread::sleep_for(400ms);
+    fakehal::SetPresent(id, true);
+}
+
+// wait until no frame has been sent to the device for a while; returns how many were
+static uint64_t Settle(uint8_t id, uint64_t before) {
+    uint64_t count = fakehal::SentFrames(id);
+    for (int quiet = 0; quiet < 20;) {
+        std::this_thread::sleep_for(10ms);
+        uint64_t now = fakehal::SentFrames(id);
+        quiet = now == count ? quiet + 1 : 0;
+        count = now;
+    }
+    return count - before;
+}
+
+static void Replay() {
+    const uint8_t id = 50;
+    fakehal::SetPresent(id, true);
+    CANLight light(id);
+    light.WriteRegister(2, 0.1, 10, 20, 30);
+    light.WriteRegister(5, 0.1, 40, 50, 60);
+    light.ShowRGB(1, 2, 3);
+    uint64_t before = Settle(id, 0);
+
+    Reset(id);
+    uint64_t replayed = Settle(id, before);
+    printf("replayed %llu frames after a reset\n", (unsigned long long) replayed);
+    CHECK(replayed == 3);
+    uint8_t data[8];
+    CHECK(fakehal::LastSent(id, data) == messages::ColorSet::ArbitrationID(id));
+    CHECK(data[1] == 1 && data[2] == 2 && data[3] == 3);
+}
+
+static void ReplayRace() {
+    const uint8_t id = 51;
+    fakehal::SetPresent(id, true);
+    fakehal::SetSendCost(300us); // widen the window between reading the shadow and sending
+    CANLight light(id);
+    light.WriteRegister(0, 0.1, 1, 1, 1);
+
+    std::atomic<bool> stop{false};
+    std::atomic<uint8_t> last{0};
+    std::thread commands([&] {
+        for (uint8_t i = 1; !stop; i = i % 250 + 1) {
+            light.ShowRGB(i, 0, 0);
+            last = i;
+            std::this_thread::sleep_for(200us);
+        }
+    });
+    for (int i = 0; i < 8; i++) {
+        Reset(id);
+        std::this_thread::sleep_for(30ms); // let the monitor notice while commands keep coming
+    }
+    stop = true;
+    commands.join();
+    Settle(id, 0);
+    fakehal::SetSendCost(0ns);
+
+    uint8_t data[8];
+    CHECK(fakehal::LastSent(id, data) == messages::ColorSet::ArbitrationID(id));
+    printf("last commanded red %u, device shows %u\n", last.load(), data[1]);
+    CHECK(data[1] == last);
+}
+
+static void ReplayBudget() {
+    const uint8_t id = 52;
+    fakehal::SetPresent(id, true);
+    CANLight light(id);
+    for (uint8_t index = 0; index < 8; index++) light.WriteRegister(index, 0.1, index, index, index);
+    light.ShowRegister(0);
+    uint64_t before = Settle(id, 0);
+
+    // about three register frames per 100ms window
+    CANLight::SetBusBudget(0.005);
+    Reset(id);
+    auto start = std::chrono::steady_clock::now();
+    uint64_t early = 0;
+    while (std::chrono::steady_clock::now() - start < 1s) {
+        std::this_thread::sleep_for(5ms);
+        if (std::chrono::steady_clock::now() - start < 100ms) early = fakehal::SentFrames(id) - before;
+    }
+    uint64_t replayed = Settle(id, before);
+    CANLight::SetBusBudget(1.0);
+    printf("replayed %llu frames under the bus budget, %llu in the first 100ms\n", (unsigned long long) replayed, (unsigned long long) early);
+    CHECK(replayed == 9);
+    CHECK(early <= 4);
+}
+
+static void ReplayGovernor() {
+    const uint8_t id = 53;
+    fakehal::SetPresent(id, true);
+    CANLight light(id);
+    CANLight::Governor governor;
+    governor.reducedVoltage = 12; // the fake battery reads 11.5V
+    governor.reducedUpdatePeriod = 1.5;
+    CANLight::EnableGovernor(governor);
+    while (light.GetDeliveryReport().throttled == 0) {
+        light.ShowRGB(100, 100, 100); // until the governor has kicked in and holds one back
+        std::this_thread::sleep_for(20ms);
+    }
+    while (light.GetDeliveryReport().pending != 0) std::this_thread::sleep_for(1ms);
+    auto sent = std::chrono::steady_clock::now(); // the held back color just went out
+    uint64_t before = fakehal::SentFrames(id);
+
+    Reset(id);
+    while (fakehal::SentFrames(id) == before) std::this_thread::sleep_for(1ms);
+    auto waited = std::chrono::steady_clock::now() - sent;
+    CANLight::DisableGovernor();
+    printf("replayed the mode %lldms after the last color change\n",
+           (long long) std::chrono::duration_cast<std::chrono::milliseconds>(waited).count());
+    CHECK(waited >= 1300ms);
+}
+
+int main() {
+    Replay();
+    ReplayRace();
+    ReplayBudget();
+    ReplayGovernor();
+    printf("ok\n");
+    return 0;
+}
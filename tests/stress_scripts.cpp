@@ -0,0 +1,138 @@
+/*
+ * Until conditions that call back into the LightScript executor, while other
+ * threads start and cancel scripts. Conditions are checked with the
+ * executor's lock released, so none of this may deadlock; a watchdog fails
+ * the test if it does. Then Delivered is checked to wait for the device's
+ * status broadcast, not just the send.
+ */
+
+#include "LightScript.h"
+#include "LightSequence.h"
+#include "FakeHAL.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace mindsensors;
+using namespace std::chrono_literals;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+static std::atomic<int> finished{0};
+
+static LightScript Blink(CANLight light, int steps) {
+    for (int i = 0; i < steps; i++) {
+        light.ShowRGB(i & 0xFF, 0, 0);
+        co_await NextTick();
+    }
+    finished++;
+}
+
+// waits on a condition that starts a script for another device, queries the
+// executor and, on the fifth check, cancels its own script
+static LightScript Meddler(CANLight light, CANLight other, std::shared_ptr<std::atomic<int>> self) {
+    auto& executor = LightScriptExecutor::GetInstance();
+    int checks = 0;
+    // built before the co_await: see Until about GCC 12 and captured CANLights
+    std::function<bool()> condition = [&, light, other] {
+        executor.Start(other.GetDeviceID(), Blink(other, 3));
+        executor.IsRunning(*self);
+        if (++checks == 5) executor.Cancel(*self);
+        return false;
+    };
+    co_await Until(std::move(condition));
+    light.ShowRGB(255, 255, 255); // never reached
+    CHECK(false);
+}
+
+static LightScript ShowAndConfirm(CANLight light, std::atomic<bool>* done) {
+    light.ShowRGB(1, 2, 3);
+    co_await Delivered(light);
+    *done = true;
+}
+
+// the fake sends fine to an absent device, which never broadcasts its status
+static void DeliveredWaitsForStatus() {
+    const uint8_t id = 20;
+    fakehal::SetPresent(id, true);
+    CANLight light(id);
+    fakehal::SetPresent(id, false);
+    std::atomic<bool> done{false};
+    LightScriptExecutor::GetInstance().Start(id, ShowAndConfirm(light, &done));
+
+    std::this_thread::sleep_for(150ms); // well within the presence timeout
+    CANLight::DeliveryReport report = light.GetDeliveryReport();
+    CHECK(report.synchronized && !report.acknowledged);
+    CHECK(!done);
+
+    fakehal::SetPresent(id, true);
+    auto deadline = std::chrono::steady_clock::now() + 1s;
+    while (!done && std::chrono::steady_clock::now() < deadline) std::this_thread::sleep_for(5ms);
+    CHECK(done);
+    CHECK(light.GetDeliveryReport().acknowledged);
+}
+
+int main() {
+    alarm(60);
+    auto& executor = LightScriptExecutor::GetInstance();
+    std::vector<CANLight> lights;
+    for (uint8_t id = 1; id <= 8; id++) {
+        fakehal::SetPresent(id, true);
+        lights.emplace_back(id);
+    }
+
+    std::vector<std::shared_ptr<std::atomic<int>>> meddlers;
+    for (int i = 0; i < 4; i++) {
+        auto self = std::make_shared<std::atomic<int>>(0);
+        *self = executor.Start(0, Meddler(lights[i], lights[4 + i], self));
+        meddlers.push_back(self);
+    }
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < 500; i++) {
+                int handle = executor.Start(lights[t].GetDeviceID(), Blink(lights[t], 5));
+                if (i % 3 == 0) executor.Cancel(handle);
+                if (i % 7 == 0) executor.CancelDevice(lights[4 + t].GetDeviceID());
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+
+    // the meddlers cancel themselves after five condition checks, 10ms apart
+    auto deadline = std::chrono::steady_clock::now() + 5s;
+    auto anyRunning = [&] {
+        for (auto& self : meddlers) {
+            if (executor.IsRunning(*self)) return true;
+        }
+        return false;
+    };
+    while (anyRunning() && std::chrono::steady_clock::now() < deadline) std::this_thread::sleep_for(10ms);
+    CHECK(!anyRunning());
+    printf("scripts finished: %d\n", finished.load());
+    DeliveredWaitsForStatus();
+
+    LightSequence sequence;
+    sequence.Flash(7);
+    try { sequence.Flash(8); CHECK(false); } catch (const std::out_of_range&) {}
+    try { sequence.ShowRegister(8); CHECK(false); } catch (const std::out_of_range&) {}
+    try { sequence.Cycle(0, 8); CHECK(false); } catch (const std::out_of_range&) {}
+    try { sequence.Fade(9, 0); CHECK(false); } catch (const std::out_of_range&) {}
+
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * Replacing the CAN transport while threads keep commanding CANLights. A
+ * replaced transport must be released once no send is using it, not kept
+ * until exit, and no send may reach a transport after it was released.
+ */
+
+#include "CANLightDriver.h"
+#include "FakeHAL.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using namespace mindsensors;
+using namespace std::chrono_literals;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            exit(1); \
+        } \
+    } while (0)
+
+static std::atomic<int> live{0};
+static std::atomic<uint64_t> sends{0};
+
+// forwards to the (fake) HAL, so the devices stay connected
+class CountingTransport : public HALCANTransport {
+public:
+    CountingTransport() { live++; }
+    ~CountingTransport() override {
+        m_alive = false;
+        live--;
+    }
+
+    void SendMessage(uint32_t messageID, const uint8_t* data, uint8_t dataSize, int32_t periodMs, int32_t* status) override {
+        CHECK(m_alive);
+        std::this_thread::sleep_for(20us); // keep sends in flight across swaps
+        sends++;
+        HALCANTransport::SendMessage(messageID, data, dataSize, periodMs, status);
+    }
+    void ReceiveMessage(uint32_t* messageID, uint32_t messageIDMask, uint8_t* data, uint8_t* dataSize, uint32_t* timeStamp, int32_t* status) override {
+        CHECK(m_alive);
+        HALCANTransport::ReceiveMessage(messageID, messageIDMask, data, dataSize, timeStamp, status);
+    }
+
+private:
+    std::atomic<bool> m_alive{true};
+};
+
+int main() {
+    std::vector<CANLight_Handle> handles;
+    for (uint8_t id = 1; id <= 4; id++) {
+        fakehal::SetPresent(id, true);
+        int32_t status = 0;
+        handles.push_back(CANLight_Constructor(id, &status));
+        CHECK(status == 0);
+    }
+
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> threads;
+    for (CANLight_Handle handle : handles) {
+        threads.emplace_back([&, handle] {
+            for (uint8_t i = 0; !stop; i++) {
+                int32_t status = 0;
+                CANLight_ShowRGB(handle, i, 0, 0, &status);
+                CANLight_GetBatteryVoltage(handle, &status);
+            }
+        });
+    }
+
+    int swaps = 0;
+    for (auto end = std::chrono::steady_clock::now() + 2s; std::chrono::steady_clock::now() < end; swaps++) {
+        mindsensorsDriver::SetTransport(std::make_shared<CountingTransport>());
+        CHECK(live == 1); // the one just installed; the previous one is gone
+        std::this_thread::sleep_for(1ms);
+    }
+    mindsensorsDriver::SetTransport(nullptr);
+    CHECK(live == 0);
+    stop = true;
+    for (auto& thread : threads) thread.join();
+
+    printf("%d transport swaps, %llu sends through them\n", swaps, (unsigned long long) sends.load());
+    CHECK(swaps > 100 && sends > 0);
+    printf("ok\n");
+    return 0;
+}